@@ -7,13 +7,49 @@ public class XZInputStream {
 
 	private long m_length; // uncompressed length
 
-	private native void openFile(String filename) throws IOException;
+	private native void openFile(String filename, int flags) throws IOException;
 	private native void closeFile() throws IOException;
 
 	public native void readInt(long offset, int[] buffer, int start, int length) throws IOException;
+	/** hint that the byte range will be read soon: decodes it in the background */
+	public native void prefetch(long offset, long length);
+
+	/** release idle decoder states and memory */
+	public static final int TRIM_IDLE = 1;
+	/** also drop the older half of the decoded blocks cache */
+	public static final int TRIM_CACHE = 2;
+	/** also empty the decoded blocks cache */
+	public static final int TRIM_ALL = 3;
+
+	/** release native memory of all open files, see TRIM_* (e.g. from onTrimMemory()) */
+	public static native void trimMemory(int level);
+	/** limit for the native memory of all open files in bytes (0: no limit) */
+	public static native void setMemoryLimit(long limit);
+
+	/** allocate decoder dictionaries and large decoded blocks with normal pages (default) */
+	public static final int HUGE_PAGES_OFF = 0;
+	/** use transparent huge pages (madvise) for them; can increase resident memory and page fault latency */
+	public static final int HUGE_PAGES_TRANSPARENT = 1;
+	/** use reserved huge pages (MAP_HUGETLB) for them if available, transparent huge pages otherwise */
+	public static final int HUGE_PAGES_EXPLICIT = 2;
+
+	/** page type for new decoder allocations, see HUGE_PAGES_* */
+	public static native void setHugePages(int mode);
+
+	/** read the complete archive into the page cache when opening it */
+	public static final int OPEN_PRELOAD = 1;
+	/** also lock it into RAM (if RLIMIT_MEMLOCK allows it) */
+	public static final int OPEN_LOCK = 2;
+	/** read the complete archive into native memory instead of mapping it */
+	public static final int OPEN_IN_MEMORY = 4;
 
 	public XZInputStream(String filename) throws IOException {
-		openFile(filename);
+		this(filename, 0);
+	}
+
+	/** flags (OPEN_*) only apply if the archive isn't open already */
+	public XZInputStream(String filename, int flags) throws IOException {
+		openFile(filename, flags);
 	}
 
 	protected void finalize() throws Throwable {
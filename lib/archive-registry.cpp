@@ -0,0 +1,141 @@
+#include "archive-registry.h"
+
+#include "idx-defl-file.h"
+#include "xz-file.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static void errnoFnameToSt(const char *prefix, const char *filename, std::string &error) {
+	error.assign(prefix);
+	error.push_back(' ');
+	error.append(filename);
+	error.push_back(':');
+	error.append(strerror(errno));
+}
+
+/* open the archive through osfile (out), which is set even if parsing the archive fails (unless IN_MEMORY is used) */
+static File openArchiveFile(const char *filename, int flags, std::shared_ptr<NormalFile> &osfile /* out */, std::string &error /* out */) {
+	static const unsigned char idxdefl_magic_header[8] = "idxdefl";
+	unsigned char magic_header[sizeof(idxdefl_magic_header)];
+
+	File plain;
+	if (0 != (flags & ArchiveRegistry::IN_MEMORY)) {
+		std::shared_ptr<MemoryFile> memfile(new MemoryFile(filename, error));
+		if (!memfile->valid()) return File();
+		plain = memfile;
+	} else {
+		osfile.reset(new MMappedFile(filename, error, flags & (MMappedFile::PRELOAD | MMappedFile::LOCK)));
+		if (!osfile->valid()) return File();
+		plain = osfile;
+	}
+
+	FileReaderState *state = nullptr;
+	bool result = plain->readInto(state, 0, sizeof(idxdefl_magic_header), magic_header, error);
+	plain->finish(state);
+	if (!result) return File();
+
+	std::string sidecarFilename(filename);
+	sidecarFilename.append(".sidx");
+
+	/* the last header byte is the idxdefl format version */
+	if (0 == memcmp(idxdefl_magic_header, magic_header, sizeof(idxdefl_magic_header) - 1)) {
+		std::shared_ptr<IndexedDeflateFile> idxdeflfile(new IndexedDeflateFile(plain, sidecarFilename.c_str(), error));
+		if (!idxdeflfile->valid()) return File();
+		return idxdeflfile;
+	} else {
+		std::shared_ptr<XZFile> xzfile(new XZFile(plain, sidecarFilename.c_str(), error));
+		if (!xzfile->valid()) return File();
+		return xzfile;
+	}
+}
+
+ArchiveRegistry::ArchiveRegistry() {
+}
+
+ArchiveRegistry& ArchiveRegistry::instance() {
+	/* never destroyed: archives in static objects might be closed during exit */
+	static ArchiveRegistry *registry = new ArchiveRegistry();
+	return *registry;
+}
+
+void ArchiveRegistry::sweep() {
+	for (auto it = m_entries.begin(); it != m_entries.end(); ) {
+		/* nobody else can get the entry while we hold m_mutex, so nobody is opening it either */
+		if (1 == it->second.use_count() && it->second->file.expired()) {
+			it = m_entries.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+File ArchiveRegistry::open(const char *filename, std::string &error /* out */, int flags) {
+	struct stat st;
+	if (-1 == ::stat(filename, &st)) {
+		errnoFnameToSt("Couldn't stat file", filename, error);
+		return File();
+	}
+	/* whole seconds would miss a file replaced (with the same size) within the same second */
+	Key key = { (uint64_t) st.st_dev, (uint64_t) st.st_ino, NormalFile::statMtimeNsec(st), (int64_t) st.st_size };
+
+	std::shared_ptr<Entry> entry;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(key);
+		if (m_entries.end() == it) {
+			sweep();
+			it = m_entries.emplace(key, std::make_shared<Entry>()).first;
+		}
+		entry = it->second;
+	}
+
+	std::lock_guard<std::mutex> lock(entry->mutex);
+	File file = entry->file.lock();
+	if (file) return file;
+
+	std::shared_ptr<NormalFile> osfile;
+	file = openArchiveFile(filename, flags, osfile, error);
+	if (!file) return file;
+
+	/* only share it if the file wasn't replaced after the stat() above (a MemoryFile has no
+	 * descriptor to check: stat() again after reading it) */
+	Key opened = key;
+	if (osfile) {
+		opened.device = osfile->device();
+		opened.inode = osfile->inode();
+		opened.mtime = osfile->mtimeNsec();
+		opened.size = osfile->filesize();
+	} else if (-1 != ::stat(filename, &st)) {
+		opened.device = (uint64_t) st.st_dev;
+		opened.inode = (uint64_t) st.st_ino;
+		opened.mtime = NormalFile::statMtimeNsec(st);
+		opened.size = (int64_t) st.st_size;
+	} else {
+		opened.size = -1;
+	}
+	if (opened == key) entry->file = file;
+	return file;
+}
+
+size_t ArchiveRegistry::openArchives() {
+	std::vector<std::shared_ptr<Entry>> entries;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto &entry : m_entries) entries.push_back(entry.second);
+	}
+
+	/* entries being opened are locked for a while; don't block open() meanwhile */
+	size_t count = 0;
+	for (std::shared_ptr<Entry> &entry : entries) {
+		std::lock_guard<std::mutex> lock(entry->mutex);
+		if (!entry->file.expired()) ++count;
+	}
+	return count;
+}
+
+File ArchiveRegistry::openArchive(const char *filename, std::string &error /* out */, int flags) {
+	std::shared_ptr<NormalFile> osfile;
+	return openArchiveFile(filename, flags, osfile, error);
+}
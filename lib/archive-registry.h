@@ -0,0 +1,83 @@
+#ifndef __MY_ARCHIVE_REGISTRY_H
+#define __MY_ARCHIVE_REGISTRY_H __MY_ARCHIVE_REGISTRY_H
+
+#include "file.h"
+
+#include <unordered_map>
+
+/**
+ * process wide registry of open archives (xz or idxdefl), keyed by the identity of the
+ * archive file (device, inode, mtime and size).
+ *
+ * opening an archive that is already open returns the same File, so all users share one
+ * file descriptor (and mapping), one parsed index, the warm reader states and the cached
+ * blocks; this only costs a stat() and a lookup. a replaced or modified archive gets a new key
+ * and is opened again.
+ *
+ * the registry only keeps weak references: an archive is closed when the last user drops it.
+ * thread safe; concurrent first opens of the same archive parse the index only once.
+ */
+class ArchiveRegistry {
+private:
+	ArchiveRegistry(const ArchiveRegistry &);
+	ArchiveRegistry& operator=(const ArchiveRegistry &);
+
+	struct Key {
+		uint64_t device, inode;
+		int64_t mtime, size; /** mtime in nanoseconds */
+		bool operator==(const Key &other) const {
+			return device == other.device && inode == other.inode && mtime == other.mtime && size == other.size;
+		}
+	};
+
+	struct KeyHash {
+		size_t operator()(const Key &key) const {
+			uint64_t h = key.inode * 0x9E3779B97F4A7C15ull ^ key.device;
+			h ^= (uint64_t) key.mtime * 0xBF58476D1CE4E5B9ull ^ (uint64_t) key.size;
+			h ^= h >> 31;
+			return (size_t) h;
+		}
+	};
+
+	/* an open (or opening) archive; mutex serializes opening it */
+	struct Entry {
+		std::mutex mutex;
+		std::weak_ptr<IFile> file;
+	};
+
+	std::mutex m_mutex;
+	std::unordered_map<Key, std::shared_ptr<Entry>, KeyHash> m_entries;
+
+	/* drop entries of closed archives; needs m_mutex */
+	void sweep();
+
+public:
+	enum Flags {
+		/** map the archive with MMappedFile::PRELOAD */
+		PRELOAD = MMappedFile::PRELOAD,
+		/** map the archive with MMappedFile::LOCK (implies PRELOAD) */
+		LOCK = MMappedFile::LOCK,
+		/** read the complete archive into a MemoryFile instead of mapping it (it has no mtime, so sidecars written for the file don't match) */
+		IN_MEMORY = 4,
+	};
+
+	ArchiveRegistry();
+
+	/** the process wide registry */
+	static ArchiveRegistry& instance();
+
+	/**
+	 * return the open archive or open it: detects the format from the magic bytes and
+	 * uses a sidecar index (filename + ".sidx") if one matches. returns an empty File on error.
+	 * flags (see Flags) are only used if the archive isn't open yet.
+	 */
+	File open(const char *filename, std::string &error /* out */, int flags = 0);
+
+	/** number of archives currently open through the registry */
+	size_t openArchives();
+
+	/** open an archive without the registry (see open()) */
+	static File openArchive(const char *filename, std::string &error /* out */, int flags = 0);
+};
+
+#endif
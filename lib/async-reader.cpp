@@ -0,0 +1,122 @@
+#include "async-reader.h"
+
+/********************************************************************************
+ *                                                                              *
+ *                                  AsyncRead                                   *
+ *                                                                              *
+ ********************************************************************************/
+
+AsyncRead::AsyncRead(int64_t offset, ssize_t length, unsigned char *data, Callback callback)
+: m_offset(offset), m_length(length), m_data(data), m_callback(callback), m_status(PENDING), m_success(false) {
+	m_future = m_promise.get_future().share();
+}
+
+bool AsyncRead::cancel() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (PENDING != m_status) return false;
+		m_status = CANCELLED;
+	}
+	complete(false, "Request cancelled");
+	return true;
+}
+
+bool AsyncRead::done() {
+	return std::future_status::ready == m_future.wait_for(std::chrono::seconds(0));
+}
+
+bool AsyncRead::wait() {
+	return m_future.get();
+}
+
+bool AsyncRead::success() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_success;
+}
+
+bool AsyncRead::cancelled() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return CANCELLED == m_status;
+}
+
+std::string AsyncRead::error() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_error;
+}
+
+bool AsyncRead::start() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (PENDING != m_status) return false;
+	m_status = RUNNING;
+	return true;
+}
+
+void AsyncRead::complete(bool success, const std::string &error) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (RUNNING == m_status) m_status = DONE;
+		m_success = success;
+		m_error = error;
+	}
+	if (m_callback) m_callback(success, error);
+	m_promise.set_value(success);
+}
+
+/********************************************************************************
+ *                                                                              *
+ *                                 AsyncReader                                  *
+ *                                                                              *
+ ********************************************************************************/
+
+AsyncReader::AsyncReader(File file, unsigned int threads)
+: m_shared(std::make_shared<Shared>()), m_pool(&WorkerPool::instance()) {
+	if (0 != threads) {
+		m_ownPool.reset(new WorkerPool(threads));
+		m_pool = m_ownPool.get();
+	}
+	m_shared->file = file;
+	m_shared->states.resize(m_pool->threads(), nullptr);
+}
+
+AsyncReader::~AsyncReader() {
+	std::list<AsyncReadPtr> outstanding;
+	{
+		std::lock_guard<std::mutex> lock(m_shared->mutex);
+		outstanding = m_shared->outstanding;
+	}
+	for (AsyncReadPtr &request : outstanding) request->cancel();
+
+	/* wait for running requests before the states are released; the remaining
+	 * (cancelled) tasks don't touch the states anymore */
+	for (AsyncReadPtr &request : outstanding) request->m_future.wait();
+
+	for (FileReaderState* &state : m_shared->states) {
+		if (nullptr != state) m_shared->file->finish(state);
+	}
+}
+
+AsyncReadPtr AsyncReader::readAsync(int64_t offset, ssize_t length, unsigned char *data, int priority, AsyncRead::Callback callback) {
+	AsyncReadPtr request(new AsyncRead(offset, length, data, callback));
+
+	std::list<AsyncReadPtr>::iterator it;
+	{
+		std::lock_guard<std::mutex> lock(m_shared->mutex);
+		it = m_shared->outstanding.insert(m_shared->outstanding.end(), request);
+	}
+
+	std::shared_ptr<Shared> shared(m_shared);
+	m_pool->submit([shared, request, it](unsigned int worker) { process(shared, request, it, worker); }, priority);
+
+	return request;
+}
+
+void AsyncReader::process(const std::shared_ptr<Shared> &shared, AsyncReadPtr request, std::list<AsyncReadPtr>::iterator outstandingIt, unsigned int worker) {
+	if (request->start()) {
+		std::string error;
+		bool success = shared->file->readInto(shared->states[worker], request->m_offset, request->m_length, request->m_data, error);
+		request->complete(success, error);
+	}
+
+	std::lock_guard<std::mutex> lock(shared->mutex);
+	shared->outstanding.erase(outstandingIt);
+}
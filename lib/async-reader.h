@@ -0,0 +1,116 @@
+#ifndef __MY_ASYNC_READER_H
+#define __MY_ASYNC_READER_H __MY_ASYNC_READER_H
+
+#include "file.h"
+#include "worker-pool.h"
+
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+
+class AsyncReader;
+
+/**
+ * handle for a request submitted with AsyncReader::readAsync
+ */
+class AsyncRead {
+private:
+	AsyncRead(const AsyncRead &);
+	AsyncRead& operator=(const AsyncRead &);
+
+	friend class AsyncReader;
+
+public:
+	typedef std::function<void(bool success, const std::string &error)> Callback;
+
+	AsyncRead(int64_t offset, ssize_t length, unsigned char *data, Callback callback);
+
+	/**
+	 * cancel the request if it hasn't been started yet; returns true if it was cancelled
+	 * (the request then completes with an error and the destination is not touched)
+	 */
+	bool cancel();
+
+	/** whether the request is completed (successfully, failed or cancelled) */
+	bool done();
+	/** wait for completion and return whether it was successful */
+	bool wait();
+	/** the result as future; true on success */
+	std::shared_future<bool> future() { return m_future; }
+
+	/** only valid after completion */
+	bool success();
+	bool cancelled();
+	/** only valid after completion */
+	std::string error();
+
+private:
+	enum Status { PENDING, RUNNING, DONE, CANCELLED };
+
+	int64_t m_offset;
+	ssize_t m_length;
+	unsigned char *m_data;
+	Callback m_callback;
+
+	std::mutex m_mutex;
+	Status m_status;
+	bool m_success;
+	std::string m_error;
+	std::promise<bool> m_promise;
+	std::shared_future<bool> m_future;
+
+	/** PENDING -> RUNNING; returns false if it was cancelled */
+	bool start();
+	void complete(bool success, const std::string &error);
+};
+
+typedef std::shared_ptr<AsyncRead> AsyncReadPtr;
+
+/**
+ * asynchronous reads from a file, processed by the process wide WorkerPool (or a pool of
+ * its own); each worker has its own FileReaderState for the file, so requests for different
+ * blocks of a compressed file are decoded in parallel.
+ *
+ * readAsync() is thread safe. destroying the reader cancels all requests that haven't
+ * been started yet, and waits for the running ones (cancelled tasks stay queued in a shared
+ * pool until a worker drops them, keeping the file open until then).
+ */
+class AsyncReader {
+private:
+	AsyncReader();
+	AsyncReader(const AsyncReader &);
+	AsyncReader& operator=(const AsyncReader &);
+
+	/* used by the queued tasks, which might run after the reader was destroyed */
+	struct Shared {
+		File file;
+		std::vector<FileReaderState*> states; /** one per worker */
+
+		std::mutex mutex;
+		std::list<AsyncReadPtr> outstanding;
+	};
+
+	std::shared_ptr<Shared> m_shared;
+	WorkerPool *m_pool;
+	std::unique_ptr<WorkerPool> m_ownPool; /* last member: destroyed (joined) first */
+
+	static void process(const std::shared_ptr<Shared> &shared, AsyncReadPtr request, std::list<AsyncReadPtr>::iterator outstandingIt, unsigned int worker);
+
+public:
+	/** threads == 0: use WorkerPool::instance(); otherwise start a pool with that many threads for this reader */
+	explicit AsyncReader(File file, unsigned int threads = 0);
+	~AsyncReader();
+
+	File file() const { return m_shared->file; }
+
+	/**
+	 * read exactly length bytes at offset into data (which must stay valid until the request is completed).
+	 * requests with higher priority are started first.
+	 * the callback (optional) is run in the worker thread after completion (or in the thread
+	 * calling AsyncRead::cancel()).
+	 */
+	AsyncReadPtr readAsync(int64_t offset, ssize_t length, unsigned char *data, int priority = 0, AsyncRead::Callback callback = nullptr);
+};
+
+#endif
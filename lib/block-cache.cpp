@@ -0,0 +1,279 @@
+#include "block-cache.h"
+
+#include "huge-pages.h"
+#include "lz4-codec.h"
+#include "worker-pool.h"
+
+#include <cstring>
+
+/* default byte budget of the process wide cache */
+#define DEFAULT_BLOCK_CACHE_CAPACITY (16*1024*1024)
+/* default byte budget of the packed tier of the process wide cache */
+#define DEFAULT_PACKED_CACHE_CAPACITY (16*1024*1024)
+/* evicted blocks are only packed if that saves at least 1/PACK_MIN_SAVING of their size */
+#define PACK_MIN_SAVING 8
+/* WorkerPool priority for packing evicted blocks (below readahead and prefetching) */
+#define PACK_PRIORITY (-3)
+
+DecodedBlock::DecodedBlock(size_t size)
+: m_pages(HugePages::OFF), data(nullptr), size(size) {
+	if (HugePages::suitable(size)) data = (unsigned char*) HugePages::allocate(size, m_pages);
+	if (nullptr == data) data = new unsigned char[size];
+}
+
+DecodedBlock::~DecodedBlock() {
+	if (HugePages::OFF != m_pages) {
+		HugePages::release(data, size, m_pages);
+	} else {
+		delete[] data;
+	}
+	data = nullptr;
+	size = 0;
+}
+
+BlockCache::BlockCache(size_t capacity, size_t packedCapacity)
+: m_capacity(capacity), m_packedCapacity(packedCapacity), m_packing(0) {
+}
+
+BlockCache::~BlockCache() {
+	waitForPacking();
+}
+
+BlockCache& BlockCache::instance() {
+	/* never destroyed: pack tasks and files in static objects might still use it during exit */
+	static BlockCache *cache = new BlockCache(DEFAULT_BLOCK_CACHE_CAPACITY, DEFAULT_PACKED_CACHE_CAPACITY);
+	return *cache;
+}
+
+uint64_t BlockCache::newFileId() {
+	static std::atomic<uint64_t> nextId(1);
+	return nextId++;
+}
+
+void BlockCache::evict(Shard &shard, size_t shardCapacity, std::vector<Entry> *victims) {
+	while (shard.bytes > shardCapacity && !shard.lru.empty()) {
+		Entry &victim = shard.lru.back();
+		shard.bytes -= victim.block->size;
+		shard.map.erase(victim.key);
+		if (nullptr != victims) victims->push_back(std::move(victim));
+		shard.lru.pop_back();
+	}
+}
+
+void BlockCache::evictPacked(Shard &shard, size_t shardCapacity) {
+	while (shard.packedBytes > shardCapacity && !shard.packedLru.empty()) {
+		removePacked(shard, std::prev(shard.packedLru.end()));
+	}
+}
+
+void BlockCache::removePacked(Shard &shard, std::list<PackedEntry>::iterator it) {
+	shard.packedBytes -= it->block->packedSize;
+	shard.packedMap.erase(it->key);
+	shard.packedLru.erase(it);
+}
+
+void BlockCache::pack(Shard &shard, std::vector<Entry> &victims, uint64_t removals) {
+	size_t shardCapacity = m_packedCapacity / SHARDS;
+
+	for (Entry &victim : victims) {
+		DecodedBlock &decoded = *victim.block;
+		/* compressing into a buffer smaller than the bound fails early for incompressible blocks */
+		size_t maxSize = decoded.size - decoded.size / PACK_MIN_SAVING;
+		if (0 == maxSize || maxSize > shardCapacity) continue;
+
+		std::unique_ptr<unsigned char[]> buffer(new unsigned char[maxSize]);
+		size_t packedSize = LZ4Codec::compress(decoded.data, decoded.size, buffer.get(), maxSize);
+		if (0 == packedSize) continue;
+
+		std::shared_ptr<PackedBlock> packed(new PackedBlock());
+		packed->data.reset(new unsigned char[packedSize]);
+		memcpy(packed->data.get(), buffer.get(), packedSize);
+		packed->packedSize = packedSize;
+		packed->size = decoded.size;
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		/* the file might have been removed (closed), or the block decoded and inserted again in the meantime */
+		if (shard.removals != removals) return;
+		if (shard.map.end() != shard.map.find(victim.key)) continue;
+		if (shard.packedMap.end() != shard.packedMap.find(victim.key)) continue;
+
+		PackedEntry entry = { victim.key, packed };
+		shard.packedLru.push_front(entry);
+		shard.packedMap[victim.key] = shard.packedLru.begin();
+		shard.packedBytes += packedSize;
+
+		evictPacked(shard, m_packedCapacity / SHARDS);
+	}
+}
+
+void BlockCache::setCapacity(size_t capacity) {
+	m_capacity = capacity;
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		evict(shard, capacity / SHARDS, nullptr);
+	}
+}
+
+void BlockCache::setPackedCapacity(size_t capacity) {
+	m_packedCapacity = capacity;
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		evictPacked(shard, capacity / SHARDS);
+	}
+}
+
+size_t BlockCache::size() {
+	size_t bytes = 0;
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		bytes += shard.bytes + shard.packedBytes;
+	}
+	return bytes;
+}
+
+size_t BlockCache::packedSize() {
+	size_t bytes = 0;
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		bytes += shard.packedBytes;
+	}
+	return bytes;
+}
+
+DecodedBlockPtr BlockCache::lookup(uint64_t file, uint64_t block) {
+	Key key = { file, block };
+	Shard &shard = shardFor(key);
+	std::shared_ptr<PackedBlock> packed;
+
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(key);
+		if (shard.map.end() != it) {
+			/* mark as most recently used */
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			return it->second->block;
+		}
+
+		auto packedIt = shard.packedMap.find(key);
+		if (shard.packedMap.end() == packedIt) return nullptr;
+		/* moves back to the decoded tier */
+		packed = packedIt->second->block;
+		removePacked(shard, packedIt->second);
+	}
+
+	DecodedBlockPtr data(new DecodedBlock(packed->size));
+	if (!LZ4Codec::decompress(packed->data.get(), packed->packedSize, data->data, data->size)) return nullptr;
+
+	insert(file, block, data);
+	return data;
+}
+
+void BlockCache::insert(uint64_t file, uint64_t block, DecodedBlockPtr data) {
+	if (!data || !cacheable(data->size)) return;
+
+	Key key = { file, block };
+	Shard &shard = shardFor(key);
+	std::vector<Entry> victims;
+	uint64_t removals;
+
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(key);
+		if (shard.map.end() != it) {
+			/* another thread was faster; keep the existing block */
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			return;
+		}
+
+		/* a packed copy is outdated now */
+		auto packedIt = shard.packedMap.find(key);
+		if (shard.packedMap.end() != packedIt) removePacked(shard, packedIt->second);
+
+		Entry entry = { key, data };
+		shard.lru.push_front(entry);
+		shard.map[key] = shard.lru.begin();
+		shard.bytes += data->size;
+
+		evict(shard, m_capacity / SHARDS, (m_packedCapacity > 0) ? &victims : nullptr);
+		removals = shard.removals;
+	}
+	if (victims.empty()) return;
+
+	/* compressing takes about as long as copying the block a few times: keep it off the reader's path */
+	std::shared_ptr<std::vector<Entry>> pending(new std::vector<Entry>(std::move(victims)));
+	{
+		std::lock_guard<std::mutex> lock(m_packMutex);
+		++m_packing;
+	}
+	WorkerPool::instance().submit([this, &shard, pending, removals](unsigned int) {
+		pack(shard, *pending, removals);
+		pending->clear();
+		std::lock_guard<std::mutex> lock(m_packMutex);
+		if (0 == --m_packing) m_packDone.notify_all();
+	}, PACK_PRIORITY);
+}
+
+void BlockCache::removeFile(uint64_t file) {
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		++shard.removals;
+		for (auto it = shard.lru.begin(); it != shard.lru.end(); ) {
+			if (it->key.file == file) {
+				shard.bytes -= it->block->size;
+				shard.map.erase(it->key);
+				it = shard.lru.erase(it);
+			} else {
+				++it;
+			}
+		}
+		for (auto it = shard.packedLru.begin(); it != shard.packedLru.end(); ) {
+			auto current = it++;
+			if (current->key.file == file) removePacked(shard, current);
+		}
+	}
+}
+
+size_t BlockCache::fileSize(uint64_t file) {
+	size_t bytes = 0;
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (const Entry &entry : shard.lru) {
+			if (entry.key.file == file) bytes += entry.block->size;
+		}
+		for (const PackedEntry &entry : shard.packedLru) {
+			if (entry.key.file == file) bytes += entry.block->packedSize;
+		}
+	}
+	return bytes;
+}
+
+void BlockCache::shrink(size_t bytes) {
+	size_t total = size();
+	if (bytes >= total) return;
+
+	/* both tiers keep their share of the remaining bytes */
+	double keep = (double) bytes / (double) total;
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		evict(shard, (size_t) (shard.bytes * keep), nullptr);
+		evictPacked(shard, (size_t) (shard.packedBytes * keep));
+	}
+}
+
+void BlockCache::clear() {
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		++shard.removals;
+		shard.map.clear();
+		shard.lru.clear();
+		shard.bytes = 0;
+		shard.packedMap.clear();
+		shard.packedLru.clear();
+		shard.packedBytes = 0;
+	}
+}
+
+void BlockCache::waitForPacking() {
+	std::unique_lock<std::mutex> lock(m_packMutex);
+	m_packDone.wait(lock, [this]() { return 0 == m_packing; });
+}
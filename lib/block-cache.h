@@ -0,0 +1,158 @@
+#ifndef __MY_BLOCK_CACHE_H
+#define __MY_BLOCK_CACHE_H __MY_BLOCK_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * a completely decoded block of a compressed file; large blocks are backed by huge pages (see HugePages)
+ */
+class DecodedBlock {
+private:
+	DecodedBlock();
+	DecodedBlock(const DecodedBlock &);
+	DecodedBlock& operator=(const DecodedBlock &);
+
+	int m_pages; /** HugePages kind of data; OFF if allocated with new[] */
+
+public:
+	explicit DecodedBlock(size_t size);
+	~DecodedBlock();
+
+	unsigned char *data;
+	size_t size;
+};
+
+typedef std::shared_ptr<DecodedBlock> DecodedBlockPtr;
+
+/**
+ * process wide cache for decoded blocks, keyed by (file id, block index).
+ *
+ * thread safe; the keys are distributed over several shards, each with its own lock
+ * and its own least-recently-used list. each shard gets an equal part of the byte budget,
+ * blocks larger than that are never cached (see cacheable()).
+ *
+ * returned blocks are shared pointers, so they stay valid after eviction as long as
+ * someone still uses them.
+ *
+ * second tier: blocks evicted from the decoded tier are compressed with LZ4 (see LZ4Codec) and
+ * kept in a separate least-recently-used list with its own byte budget. a lookup that hits the
+ * packed tier decompresses the block (much faster than decoding it again) and moves it back into
+ * the decoded tier. blocks that don't compress well are simply dropped. packing runs on the
+ * WorkerPool at a low priority: evicted blocks stay in memory until a worker gets to them, and
+ * lookups miss them in the meantime.
+ */
+class BlockCache {
+private:
+	BlockCache(const BlockCache &);
+	BlockCache& operator=(const BlockCache &);
+
+	enum { SHARDS = 16 };
+
+	struct Key {
+		uint64_t file, block;
+		bool operator==(const Key &other) const { return file == other.file && block == other.block; }
+	};
+
+	struct KeyHash {
+		size_t operator()(const Key &key) const {
+			uint64_t h = key.file * 0x9E3779B97F4A7C15ull ^ key.block;
+			h ^= h >> 29; h *= 0xBF58476D1CE4E5B9ull; h ^= h >> 32;
+			return (size_t) h;
+		}
+	};
+
+	struct Entry {
+		Key key;
+		DecodedBlockPtr block;
+	};
+
+	/* LZ4 compressed copy of an evicted block */
+	struct PackedBlock {
+		std::unique_ptr<unsigned char[]> data;
+		size_t packedSize, size;
+	};
+
+	struct PackedEntry {
+		Key key;
+		std::shared_ptr<PackedBlock> block;
+	};
+
+	struct Shard {
+		Shard() : bytes(0), packedBytes(0), removals(0) { }
+		std::mutex mutex;
+		std::list<Entry> lru; /* most recently used first */
+		std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map;
+		size_t bytes;
+		std::list<PackedEntry> packedLru; /* most recently used first */
+		std::unordered_map<Key, std::list<PackedEntry>::iterator, KeyHash> packedMap;
+		size_t packedBytes;
+		uint64_t removals; /* incremented by removeFile() and clear(); blocks evicted before aren't packed */
+	};
+
+	Shard m_shards[SHARDS];
+	std::atomic<size_t> m_capacity;
+	std::atomic<size_t> m_packedCapacity;
+
+	std::mutex m_packMutex;
+	std::condition_variable m_packDone;
+	size_t m_packing; /* pack tasks submitted to the WorkerPool and not finished yet */
+
+	Shard& shardFor(const Key &key) { return m_shards[KeyHash()(key) % SHARDS]; }
+	/* victims (if not nullptr) get the evicted entries to pack them after releasing the lock */
+	void evict(Shard &shard, size_t shardCapacity, std::vector<Entry> *victims); /* needs shard.mutex */
+	void evictPacked(Shard &shard, size_t shardCapacity); /* needs shard.mutex */
+	void removePacked(Shard &shard, std::list<PackedEntry>::iterator it); /* needs shard.mutex */
+	/* compress the victims (evicted while shard.removals was removals) and store them in the packed tier */
+	void pack(Shard &shard, std::vector<Entry> &victims, uint64_t removals);
+
+public:
+	BlockCache(size_t capacity, size_t packedCapacity);
+	/** waits for pending pack tasks */
+	~BlockCache();
+
+	/** the process wide cache */
+	static BlockCache& instance();
+
+	/** unique id for a file to use in the keys */
+	static uint64_t newFileId();
+
+	/** byte budget; setting it to 0 disables the cache */
+	void setCapacity(size_t capacity);
+	size_t capacity() const { return m_capacity; }
+	/** byte budget of the packed tier (compressed bytes); setting it to 0 disables the tier */
+	void setPackedCapacity(size_t capacity);
+	size_t packedCapacity() const { return m_packedCapacity; }
+	/** currently used bytes (both tiers) */
+	size_t size();
+	/** currently used bytes in the packed tier */
+	size_t packedSize();
+	/** bytes used by the blocks of a file in both tiers (walks the complete cache) */
+	size_t fileSize(uint64_t file);
+
+	/** whether a block of the given (uncompressed) size would be cached */
+	bool cacheable(size_t blocksize) const {
+		return blocksize > 0 && blocksize <= m_capacity / SHARDS;
+	}
+
+	/** returns nullptr if not found; unpacks blocks from the packed tier */
+	DecodedBlockPtr lookup(uint64_t file, uint64_t block);
+	void insert(uint64_t file, uint64_t block, DecodedBlockPtr data);
+	/** drop all blocks of a file (call when it is closed) */
+	void removeFile(uint64_t file);
+	/** drop the least recently used blocks (in each tier) until at most about bytes are used; keeps the capacities */
+	void shrink(size_t bytes);
+	void clear();
+	/** wait until the blocks evicted so far are packed (or dropped) */
+	void waitForPacking();
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include "block-prefetch.h"
+
+#include "worker-pool.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <unordered_set>
+
+/* maximum number of blocks queued for prefetching per file (the bytes are limited by the cache capacity) */
+#define PREFETCH_MAX_QUEUED 1024
+/* prefetching is only a hint; run it after other work in the pool, including readahead for active readers */
+#define PREFETCH_PRIORITY (-2)
+
+struct BlockPrefetcher::Shared {
+	explicit Shared(DecodeBlock decodeBlock)
+	: decodeBlock(decodeBlock), running(0), cancelled(false) { }
+
+	DecodeBlock decodeBlock;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::unordered_set<int64_t> queued;
+	size_t running;
+	bool cancelled;
+
+	static void run(std::shared_ptr<Shared> shared, int64_t blockOffset) {
+		{
+			std::lock_guard<std::mutex> lock(shared->mutex);
+			if (shared->cancelled || 0 == shared->queued.erase(blockOffset)) return;
+			++shared->running;
+		}
+
+		std::string error;
+		shared->decodeBlock(blockOffset, error); /* ignore errors */
+
+		std::lock_guard<std::mutex> lock(shared->mutex);
+		if (0 == --shared->running) shared->cond.notify_all();
+	}
+};
+
+BlockPrefetcher::BlockPrefetcher(DecodeBlock decodeBlock)
+: m_shared(new Shared(decodeBlock)) {
+}
+
+BlockPrefetcher::~BlockPrefetcher() {
+	cancel();
+}
+
+bool BlockPrefetcher::schedule(int64_t blockOffset) {
+	{
+		std::lock_guard<std::mutex> lock(m_shared->mutex);
+		if (m_shared->cancelled || m_shared->queued.size() >= PREFETCH_MAX_QUEUED) return false;
+		if (!m_shared->queued.insert(blockOffset).second) return false;
+	}
+
+	std::shared_ptr<Shared> shared = m_shared;
+	WorkerPool::instance().submit([shared, blockOffset](unsigned int) {
+		Shared::run(shared, blockOffset);
+	}, PREFETCH_PRIORITY);
+	return true;
+}
+
+void BlockPrefetcher::cancel() {
+	std::unique_lock<std::mutex> lock(m_shared->mutex);
+	m_shared->cancelled = true;
+	m_shared->queued.clear();
+	while (m_shared->running > 0) m_shared->cond.wait(lock);
+}
@@ -0,0 +1,44 @@
+#ifndef __MY_BLOCK_PREFETCH_H
+#define __MY_BLOCK_PREFETCH_H __MY_BLOCK_PREFETCH_H
+
+#include <cstdint>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+/**
+ * decodes blocks of a compressed file into the BlockCache in the background (on
+ * WorkerPool::instance()), for IFile::prefetch() with PREFETCH_DECODE.
+ *
+ * belongs to a file; thread safe. blocks are identified by their uncompressed offset,
+ * each block is queued only once at a time. errors are ignored (prefetching is only
+ * speculative; a later read reports them).
+ */
+class BlockPrefetcher {
+public:
+	/** decode the block at blockOffset into the BlockCache (unless it is already cached); called in worker threads */
+	typedef std::function<bool(int64_t blockOffset, std::string &error /* out */)> DecodeBlock;
+
+private:
+	BlockPrefetcher();
+	BlockPrefetcher(const BlockPrefetcher &);
+	BlockPrefetcher& operator=(const BlockPrefetcher &);
+
+	struct Shared;
+	/* shared with the queued tasks, which might start after the prefetcher is gone */
+	std::shared_ptr<Shared> m_shared;
+
+public:
+	explicit BlockPrefetcher(DecodeBlock decodeBlock);
+	/** calls cancel() */
+	~BlockPrefetcher();
+
+	/** queue the block; returns false if it is queued already or too many blocks are queued */
+	bool schedule(int64_t blockOffset);
+
+	/** drop the queued blocks, wait for the running ones and ignore further schedule() calls; the file has to call this before destroying what DecodeBlock uses */
+	void cancel();
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define CRC32C_X86 1
+# include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+# define CRC32C_ARM 1
+# include <arm_acle.h>
+#endif
+
+/* reversed Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78u
+
+namespace {
+	struct Tables {
+		uint32_t t[8][256];
+
+		Tables() {
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t crc = i;
+				for (int k = 0; k < 8; ++k) crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+				t[0][i] = crc;
+			}
+			for (uint32_t i = 0; i < 256; ++i) {
+				for (int k = 1; k < 8; ++k) t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+			}
+		}
+	};
+}
+
+static const Tables& tables() {
+	static Tables tables;
+	return tables;
+}
+
+/* slicing by 8 (little endian loads; falls back to bytes on big endian machines) */
+static uint32_t updateTable(uint32_t crc, const unsigned char *data, size_t size) {
+	const Tables &tab = tables();
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (size >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		word ^= crc;
+		crc = tab.t[7][word & 0xff] ^ tab.t[6][(word >> 8) & 0xff]
+			^ tab.t[5][(word >> 16) & 0xff] ^ tab.t[4][(word >> 24) & 0xff]
+			^ tab.t[3][(word >> 32) & 0xff] ^ tab.t[2][(word >> 40) & 0xff]
+			^ tab.t[1][(word >> 48) & 0xff] ^ tab.t[0][word >> 56];
+		data += 8;
+		size -= 8;
+	}
+#endif
+	while (size-- > 0) crc = (crc >> 8) ^ tab.t[0][(crc ^ *data++) & 0xff];
+	return crc;
+}
+
+#if defined(CRC32C_X86)
+
+__attribute__((target("sse4.2")))
+static uint32_t updateHardware(uint32_t crc, const unsigned char *data, size_t size) {
+	uint64_t crc64 = crc;
+	while (size >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		data += 8;
+		size -= 8;
+	}
+	crc = (uint32_t) crc64;
+	while (size-- > 0) crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+
+static bool haveHardware() {
+	static bool sse42 = __builtin_cpu_supports("sse4.2");
+	return sse42;
+}
+
+#elif defined(CRC32C_ARM)
+
+static uint32_t updateHardware(uint32_t crc, const unsigned char *data, size_t size) {
+	while (size >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc = __crc32cd(crc, word);
+		data += 8;
+		size -= 8;
+	}
+	while (size-- > 0) crc = __crc32cb(crc, *data++);
+	return crc;
+}
+
+static bool haveHardware() {
+	return true;
+}
+
+#endif
+
+uint32_t Crc32c::update(uint32_t crc, const unsigned char *data, size_t size) {
+	crc = ~crc;
+#if defined(CRC32C_X86) || defined(CRC32C_ARM)
+	if (haveHardware()) return ~updateHardware(crc, data, size);
+#endif
+	return ~updateTable(crc, data, size);
+}
@@ -0,0 +1,25 @@
+#ifndef __MY_CRC32C_H
+#define __MY_CRC32C_H __MY_CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * CRC-32C (Castagnoli, as in iSCSI / ext4); used for the per-block checksums of
+ * idxdefl v2 archives.
+ *
+ * uses the crc32 instructions of SSE 4.2 (x86-64, detected at runtime) or ARMv8
+ * (if enabled at compile time), otherwise a table based (slicing by 8) implementation.
+ */
+class Crc32c {
+private:
+	Crc32c();
+
+public:
+	/** continue crc (0 for the first piece) with size bytes */
+	static uint32_t update(uint32_t crc, const unsigned char *data, size_t size);
+
+	static uint32_t compute(const unsigned char *data, size_t size) { return update(0, data, size); }
+};
+
+#endif
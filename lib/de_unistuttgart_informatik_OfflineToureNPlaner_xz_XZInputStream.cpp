@@ -1,6 +1,7 @@
 
-#include "xz-file.h"
-#include "idx-defl-file.h"
+#include "archive-registry.h"
+#include "huge-pages.h"
+#include "memory-budget.h"
 
 #include "de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream.h"
 
@@ -31,50 +32,27 @@
 /*
  * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
  * Method:    openFile
- * Signature: (Ljava/lang/String;)V
+ * Signature: (Ljava/lang/String;I)V
  */
-JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_openFile(JNIEnv *env, jobject obj, jstring filename) {
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_openFile(JNIEnv *env, jobject obj, jstring filename, jint flags) {
 	std::string error("Couldn't read xz archive");
 
-	std::shared_ptr<NormalFile> osfile;
-	std::shared_ptr<XZFile> xzfile;
-	std::shared_ptr<IndexedDeflateFile> idxdeflfile;
+	File file;
 	FileReader *reader = nullptr;
 	jlong filesize = 0;
-	FileReaderState *state = nullptr;
-
-	static const unsigned char idxdefl_magic_header[8] = "idxdefl";
-	unsigned char magic_header[sizeof(idxdefl_magic_header)];
 
 	{
+		/* opens of the same archive share the file, its index and its cached blocks */
 		const char *filenameUtf8 = env->GetStringUTFChars(filename, NULL);
-		osfile.reset(new MMappedFile(filenameUtf8, error));
+		/* the OPEN_* constants are ArchiveRegistry::Flags */
+		file = ArchiveRegistry::instance().open(filenameUtf8, error, flags & (ArchiveRegistry::PRELOAD | ArchiveRegistry::LOCK | ArchiveRegistry::IN_MEMORY));
 		env->ReleaseStringUTFChars(filename, filenameUtf8);
 	}
 
-	if (!osfile->valid()) goto failed;
-
-	if (!osfile->readInto(state, 0, sizeof(idxdefl_magic_header), magic_header, error)) {
-		osfile->finish(state);
-		goto failed;
-	}
-	osfile->finish(state);
-
-	if (0 == memcmp(idxdefl_magic_header, magic_header, sizeof(idxdefl_magic_header))) {
-		idxdeflfile.reset(new IndexedDeflateFile(osfile, error));
-		if (!idxdeflfile->valid()) goto failed;
-
-		reader = new FileReader(idxdeflfile);
+	if (!file) goto failed;
 
-		filesize = idxdeflfile->filesize();
-	} else {
-		xzfile.reset(new XZFile(osfile, error));
-		if (!xzfile->valid()) goto failed;
-
-		reader = new FileReader(xzfile);
-
-		filesize = xzfile->filesize();
-	}
+	reader = new FileReader(file);
+	filesize = file->filesize();
 
 	{
 		jclass cls =  env->GetObjectClass(obj);
@@ -152,12 +130,8 @@ JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZ
 	buf = env->GetIntArrayElements(buffer, NULL);
 	if (nullptr == buf) goto failed;
 
-	reader->seek(offset);
-
-	if (!reader->readInto((unsigned char*) (buf + start), 4 * length)) {
-		error.assign(reader->lastError());
-		goto failed;
-	}
+	/* pread() is thread safe and reuses warm decoder states of the file */
+	if (!reader->file()->pread(offset, 4 * (ssize_t) length, (unsigned char*) (buf + start), error)) goto failed;
 	for (int i = 0; i < length; ++i) {
 		buf[start+i] = htonl(buf[start+i]);
 	}
@@ -176,3 +150,48 @@ failed:
 		if (nullptr != excCls) env->ThrowNew(excCls, error.c_str());
 	}
 }
+
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    prefetch
+ * Signature: (JJ)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_prefetch(JNIEnv *env, jobject obj, jlong offset, jlong length) {
+	jclass cls =  env->GetObjectClass(obj);
+	jfieldID fNativePtr = env->GetFieldID(cls, "nativePtr", "J");
+	if (nullptr == fNativePtr) return;
+
+	FileReader *reader = (FileReader*) (intptr_t) env->GetLongField(obj, fNativePtr);
+	if (nullptr == reader) return;
+
+	/* only a hint; doesn't fail */
+	reader->file()->prefetch(offset, length, IFile::PREFETCH_DECODE);
+}
+
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    trimMemory
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_trimMemory(JNIEnv *, jclass, jint level) {
+	MemoryBudget::instance().trim(level);
+}
+
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    setMemoryLimit
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_setMemoryLimit(JNIEnv *, jclass, jlong limit) {
+	if (limit < 0) limit = 0;
+	MemoryBudget::instance().setLimit((size_t) std::min<uint64_t>(limit, std::numeric_limits<size_t>::max()));
+}
+
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    setHugePages
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_setHugePages(JNIEnv *, jclass, jint mode) {
+	HugePages::setMode(mode);
+}
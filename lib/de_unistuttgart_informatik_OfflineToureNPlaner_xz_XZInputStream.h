@@ -4,16 +4,28 @@
 
 #ifndef _Included_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
 #define _Included_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+#undef de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_TRIM_IDLE
+#define de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_TRIM_IDLE 1L
+#undef de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_TRIM_CACHE
+#define de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_TRIM_CACHE 2L
+#undef de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_TRIM_ALL
+#define de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_TRIM_ALL 3L
+#undef de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_HUGE_PAGES_OFF
+#define de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_HUGE_PAGES_OFF 0L
+#undef de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_HUGE_PAGES_TRANSPARENT
+#define de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_HUGE_PAGES_TRANSPARENT 1L
+#undef de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_HUGE_PAGES_EXPLICIT
+#define de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_HUGE_PAGES_EXPLICIT 2L
 #ifdef __cplusplus
 extern "C" {
 #endif
 /*
  * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
  * Method:    openFile
- * Signature: (Ljava/lang/String;)V
+ * Signature: (Ljava/lang/String;I)V
  */
 JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_openFile
-  (JNIEnv *, jobject, jstring);
+  (JNIEnv *, jobject, jstring, jint);
 
 /*
  * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
@@ -31,6 +43,38 @@ JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZ
 JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_readInt
   (JNIEnv *, jobject, jlong, jintArray, jint, jint);
 
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    prefetch
+ * Signature: (JJ)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_prefetch
+  (JNIEnv *, jobject, jlong, jlong);
+
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    trimMemory
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_trimMemory
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    setMemoryLimit
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_setMemoryLimit
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream
+ * Method:    setHugePages
+ * Signature: (I)V
+ */
+JNIEXPORT void JNICALL Java_de_unistuttgart_informatik_OfflineToureNPlaner_xz_XZInputStream_setHugePages
+  (JNIEnv *, jclass, jint);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,103 @@
+#include "decoder-arena.h"
+
+#include "huge-pages.h"
+
+#include <cstdlib>
+
+/* default limit of idle memory in the process wide arena; enough for a few lzma dictionaries */
+#define DEFAULT_ARENA_MAX_IDLE (32*1024*1024)
+
+DecoderArena::DecoderArena(size_t maxIdle)
+: m_idleBytes(0), m_maxIdle(maxIdle), m_usedBytes(0) {
+}
+
+DecoderArena::~DecoderArena() {
+	trim();
+}
+
+DecoderArena& DecoderArena::instance() {
+	/* never destroyed: decoders in static objects might release memory during exit */
+	static DecoderArena *arena = new DecoderArena(DEFAULT_ARENA_MAX_IDLE);
+	return *arena;
+}
+
+void* DecoderArena::allocate(size_t size) {
+	Header *header = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_free.find(size);
+		if (m_free.end() != it && !it->second.empty()) {
+			header = it->second.back();
+			it->second.pop_back();
+			m_idleBytes -= size;
+		}
+	}
+
+	if (nullptr == header) {
+		int pages = HugePages::OFF;
+		if (HugePages::suitable(sizeof(Header) + size)) {
+			header = (Header*) HugePages::allocate(sizeof(Header) + size, pages);
+		}
+		if (nullptr == header) header = (Header*) malloc(sizeof(Header) + size);
+		if (nullptr == header) return nullptr;
+		header->size = size;
+		header->pages = pages;
+	}
+
+	m_usedBytes += size;
+	return header + 1;
+}
+
+void DecoderArena::release(void *ptr) {
+	if (nullptr == ptr) return;
+
+	Header *header = ((Header*) ptr) - 1;
+	size_t size = header->size;
+	m_usedBytes -= size;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_idleBytes + size <= m_maxIdle) {
+			m_free[size].push_back(header);
+			m_idleBytes += size;
+			return;
+		}
+	}
+
+	freeHeader(header);
+}
+
+void DecoderArena::freeHeader(Header *header) {
+	if (HugePages::OFF != header->pages) {
+		HugePages::release(header, sizeof(Header) + header->size, (int) header->pages);
+	} else {
+		free(header);
+	}
+}
+
+size_t DecoderArena::idleBytes() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_idleBytes;
+}
+
+void DecoderArena::setMaxIdle(size_t maxIdle) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_maxIdle = maxIdle;
+		if (m_idleBytes <= m_maxIdle) return;
+	}
+	trim();
+}
+
+void DecoderArena::trim() {
+	std::unordered_map<size_t, std::vector<Header*>> idle;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		idle.swap(m_free);
+		m_idleBytes = 0;
+	}
+
+	for (auto &bucket : idle) {
+		for (Header *header : bucket.second) freeHeader(header);
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef __MY_DECODER_ARENA_H
+#define __MY_DECODER_ARENA_H __MY_DECODER_ARENA_H
+
+#include <cstddef>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * allocator for decoder memory (lzma dictionaries, zlib windows, block header filter options);
+ * used through the lzma_allocator / zalloc hooks of the decoders.
+ *
+ * released allocations are kept in free lists per size and handed out again, so
+ * setting up decoders again (for other blocks, or new states for other files)
+ * doesn't need malloc()/free() in the steady state.
+ *
+ * large allocations (lzma dictionaries) are backed by huge pages (see HugePages), which reduces
+ * TLB misses for the random dictionary accesses of the lzma decoder.
+ *
+ * thread safe; the memory kept idle is bounded (setMaxIdle()) and can be released with trim().
+ */
+class DecoderArena {
+private:
+	DecoderArena(const DecoderArena &);
+	DecoderArena& operator=(const DecoderArena &);
+
+	/* stored before each allocation; keeps the returned memory 16-byte aligned */
+	struct Header {
+		size_t size;
+		size_t pages; /* HugePages kind; OFF if allocated with malloc() */
+	};
+
+	static void freeHeader(Header *header);
+
+	std::mutex m_mutex;
+	std::unordered_map<size_t, std::vector<Header*>> m_free;
+	size_t m_idleBytes;
+	size_t m_maxIdle;
+	std::atomic<size_t> m_usedBytes;
+
+public:
+	explicit DecoderArena(size_t maxIdle);
+	~DecoderArena();
+
+	/** the process wide arena */
+	static DecoderArena& instance();
+
+	/** returns nullptr if out of memory */
+	void* allocate(size_t size);
+	/** ptr must come from allocate() (or be nullptr) */
+	void release(void *ptr);
+	/** the size passed to allocate() for ptr (0 for nullptr) */
+	static size_t allocationSize(const void *ptr) { return (nullptr != ptr) ? (((const Header*) ptr) - 1)->size : 0; }
+
+	/** bytes currently handed out to decoders */
+	size_t usedBytes() const { return m_usedBytes; }
+	/** bytes kept for reuse */
+	size_t idleBytes();
+
+	void setMaxIdle(size_t maxIdle);
+	/** release all idle memory */
+	void trim();
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "file.h"
 
+#include "worker-pool.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
@@ -8,6 +10,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <limits>
+#include <thread>
+
 static void errnoToSt(const char *prefix, std::string &error) {
 	error.assign(prefix);
 	error.append(strerror(errno));
@@ -22,6 +27,180 @@ static void errnoFnameToSt(const char *prefix, const char *filename, std::string
 }
 
 
+/********************************************************************************
+ *                                                                              *
+ *                                   IFile                                      *
+ *                                                                              *
+ ********************************************************************************/
+
+void planReadMany(const std::vector<ReadRequest> &requests, std::vector<ReadRequest> &reads /* out */, std::vector<ReadCopy> &copies /* out */) {
+	reads.clear();
+	copies.clear();
+
+	std::vector<const ReadRequest*> sorted;
+	sorted.reserve(requests.size());
+	for (const ReadRequest &req : requests) {
+		if (req.length > 0) sorted.push_back(&req);
+	}
+	std::stable_sort(sorted.begin(), sorted.end(), [](const ReadRequest *a, const ReadRequest *b) { return a->offset < b->offset; });
+
+	/* request reaching furthest so far; it contains everything from its own offset up to end */
+	const ReadRequest *furthest = nullptr;
+	int64_t end = 0;
+
+	for (const ReadRequest *req : sorted) {
+		ssize_t overlap = 0;
+		if (nullptr != furthest && req->offset < end) {
+			overlap = (ssize_t) std::min<int64_t>(req->length, end - req->offset);
+			ReadCopy copy = { req->data, furthest->data + (req->offset - furthest->offset), overlap };
+			copies.push_back(copy);
+		}
+
+		if (overlap < req->length) {
+			ReadRequest rest = { req->offset + overlap, req->length - overlap, req->data + overlap };
+			reads.push_back(rest);
+		}
+
+		if (nullptr == furthest || req->offset + req->length > end) {
+			furthest = req;
+			end = req->offset + req->length;
+		}
+	}
+}
+
+void finishReadCopies(const std::vector<ReadCopy> &copies) {
+	for (const ReadCopy &copy : copies) {
+		memmove(copy.dst, copy.src, copy.length);
+	}
+}
+
+bool parallelPread(IFile *file, const std::vector<ReadRequest> &requests, std::string &error /* out */) {
+	return WorkerPool::instance().parallelFor(requests.size(), [file, &requests](size_t index, std::string &joberror) {
+		const ReadRequest &req = requests[index];
+		return file->pread(req.offset, req.length, req.data, joberror);
+	}, error);
+}
+
+bool IFile::pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	FileReaderState *state = nullptr;
+	bool result = readInto(state, offset, length, data, error);
+	finish(state);
+	return result;
+}
+
+void IFile::prefetch(int64_t, int64_t, int) {
+}
+
+void IFile::advise(int) {
+}
+
+bool IFile::readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */) {
+	std::vector<ReadRequest> reads;
+	std::vector<ReadCopy> copies;
+	planReadMany(requests, reads, copies);
+
+	for (const ReadRequest &req : reads) {
+		if (!readInto(internalState, req.offset, req.length, req.data, error)) return false;
+	}
+
+	finishReadCopies(copies);
+	return true;
+}
+
+
+/********************************************************************************
+ *                                                                              *
+ *                            FileReaderStatePool                               *
+ *                                                                              *
+ ********************************************************************************/
+
+FileReaderStatePool::FileReaderStatePool(IFile *file, size_t maxIdle)
+: m_file(file), m_maxIdle(maxIdle) {
+}
+
+FileReaderStatePool::~FileReaderStatePool() {
+	/* the file should have done this already */
+	assert(m_idle.empty());
+}
+
+size_t FileReaderStatePool::defaultMaxIdle() {
+	/* enough for every core to have a warm state */
+	unsigned int cores = std::thread::hardware_concurrency();
+	return cores > 0 ? cores : 4;
+}
+
+void FileReaderStatePool::setMaxIdle(size_t maxIdle) {
+	std::vector<FileReaderState*> surplus;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_maxIdle = maxIdle;
+		while (m_idle.size() > m_maxIdle) {
+			surplus.push_back(m_idle.back());
+			m_idle.pop_back();
+		}
+	}
+	for (FileReaderState *state : surplus) m_file->finish(state);
+}
+
+FileReaderState* FileReaderStatePool::acquire() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_idle.empty()) return nullptr;
+	FileReaderState *state = m_idle.back();
+	m_idle.pop_back();
+	return state;
+}
+
+void FileReaderStatePool::release(FileReaderState* &state) {
+	if (nullptr == state) return;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_idle.size() < m_maxIdle) {
+			m_idle.push_back(state);
+			state = nullptr;
+			return;
+		}
+	}
+	m_file->finish(state);
+}
+
+void FileReaderStatePool::clear() {
+	/* finishing a state can release its readahead helper into the pool again */
+	for (;;) {
+		std::vector<FileReaderState*> idle;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			idle.swap(m_idle);
+		}
+		if (idle.empty()) return;
+		for (FileReaderState *state : idle) m_file->finish(state);
+	}
+}
+
+size_t FileReaderStatePool::idle() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_idle.size();
+}
+
+size_t FileReaderStatePool::idleBytes() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	size_t bytes = 0;
+	for (FileReaderState *state : m_idle) bytes += state->memoryUsage();
+	return bytes;
+}
+
+bool FileReaderStatePool::pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */, void (*makeIdle)(FileReaderState *state)) {
+	FileReaderState *state = acquire();
+	if (!m_file->readInto(state, offset, length, data, error)) {
+		/* don't reuse states after errors */
+		m_file->finish(state);
+		return false;
+	}
+	if (nullptr != makeIdle && nullptr != state) makeIdle(state);
+	release(state);
+	return true;
+}
+
+
 /********************************************************************************
  *                                                                              *
  *                                 NormalFile                                   *
@@ -36,7 +215,7 @@ public:
 };
 
 NormalFile::NormalFile(const char *filename, std::string &error /* out */)
-: m_fd(-1), m_filesize(0) {
+: m_fd(-1), m_filesize(0), m_mtime(0), m_mtimeNsec(0), m_device(0), m_inode(0) {
 	m_fd = open(filename, O_RDONLY);
 	if (-1 == m_fd) {
 		errnoFnameToSt("Couldn't open file", filename, error);
@@ -52,6 +231,18 @@ NormalFile::NormalFile(const char *filename, std::string &error /* out */)
 	}
 
 	m_filesize = st.st_size;
+	m_mtime = st.st_mtime;
+	m_mtimeNsec = statMtimeNsec(st);
+	m_device = st.st_dev;
+	m_inode = st.st_ino;
+}
+
+int64_t NormalFile::statMtimeNsec(const struct stat &st) {
+#ifdef HAVE_STAT_MTIM
+	return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	return (int64_t) st.st_mtime * 1000000000;
+#endif
 }
 
 NormalFile::~NormalFile() {
@@ -95,12 +286,13 @@ bool NormalFile::readInto(FileReaderState* &internalState, int64_t offset, ssize
 		return false;
 	}
 
-	if (length < 0 || offset < 0 || length > m_filesize || offset > m_filesize - length) {
+	int64_t filesize = m_filesize;
+	if (length < 0 || offset < 0 || length > filesize || offset > filesize - length) {
 		error.assign("Invalid offset/length");
 		return false;
 	}
 
-	ssize_t r = pread(m_fd, data, length, offset);
+	ssize_t r = ::pread(m_fd, data, length, offset);
 	if (r != length) {
 		if (r < 0) {
 			errnoToSt("Couldn't read file:", error);
@@ -123,6 +315,33 @@ void NormalFile::finish(FileReaderState* &internalState) {
 	}
 }
 
+#if !defined(ANDROID) || __ANDROID_API__ >= 21
+/* bionic only has posix_fadvise() since android-21 */
+# define HAVE_POSIX_FADVISE 1
+#endif
+
+void NormalFile::prefetch(int64_t offset, int64_t length, int) {
+	if (-1 == m_fd || offset < 0 || length <= 0) return;
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise(m_fd, offset, length, POSIX_FADV_WILLNEED); /* only a hint, ignore errors */
+#endif
+}
+
+void NormalFile::advise(int advice) {
+	if (-1 == m_fd) return;
+#ifdef HAVE_POSIX_FADVISE
+	int fadvice;
+	switch (advice) {
+	case ADVICE_SEQUENTIAL: fadvice = POSIX_FADV_SEQUENTIAL; break;
+	case ADVICE_RANDOM: fadvice = POSIX_FADV_RANDOM; break;
+	default: fadvice = POSIX_FADV_NORMAL; break;
+	}
+	posix_fadvise(m_fd, 0, 0, fadvice); /* only a hint, ignore errors */
+#else
+	(void) advice;
+#endif
+}
+
 /********************************************************************************
  *                                                                              *
  *                                MMappedFile                                   *
@@ -136,9 +355,110 @@ public:
 	size_t length;
 };
 
-MMappedFile::MMappedFile(const char *filename, std::string &error /* out */)
-: NormalFile(filename, error) {
+static int madviseFor(int advice) {
+	switch (advice) {
+	case IFile::ADVICE_SEQUENTIAL: return MADV_SEQUENTIAL;
+	case IFile::ADVICE_RANDOM: return MADV_RANDOM;
+	default: return MADV_NORMAL;
+	}
+}
+
+MMappedFile::MMappedFile(const char *filename, std::string &error /* out */, int flags)
+: NormalFile(filename, error), m_flags(flags), m_locked(false), m_advice(ADVICE_NORMAL), m_mapping(nullptr) {
 	m_pagesize = sysconf(_SC_PAGE_SIZE);
+
+	if (-1 != m_fd) {
+		std::string maperror;
+		mapFile(maperror); /* ignore errors, use fallback */
+	}
+}
+
+MMappedFile::~MMappedFile() {
+	Mapping *mapping = m_mapping.exchange(nullptr);
+	if (nullptr != mapping) m_oldMappings.push_back(mapping);
+
+	for (Mapping *m : m_oldMappings) {
+		if (m->length > 0) munmap(const_cast<unsigned char*>(m->addr), m->length); /* ignore errors */
+		delete m;
+	}
+	m_oldMappings.clear();
+}
+
+/* needs m_remapMutex (or exclusive access in constructor) */
+bool MMappedFile::mapFile(std::string &error /* out */) {
+	struct stat st;
+	if (-1 == fstat(m_fd, &st)) {
+		errnoToSt("Couldn't stat file:", error);
+		return false;
+	}
+
+	Mapping *old = m_mapping.load();
+	if (nullptr != old && old->length == st.st_size) return true;
+
+	if ((uint64_t) st.st_size > (uint64_t) std::numeric_limits<size_t>::max()) {
+		error.assign("File too large to map");
+		return false;
+	}
+
+	Mapping *mapping;
+	if (0 == st.st_size) {
+		/* can't mmap() empty files */
+		mapping = new Mapping(nullptr, 0);
+	} else {
+		int mapflags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if (0 != (m_flags & (PRELOAD | LOCK))) mapflags |= MAP_POPULATE;
+#endif
+		void *addr = mmap(NULL, st.st_size, PROT_READ, mapflags, m_fd, 0);
+		if (MAP_FAILED == addr) {
+			errnoToSt("Couldn't mmap file:", error);
+			return false;
+		}
+		mapping = new Mapping((const unsigned char*) addr, st.st_size);
+	}
+
+	bool locked = false;
+	if (0 != (m_flags & LOCK) && mapping->length > 0) {
+		locked = (0 == mlock(mapping->addr, mapping->length));
+	}
+#ifndef MAP_POPULATE
+	if (0 != (m_flags & (PRELOAD | LOCK)) && !locked && mapping->length > 0) {
+		madvise(const_cast<unsigned char*>(mapping->addr), mapping->length, MADV_WILLNEED);
+	}
+#endif
+
+	if (ADVICE_NORMAL != m_advice && mapping->length > 0) {
+		madvise(const_cast<unsigned char*>(mapping->addr), mapping->length, madviseFor(m_advice));
+	}
+
+	/* the old mapping stays mapped for running readers, but doesn't need to stay in RAM */
+	if (nullptr != old && m_locked && old->length > 0) munlock(old->addr, old->length);
+
+	m_filesize = st.st_size;
+	m_locked = locked;
+	m_mapping = mapping;
+	if (nullptr != old) m_oldMappings.push_back(old);
+
+	return true;
+}
+
+bool MMappedFile::mapped() {
+	return nullptr != m_mapping.load();
+}
+
+bool MMappedFile::remap(std::string &error /* out */) {
+	if (-1 == m_fd) {
+		error.assign("File not opened");
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_remapMutex);
+	return mapFile(error);
+}
+
+int64_t MMappedFile::filesize() {
+	Mapping *mapping = m_mapping.load();
+	return (nullptr != mapping) ? mapping->length : m_filesize.load();
 }
 
 bool MMappedFile::read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */) {
@@ -147,7 +467,21 @@ bool MMappedFile::read(FileReaderState* &internalState, int64_t offset, ssize_t
 		return false;
 	}
 
-	if (length < 0 || offset < 0 || length > m_filesize || offset > m_filesize - length) {
+	Mapping *mapping = m_mapping.load();
+	if (nullptr != mapping) {
+		/* no state needed */
+		if (length < 0 || offset < 0 || length > mapping->length || offset > mapping->length - length) {
+			error.assign("Invalid offset/length");
+			return false;
+		}
+
+		data = mapping->addr + offset;
+		datasize = length;
+		return true;
+	}
+
+	int64_t filesize = m_filesize;
+	if (length < 0 || offset < 0 || length > filesize || offset > filesize - length) {
 		error.assign("Invalid offset/length");
 		return false;
 	}
@@ -180,6 +514,19 @@ bool MMappedFile::read(FileReaderState* &internalState, int64_t offset, ssize_t
 	return true;
 }
 
+bool MMappedFile::readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	Mapping *mapping = m_mapping.load();
+	if (nullptr == mapping) return NormalFile::readInto(internalState, offset, length, data, error);
+
+	if (length < 0 || offset < 0 || length > mapping->length || offset > mapping->length - length) {
+		error.assign("Invalid offset/length");
+		return false;
+	}
+
+	memcpy(data, mapping->addr + offset, length);
+	return true;
+}
+
 void MMappedFile::finish(FileReaderState* &internalState) {
 	if (nullptr != internalState) {
 		MMappedFileReaderState *state = dynamic_cast<MMappedFileReaderState*>(internalState);
@@ -193,3 +540,137 @@ void MMappedFile::finish(FileReaderState* &internalState) {
 	}
 }
 
+void MMappedFile::prefetch(int64_t offset, int64_t length, int flags) {
+	Mapping *mapping = m_mapping.load();
+	if (nullptr == mapping) {
+		NormalFile::prefetch(offset, length, flags);
+		return;
+	}
+
+	if (offset < 0 || length <= 0 || offset >= mapping->length) return;
+	length = std::min(length, mapping->length - offset);
+	/* madvise() needs a page aligned start */
+	int64_t pagedistance = offset % m_pagesize;
+	madvise(const_cast<unsigned char*>(mapping->addr) + offset - pagedistance, length + pagedistance, MADV_WILLNEED); /* only a hint, ignore errors */
+}
+
+void MMappedFile::advise(int advice) {
+	NormalFile::advise(advice);
+
+	std::lock_guard<std::mutex> lock(m_remapMutex);
+	m_advice = advice;
+	Mapping *mapping = m_mapping.load();
+	if (nullptr != mapping && mapping->length > 0) {
+		madvise(const_cast<unsigned char*>(mapping->addr), mapping->length, madviseFor(advice));
+	}
+}
+
+
+/********************************************************************************
+ *                                                                              *
+ *                                 MemoryFile                                   *
+ *                                                                              *
+ ********************************************************************************/
+
+MemoryFile::MemoryFile(const unsigned char *data, int64_t size)
+: m_data(data), m_size(size), m_valid(true) {
+	assert(size >= 0);
+}
+
+MemoryFile::MemoryFile(std::unique_ptr<unsigned char[]> data, int64_t size)
+: m_storage(std::move(data)), m_data(m_storage.get()), m_size(size), m_valid(true) {
+	assert(size >= 0);
+}
+
+MemoryFile::MemoryFile(const char *filename, std::string &error /* out */)
+: m_data(nullptr), m_size(0), m_valid(false) {
+	int fd = open(filename, O_RDONLY);
+	if (-1 == fd) {
+		errnoFnameToSt("Couldn't open file", filename, error);
+		return;
+	}
+
+	struct stat st;
+	if (-1 == fstat(fd, &st)) {
+		errnoFnameToSt("Couldn't stat file", filename, error);
+		close(fd);
+		return;
+	}
+
+	if ((uint64_t) st.st_size > (uint64_t) std::numeric_limits<size_t>::max()) {
+		error.assign("File too large to load into memory");
+		close(fd);
+		return;
+	}
+
+	std::unique_ptr<unsigned char[]> storage(new unsigned char[st.st_size > 0 ? st.st_size : 1]);
+	int64_t have = 0;
+	while (have < st.st_size) {
+		size_t chunk = (size_t) std::min<int64_t>(st.st_size - have, 64*1024*1024);
+		ssize_t r = ::pread(fd, storage.get() + have, chunk, have);
+		if (r < 0) {
+			if (EINTR == errno) continue;
+			errnoFnameToSt("Couldn't read file", filename, error);
+			close(fd);
+			return;
+		}
+		if (0 == r) {
+			error.assign("Unexpected end of file (file shrinked while reading)");
+			close(fd);
+			return;
+		}
+		have += r;
+	}
+	close(fd);
+
+	m_storage = std::move(storage);
+	m_data = m_storage.get();
+	m_size = st.st_size;
+	m_valid = true;
+}
+
+MemoryFile::~MemoryFile() {
+}
+
+int64_t MemoryFile::filesize() {
+	return m_size;
+}
+
+bool MemoryFile::read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */) {
+	(void) internalState; /* no state needed */
+	if (!m_valid) {
+		error.assign("File not opened");
+		return false;
+	}
+	if (length < 0 || offset < 0 || length > m_size || offset > m_size - length) {
+		error.assign("Invalid offset/length");
+		return false;
+	}
+
+	data = m_data + offset;
+	datasize = length;
+	return true;
+}
+
+bool MemoryFile::readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	return pread(offset, length, data, error);
+}
+
+void MemoryFile::finish(FileReaderState* &internalState) {
+	assert(nullptr == internalState);
+	internalState = nullptr;
+}
+
+bool MemoryFile::pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	if (!m_valid) {
+		error.assign("File not opened");
+		return false;
+	}
+	if (length < 0 || offset < 0 || length > m_size || offset > m_size - length) {
+		error.assign("Invalid offset/length");
+		return false;
+	}
+
+	memcpy(data, m_data + offset, length);
+	return true;
+}
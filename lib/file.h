@@ -5,8 +5,12 @@
 #include <cstdint>
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 /**
  * each IFile implementation can allocate a state object;
@@ -21,8 +25,45 @@ protected:
 	FileReaderState() { }
 	FileReaderState(const FileReaderState &) { }
 	FileReaderState& operator=(const FileReaderState &);
+
+public:
+	/** bytes of decoder memory and buffers held by the state (see FileReaderStatePool::idleBytes()) */
+	virtual size_t memoryUsage() const { return 0; }
+};
+
+/**
+ * one part of a scatter/gather read (see IFile::readMany):
+ * read exactly length bytes from offset into data
+ */
+struct ReadRequest {
+	int64_t offset;
+	ssize_t length;
+	unsigned char *data;
 };
 
+/** copy length bytes from src to dst after the reads have been finished */
+struct ReadCopy {
+	unsigned char *dst;
+	const unsigned char *src;
+	ssize_t length;
+};
+
+/**
+ * helper for readMany() implementations: sorts the requests by offset and splits them into
+ * non-overlapping reads (sorted by offset) and copies for the overlapping parts; the copies
+ * have to be executed in the given order after all reads are done (see finishReadCopies).
+ * empty requests are dropped.
+ */
+void planReadMany(const std::vector<ReadRequest> &requests, std::vector<ReadRequest> &reads /* out */, std::vector<ReadCopy> &copies /* out */);
+void finishReadCopies(const std::vector<ReadCopy> &copies);
+
+class IFile;
+/**
+ * fill the (independent) requests with file->pread() in parallel on the process wide WorkerPool
+ * (see worker-pool.h); compressed files use it to decode large reads split at block boundaries.
+ */
+bool parallelPread(IFile *file, const std::vector<ReadRequest> &requests, std::string &error /* out */);
+
 /**
  * random access file abstraction
  */
@@ -33,6 +74,19 @@ protected:
 	IFile& operator=(const IFile &);
 
 public:
+	enum Advice {
+		ADVICE_NORMAL = 0,
+		/** reads will mostly follow each other: read ahead more */
+		ADVICE_SEQUENTIAL = 1,
+		/** reads will be scattered: don't read ahead */
+		ADVICE_RANDOM = 2,
+	};
+
+	enum PrefetchFlags {
+		/** compressed files: also decode the blocks in the background (into the BlockCache, if they fit) */
+		PREFETCH_DECODE = 1,
+	};
+
 	virtual ~IFile() { };
 
 	/* these should be thread safe (assuming each thread has its own state) */
@@ -40,6 +94,8 @@ public:
 	/**
 	 * read up to length bytes from given file offset, storing a pointer to the data in data
 	 * and storing the amount of actuall read bytes in datasize
+	 * (compressed files return up to the end of the current block; small blocks are returned
+	 * completely from the decoded block without copying)
 	 *
 	 * returns true on successful read and false otherwise; on error an error message is stored in error.
 	 * the requested range offset/length should be valid for the file; the method may still succeed by returning less data,
@@ -55,10 +111,78 @@ public:
 	 * also reads exactly length bytes - or throws an error.
 	 */
 	virtual bool readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) = 0;
+	/**
+	 * scatter/gather version of readInto: fills all requests (in any order; requests may overlap).
+	 * the default implementation sorts the requests and calls readInto for the non-overlapping parts.
+	 * on error the content of all destinations is undefined.
+	 */
+	virtual bool readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */);
 	/**
 	 * free the internalState. does nothing if internalState is nullptr, and resets internalState to nullptr.
 	 */
 	virtual void finish(FileReaderState* &internalState) = 0;
+
+	/**
+	 * same as readInto, but without a caller managed state; thread safe.
+	 * the default implementation uses a temporary state, compressed files
+	 * reuse idle states from an internal pool.
+	 */
+	virtual bool pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+
+	/**
+	 * hint that the range will be read soon; returns immediately (the data is fetched in the background).
+	 * plain files let the kernel read the range into the page cache, compressed files prefetch the
+	 * compressed blocks covering the range (see PrefetchFlags). the default implementation does nothing.
+	 */
+	virtual void prefetch(int64_t offset, int64_t length, int flags = 0);
+	/** hint about the access pattern of the whole file (see Advice); the default implementation does nothing */
+	virtual void advise(int advice);
+
+	void adviseSequential() { advise(ADVICE_SEQUENTIAL); }
+	void adviseRandom() { advise(ADVICE_RANDOM); }
+};
+
+/**
+ * bounded pool of idle states for a file (used to implement IFile::pread).
+ * thread safe. the owning file has to clear() the pool in its destructor.
+ */
+class FileReaderStatePool {
+private:
+	FileReaderStatePool();
+	FileReaderStatePool(const FileReaderStatePool &);
+	FileReaderStatePool& operator=(const FileReaderStatePool &);
+
+	IFile *m_file;
+	std::mutex m_mutex;
+	std::vector<FileReaderState*> m_idle;
+	size_t m_maxIdle;
+
+public:
+	FileReaderStatePool(IFile *file, size_t maxIdle);
+	~FileReaderStatePool();
+
+	/** maximum number of idle states to keep; finishes states above the new limit */
+	void setMaxIdle(size_t maxIdle);
+
+	/** returns an idle state or nullptr (a new state will be created by the file then) */
+	FileReaderState* acquire();
+	/** put state back into the pool; finishes it if the pool is full. resets state to nullptr */
+	void release(FileReaderState* &state);
+	/** finish all idle states */
+	void clear();
+	/** number of idle states */
+	size_t idle();
+	/** memory held by the idle states (see FileReaderState::memoryUsage()) */
+	size_t idleBytes();
+
+	/**
+	 * IFile::pread() implementation: readInto() with an idle (or new) state, which is put back
+	 * afterwards (after calling makeIdle on it, if set); states are finished after errors.
+	 */
+	bool pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */, void (*makeIdle)(FileReaderState *state) = nullptr);
+
+	/** default maximum of idle states per file */
+	static size_t defaultMaxIdle();
 };
 
 typedef std::shared_ptr<IFile> File;
@@ -180,6 +304,20 @@ public:
 		return true;
 	}
 
+	/**
+	 * read as much as the file returns at once (up to the end of the selected range);
+	 * compressed files return (the rest of) a complete decoded block without copying.
+	 * the data is valid until the next call. eof() is signaled by returning zero datasize
+	 */
+	bool readBlock(const unsigned char* &data /* out */, ssize_t &datasize /* out */) {
+		if (0 == m_length) {
+			data = nullptr;
+			datasize = 0;
+			return true;
+		}
+		return read((ssize_t) std::min<int64_t>(m_length, std::numeric_limits<ssize_t>::max()), data, datasize);
+	}
+
 	/**
 	 * read exactly datasize bytes into data
 	 */
@@ -199,6 +337,18 @@ public:
 		m_length -= datasize;
 		return true;
 	}
+
+	/**
+	 * read all requests (absolute file offsets); doesn't change the selected range
+	 */
+	bool readMany(const std::vector<ReadRequest> &requests) {
+		if (nullptr == m_file.get()) {
+			m_lastError.assign("File not opened");
+			return false;
+		}
+
+		return m_file->readMany(m_state, requests, m_lastError);
+	}
 };
 
 
@@ -211,38 +361,147 @@ private:
 
 protected:
 	int m_fd;
-	int64_t m_filesize;
+	std::atomic<int64_t> m_filesize;
+	int64_t m_mtime, m_mtimeNsec;
+	uint64_t m_device, m_inode;
 
 public:
 	NormalFile(const char *filename, std::string &error /* out */);
 	virtual ~NormalFile();
 
 	bool valid(); /** whether open() in the constructor succeeded */
+	/** modification time (seconds since the epoch) when the file was opened */
+	int64_t mtime() const { return m_mtime; }
+	/** the same in nanoseconds (see statMtimeNsec()) */
+	int64_t mtimeNsec() const { return m_mtimeNsec; }
+	/** st_mtime in nanoseconds since the epoch; only whole seconds if struct stat has no st_mtim (HAVE_STAT_MTIM) */
+	static int64_t statMtimeNsec(const struct stat &st);
+	/** identity of the opened file (st_dev / st_ino) */
+	uint64_t device() const { return m_device; }
+	uint64_t inode() const { return m_inode; }
 
 	virtual int64_t filesize();
 	virtual bool read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */);
 	/** special case: does not use the state */
 	virtual bool readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
 	virtual void finish(FileReaderState* &internalState);
+
+	/** posix_fadvise(POSIX_FADV_WILLNEED) */
+	virtual void prefetch(int64_t offset, int64_t length, int flags = 0);
+	/** posix_fadvise() for the whole file */
+	virtual void advise(int advice);
 };
 
-/* uses mmap() instead of pread() */
+/**
+ * uses mmap() instead of pread()
+ *
+ * tries to map the complete file once in the constructor; reads then just return
+ * pointers into the mapping (readInto() is a memcpy()), i.e. no syscalls at all.
+ * if mapping the complete file fails (not enough address space on 32-bit systems)
+ * it falls back to mmap()ing each requested range separately.
+ *
+ * with PRELOAD / LOCK the complete mapping is faulted in (and optionally locked
+ * into RAM) when it is created, so later reads never hit the page fault path.
+ */
 class MMappedFile : public NormalFile {
 private:
 	MMappedFile();
 	MMappedFile(const IFile &);
 	MMappedFile& operator=(const MMappedFile &);
 
+public:
+	enum Flags {
+		/** read the complete file into the page cache and populate the mapping when mapping it */
+		PRELOAD = 1,
+		/** mlock() the complete mapping (implies PRELOAD); silently skipped if it fails (RLIMIT_MEMLOCK) */
+		LOCK = 2,
+	};
+
 protected:
+	struct Mapping {
+		Mapping(const unsigned char *addr, int64_t length) : addr(addr), length(length) { }
+		const unsigned char *addr;
+		int64_t length;
+	};
+
 	int m_pagesize; /** cache sysconf(_SC_PAGE_SIZE) */
+	int m_flags;
+	std::atomic<bool> m_locked; /** whether the current mapping is mlock()ed */
+	std::atomic<int> m_advice; /** last advise(), applied to new mappings too */
+
+	std::atomic<Mapping*> m_mapping; /** complete file mapping; nullptr if not mapped */
+	std::vector<Mapping*> m_oldMappings; /** mappings replaced by remap(), kept until destruction as they might still be in use */
+	std::mutex m_remapMutex;
+
+	bool mapFile(std::string &error /* out */);
 
 public:
-	MMappedFile(const char *filename, std::string &error /* out */);
+	MMappedFile(const char *filename, std::string &error /* out */, int flags = 0);
+	virtual ~MMappedFile();
+
+	/** whether the complete file is mapped (or we fall back to a mmap() per read) */
+	bool mapped();
+	/** whether the complete mapping is locked into RAM (see LOCK) */
+	bool locked() { return m_locked; }
 
-	/** always mmap()s the complete requested range */
+	/**
+	 * check the file size again and map the complete (grown) file.
+	 * pointers returned from earlier reads stay valid until the file is destroyed.
+	 * thread safe.
+	 */
+	bool remap(std::string &error /* out */);
+
+	virtual int64_t filesize();
+	/** returns a pointer into the complete mapping if available, otherwise mmap()s the complete requested range */
 	virtual bool read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */);
+	/** memcpy() from the complete mapping if available, otherwise just use NormalFile::readInto; NormalFile::readInto does not use state, so the mmap state doesn't conflict with it */
+	virtual bool readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+	virtual void finish(FileReaderState* &internalState);
+
+	/** madvise(MADV_WILLNEED) on the complete mapping if available, otherwise see NormalFile */
+	virtual void prefetch(int64_t offset, int64_t length, int flags = 0);
+	/** madvise() for the complete mapping (and posix_fadvise()) */
+	virtual void advise(int advice);
+};
+
+/**
+ * file contents in memory: either a caller owned buffer (which has to stay valid
+ * and unchanged while the file is in use) or an owned buffer, for example a complete
+ * archive read from disk in the constructor.
+ *
+ * reads return pointers into the buffer; doesn't use states, everything is thread safe.
+ */
+class MemoryFile : public IFile {
+private:
+	MemoryFile();
+	MemoryFile(const IFile &);
+	MemoryFile& operator=(const MemoryFile &);
+
+protected:
+	std::unique_ptr<unsigned char[]> m_storage; /** owned buffer (nullptr for caller owned memory) */
+	const unsigned char *m_data;
+	int64_t m_size;
+	bool m_valid;
+
+public:
+	/** wrap caller owned memory (not copied) */
+	MemoryFile(const unsigned char *data, int64_t size);
+	/** take ownership of data */
+	MemoryFile(std::unique_ptr<unsigned char[]> data, int64_t size);
+	/** read the complete file into memory */
+	MemoryFile(const char *filename, std::string &error /* out */);
+	virtual ~MemoryFile();
+
+	bool valid() { return m_valid; } /** whether reading the file in the constructor succeeded */
+
+	const unsigned char* data() const { return m_data; }
+
+	virtual int64_t filesize();
+	virtual bool read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */);
+	virtual bool readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
 	virtual void finish(FileReaderState* &internalState);
-	/** readInto with mmap() doesn't make sense, so just use NormalFile::readInto; NormalFile::readInto does not use state, so the mmap state doesn't conflict with it */
+	/** just a memcpy() */
+	virtual bool pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
 };
 
 #endif
@@ -0,0 +1,94 @@
+#include "huge-pages.h"
+
+#include <atomic>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* size of a (default) huge page; mappings are aligned to it */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+static std::atomic<int> g_mode(HugePages::OFF);
+static std::atomic<size_t> g_mappedBytes[3];
+
+static size_t pageSize() {
+	static size_t size = (size_t) sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+static size_t roundUp(size_t size, size_t alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+/* mapped length of an allocation */
+static size_t mappedLength(size_t size, int kind) {
+	return roundUp(size, (HugePages::EXPLICIT == kind) ? HUGE_PAGE_SIZE : pageSize());
+}
+
+/* map length bytes starting at a huge page boundary */
+static void* mapAligned(size_t length) {
+	size_t mapLength = length + HUGE_PAGE_SIZE;
+	void *ptr = mmap(nullptr, mapLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == ptr) return nullptr;
+
+	uintptr_t start = (uintptr_t) ptr;
+	uintptr_t aligned = roundUp(start, HUGE_PAGE_SIZE);
+	size_t head = aligned - start, tail = mapLength - head - length;
+	if (head > 0) munmap(ptr, head);
+	if (tail > 0) munmap((void*) (aligned + length), tail);
+	return (void*) aligned;
+}
+
+void HugePages::setMode(int mode) {
+	g_mode = (mode >= OFF && mode <= EXPLICIT) ? mode : OFF;
+}
+
+int HugePages::mode() {
+	return g_mode;
+}
+
+size_t HugePages::minSize() {
+	return HUGE_PAGE_SIZE;
+}
+
+void* HugePages::allocate(size_t size, int &kind /* out */) {
+	kind = OFF;
+	int mode = g_mode;
+	if (OFF == mode || 0 == size) return nullptr;
+
+#if defined(MAP_HUGETLB)
+	if (EXPLICIT == mode) {
+		size_t length = mappedLength(size, EXPLICIT);
+		void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (MAP_FAILED != ptr) {
+			kind = EXPLICIT;
+			g_mappedBytes[EXPLICIT] += length;
+			return ptr;
+		}
+		/* no (free) reserved huge pages */
+	}
+#endif
+
+	size_t length = mappedLength(size, TRANSPARENT);
+	void *ptr = mapAligned(length);
+	if (nullptr == ptr) return nullptr;
+#if defined(MADV_HUGEPAGE)
+	/* only a hint; fails if the kernel has no transparent huge pages */
+	madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+	kind = TRANSPARENT;
+	g_mappedBytes[TRANSPARENT] += length;
+	return ptr;
+}
+
+void HugePages::release(void *ptr, size_t size, int kind) {
+	if (nullptr == ptr || OFF == kind) return;
+	size_t length = mappedLength(size, kind);
+	munmap(ptr, length);
+	g_mappedBytes[kind] -= length;
+}
+
+size_t HugePages::mappedBytes(int kind) {
+	return (kind > OFF && kind <= EXPLICIT) ? g_mappedBytes[kind].load() : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __MY_HUGE_PAGES_H
+#define __MY_HUGE_PAGES_H __MY_HUGE_PAGES_H
+
+#include <cstddef>
+
+/**
+ * anonymous mappings backed by huge pages for large buffers with random access (lzma
+ * dictionaries, decoded blocks), to reduce TLB misses while decoding.
+ *
+ * TRANSPARENT maps 2MB aligned memory and asks for transparent huge pages with
+ * madvise(MADV_HUGEPAGE) (the tail beyond the last full huge page uses normal pages);
+ * EXPLICIT uses MAP_HUGETLB (needs reserved huge pages, see /proc/sys/vm/nr_hugepages;
+ * the size is rounded up to a full huge page) and falls back to TRANSPARENT.
+ *
+ * allocations below minSize() are left to malloc; allocate() returns nullptr if
+ * mapping fails, the caller falls back to malloc too.
+ */
+class HugePages {
+private:
+	HugePages();
+
+public:
+	enum Mode {
+		OFF = 0,
+		TRANSPARENT = 1,
+		EXPLICIT = 2,
+	};
+
+	/**
+	 * mode for new allocations (default: OFF). huge pages are opt-in: a touched huge page is resident
+	 * as a whole, EXPLICIT rounds sizes up to full huge pages, and faults may stall on memory compaction
+	 */
+	static void setMode(int mode);
+	static int mode();
+
+	/** smallest allocation that is worth a mapping */
+	static size_t minSize();
+	/** whether allocate() should be used for size bytes in the current mode */
+	static bool suitable(size_t size) { return OFF != mode() && size >= minSize(); }
+
+	/** kind (out) is the Mode actually used, has to be passed to release() */
+	static void* allocate(size_t size, int &kind /* out */);
+	static void release(void *ptr, size_t size, int kind);
+
+	/** bytes currently mapped with the given kind */
+	static size_t mappedBytes(int kind);
+};
+
+#endif
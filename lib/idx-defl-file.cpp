@@ -1,5 +1,14 @@
 #include "idx-defl-file.h"
 
+#include "block-cache.h"
+#include "crc32c.h"
+#include "decoder-arena.h"
+#include "memory-budget.h"
+#include "readahead.h"
+#include "sidecar-index.h"
+
+#include <algorithm>
+#include <limits>
 #include <sstream>
 
 #include <arpa/inet.h>
@@ -24,6 +33,21 @@
 # define LOG_VERBOSE(...) do { } while(0)
 #endif
 
+/* blocks up to this size are decoded completely and kept in the state */
+#define MAX_PINNED_BLOCK_SIZE (4*1024*1024)
+/* maximum size read() returns at once for blocks too large to keep them completely */
+#define MAX_READ_WINDOW (4*1024*1024)
+/* readInto() requests of at least this size are split at block boundaries and decoded in parallel */
+#define PARALLEL_READ_MIN_LENGTH (4*1024*1024)
+/* (minimum) size of the pieces of a parallel read */
+#define PARALLEL_READ_PIECE (2*1024*1024)
+/* maximum memory for the index of a file (without a MemoryBudget limit) */
+#define IDXDEFL_INDEX_MEMLIMIT (16*1024*1024)
+/* read() returns (up to) this many bytes of zero blocks at once from a shared buffer */
+#define ZERO_BUFFER_SIZE (64*1024)
+
+static const unsigned char zero_buffer[ZERO_BUFFER_SIZE] = { 0 };
+
 static void errnoZToStr(const char *prefix, int res, std::string &error) {
 	std::ostringstream s;
 	s << prefix << ": ";
@@ -63,24 +87,81 @@ static void errnoZToStr(const char *prefix, int res, std::string &error) {
 	error.assign(s.str());
 }
 
+/* zlib memory comes from the DecoderArena; opaque points to the byte counter of the state */
+static voidpf arenaZAlloc(voidpf opaque, uInt items, uInt size) {
+	void *ptr = DecoderArena::instance().allocate((size_t) items * size);
+	if (nullptr != ptr) *static_cast<size_t*>(opaque) += (size_t) items * size;
+	MemoryBudget::instance().decodersChanged();
+	return ptr;
+}
+
+static void arenaZFree(voidpf opaque, voidpf address) {
+	*static_cast<size_t*>(opaque) -= DecoderArena::allocationSize(address);
+	DecoderArena::instance().release(address);
+}
+
 class IndexedDeflateFileIndex;
 class IndexedDeflateFileIndexIter;
 
 class IndexedDeflateFileIndex {
 public:
-	uint32_t block_size, blocks;
+	int version; /* IDXDEFL_VERSION_1 (zlib blocks) or IDXDEFL_VERSION_2 (raw deflate blocks) */
+	int checksum_type; /* IDXDEFL_CHECKSUM_* */
+	uint32_t block_size; /* size of all blocks but the last (which isn't larger); 0: see uncompressed_offsets */
+	uint64_t blocks;
 	int64_t uncompressed_size, compressed_size;
-	int64_t *offsets;
-
-	IndexedDeflateFileIndex(uint32_t block_size, uint32_t blocks, int64_t uncompressed_size, int64_t compressed_size, int64_t *offsets)
-	: block_size(block_size), blocks(blocks), uncompressed_size(uncompressed_size), compressed_size(compressed_size), offsets(offsets) {
+	const int64_t *offsets; /* blocks + 1 file offsets (the last one is the start of the index) */
+	const int64_t *uncompressed_offsets; /* blocks + 1 uncompressed offsets if block_size is 0, otherwise nullptr */
+	const uint32_t *checksums; /* one per block, unless checksum_type is IDXDEFL_CHECKSUM_NONE */
+	const unsigned char *types; /* IDXDEFL_BLOCK_* per block (v2 with IDXDEFL_FLAG_BLOCK_TYPES), otherwise nullptr (all deflate) */
+	const uint64_t *references; /* (block, source block) pairs of the IDXDEFL_BLOCK_REFERENCE blocks, sorted by block */
+	uint64_t reference_count;
+	/* mapped sidecar index the arrays point into; the arrays are owned if not set */
+	File sidecar;
+	std::vector<unsigned char> dictionary; /* preset dictionary of all blocks (v2), or empty */
+
+	IndexedDeflateFileIndex(uint32_t block_size, uint64_t blocks, int64_t uncompressed_size, int64_t compressed_size, const int64_t *offsets, File sidecar = File())
+	: version(IDXDEFL_VERSION_1), checksum_type(IDXDEFL_CHECKSUM_NONE), block_size(block_size), blocks(blocks),
+	  uncompressed_size(uncompressed_size), compressed_size(compressed_size), offsets(offsets), uncompressed_offsets(nullptr), checksums(nullptr),
+	  types(nullptr), references(nullptr), reference_count(0), sidecar(sidecar) {
 	}
 
 	~IndexedDeflateFileIndex() {
-		if (nullptr != offsets) {
+		if (!sidecar) {
 			delete[] offsets;
-			offsets = nullptr;
+			delete[] uncompressed_offsets;
+			delete[] checksums;
+			delete[] types;
+			delete[] references;
+		}
+		offsets = uncompressed_offsets = nullptr;
+		checksums = nullptr;
+		types = nullptr;
+		references = nullptr;
+	}
+
+	size_t memoryUsage() const {
+		if (sidecar) return sizeof(*this) + dictionary.size();
+		return sizeof(*this) + dictionary.size() + (blocks + 1) * sizeof(int64_t)
+			+ (uncompressed_offsets ? (blocks + 1) * sizeof(int64_t) : 0)
+			+ (checksums ? blocks * sizeof(uint32_t) : 0)
+			+ (types ? blocks : 0) + reference_count * 2 * sizeof(uint64_t);
+	}
+
+	/* the block a IDXDEFL_BLOCK_REFERENCE block is a copy of */
+	bool referenceSource(uint64_t block, uint64_t &source /* out */) const {
+		uint64_t lo = 0, hi = reference_count;
+		while (lo < hi) {
+			uint64_t mid = lo + (hi - lo) / 2;
+			if (references[2*mid] < block) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
 		}
+		if (lo == reference_count || references[2*lo] != block) return false;
+		source = references[2*lo + 1];
+		return true;
 	}
 };
 
@@ -91,17 +172,39 @@ public:
 	IndexedDeflateFileIndexIter(IndexedDeflateFileIndex *index) : m_index(index) { }
 
 	bool seek(int64_t offset) {
-		if (offset < 0 || offset > m_index->uncompressed_size) return false;
-		int64_t block = offset / m_index->block_size;
+		if (offset < 0 || offset >= m_index->uncompressed_size) return false;
+		if (nullptr != m_index->uncompressed_offsets) {
+			/* last block starting at or before offset (empty blocks only exist in empty files) */
+			const int64_t *begin = m_index->uncompressed_offsets, *end = begin + m_index->blocks + 1;
+			block = std::upper_bound(begin, end, offset) - begin - 1;
+		} else {
+			block = offset / m_index->block_size;
+		}
 		LOG_VERBOSE("calculated block %i (%i)\n", (int) block, (int) m_index->blocks);
-		if (block >= m_index->blocks) return false; // shouldn't happen anyway...
-		compressed_offset = m_index->offsets[block];
-		compressed_length = m_index->offsets[block+1] - compressed_offset;
-		uncompressed_offset = block * m_index->block_size;
-		if (block + 1 == m_index->blocks) {
-			uncompressed_length = m_index->uncompressed_size - (m_index->blocks - 1) * (int64_t) m_index->block_size;
+		if (block < 0 || (uint64_t) block >= m_index->blocks) return false; // shouldn't happen anyway...
+		/* references use the data (and cache entry) of their source block */
+		source = block;
+		type = (nullptr != m_index->types) ? m_index->types[block] : IDXDEFL_BLOCK_DEFLATE;
+		if (IDXDEFL_BLOCK_REFERENCE == type) {
+			uint64_t found;
+			if (!m_index->referenceSource(block, found) || found >= (uint64_t) block) return false; // broken sidecar
+			source = found;
+			type = m_index->types[source];
+			if (IDXDEFL_BLOCK_REFERENCE == type) return false;
+		}
+		compressed_offset = m_index->offsets[source];
+		compressed_length = m_index->offsets[source+1] - compressed_offset;
+		if (nullptr != m_index->uncompressed_offsets) {
+			uncompressed_offset = m_index->uncompressed_offsets[block];
+			uncompressed_length = m_index->uncompressed_offsets[block+1] - uncompressed_offset;
+			if (uncompressed_length < 0) return false; // broken sidecar
 		} else {
-			uncompressed_length = m_index->block_size;
+			uncompressed_offset = block * (int64_t) m_index->block_size;
+			if ((uint64_t) block + 1 == m_index->blocks) {
+				uncompressed_length = m_index->uncompressed_size - uncompressed_offset;
+			} else {
+				uncompressed_length = m_index->block_size;
+			}
 		}
 		LOG_VERBOSE("seeked offset: %i, coff: %i, clen: %i, uoff: %i, ulen: %i\n",
 			(int) offset, (int) compressed_offset, (int) compressed_length, (int) uncompressed_offset, (int) uncompressed_length);
@@ -111,13 +214,18 @@ public:
 		return seek(uncompressed_offset + uncompressed_length);
 	}
 
+	int64_t block;
+	int64_t source; /* block with the data: the referenced block for IDXDEFL_BLOCK_REFERENCE, otherwise block */
+	int type; /* IDXDEFL_BLOCK_* of source */
 	int64_t compressed_offset, compressed_length;
 	int64_t uncompressed_offset, uncompressed_length;
 };
 
 class IndexedDeflateFileReaderState : public FileReaderState {
 public:
+	IndexedDeflateFileIndex *index;
 	z_stream strm;
+	size_t decoderBytes; /* memory of strm (counted by the arena hooks) */
 
 	int64_t position; /* uncompressed offset of outputBuffer[0] (NOT strm->next_out!) */
 	IndexedDeflateFileIndexIter iter;
@@ -128,10 +236,68 @@ public:
 	unsigned char defaultOutputBuffer[4096];
 
 	FileReader reader;
-
-	IndexedDeflateFileReaderState(File file, IndexedDeflateFileIndex *index)
-	: iter(index), currentBuffer(nullptr), currentBufferSize(0), reader(file) {
+	/* state of the underlying file for stored blocks (independent of the decoder input in reader) */
+	FileReaderState *rawState;
+
+	/* last decodeFillBuffer() call reached the end of the block */
+	bool blockEnd;
+
+	bool strmInitialized; /* inflateInit2() was successful; blocks afterwards only need inflateReset() */
+
+	/* block cache key of the file */
+	uint64_t cacheId;
+	/* block of the last lookup (if cacheIterValid), and its decoded data if it is small enough to keep it */
+	IndexedDeflateFileIndexIter cacheIter;
+	bool cacheIterValid;
+	DecodedBlockPtr cachedBlock; /* allocation might be kept for the next block if it isn't shared (with the BlockCache), see cachedBlockValid */
+	bool cachedBlockValid;
+
+	/* buffer for read() with large blocks */
+	std::unique_ptr<unsigned char[]> window;
+	size_t windowSize;
+
+	/* decodes the following blocks in the background for sequential readers */
+	IndexedDeflateFileIndexIter readaheadIter;
+	Readahead readahead;
+
+	/* pool: the idle states of the file, also used for the readahead helpers */
+	IndexedDeflateFileReaderState(File file, IndexedDeflateFileIndex *index, uint64_t cacheId, FileReaderStatePool *pool)
+	: index(index), iter(index), currentBuffer(nullptr), currentBufferSize(0), reader(file), rawState(nullptr), blockEnd(false), strmInitialized(false),
+	  cacheId(cacheId), cacheIter(index), cacheIterValid(false), cachedBlockValid(false), windowSize(0),
+	  readaheadIter(index),
+	  readahead(
+		[this](int64_t blockOffset, int64_t &nextOffset, size_t &nextSize) {
+			if (!readaheadIter.seek(blockOffset) || !readaheadIter.next()) return false;
+			nextOffset = readaheadIter.uncompressed_offset;
+			nextSize = readaheadIter.uncompressed_length;
+			return true;
+		},
+		[file, index, cacheId, pool]() -> FileReaderState* {
+			FileReaderState *helper = pool->acquire();
+			return (nullptr != helper) ? helper : new IndexedDeflateFileReaderState(file, index, cacheId, pool);
+		},
+		[index](FileReaderState *helper, int64_t blockOffset, unsigned char *buf, size_t size, std::string &error) {
+			IndexedDeflateFileIndexIter blockIter(index);
+			if (!blockIter.seek(blockOffset) || blockIter.uncompressed_length != (int64_t) size) {
+				error.assign("couldn't find block in index");
+				return false;
+			}
+			return static_cast<IndexedDeflateFileReaderState*>(helper)->decodeBlock(blockIter, buf, error);
+		},
+		[pool](FileReaderState* &helper, bool success) {
+			if (success) {
+				pool->release(helper);
+			} else {
+				/* don't reuse states after errors */
+				delete static_cast<IndexedDeflateFileReaderState*>(helper);
+				helper = nullptr;
+			}
+		}) {
 		memset(&strm, 0, sizeof(strm));
+		strm.zalloc = arenaZAlloc;
+		strm.zfree = arenaZFree;
+		decoderBytes = 0;
+		strm.opaque = &decoderBytes;
 
 		position = -1;
 		selectDefaultBuffer();
@@ -141,7 +307,10 @@ public:
 
 	void selectDefaultBuffer() {
 		LOG_VERBOSE("selectDefaultBuffer\n");
-		if (defaultOutputBuffer != currentBuffer) selectBuffer(defaultOutputBuffer, sizeof(defaultOutputBuffer));
+		/* selectBuffer flushes the current buffer, so only call it when necesary */
+		if (defaultOutputBuffer != currentBuffer || sizeof(defaultOutputBuffer) != currentBufferSize) {
+			selectBuffer(defaultOutputBuffer, sizeof(defaultOutputBuffer));
+		}
 	}
 
 	void selectBuffer(unsigned char *buf, size_t size) {
@@ -153,9 +322,15 @@ public:
 		strm.avail_out = currentBufferSize;
 	}
 
+	virtual size_t memoryUsage() const {
+		/* cachedBlock only counts while it isn't shared with the BlockCache */
+		return decoderBytes + windowSize + ((cachedBlock && 1 == cachedBlock.use_count()) ? cachedBlock->size : 0);
+	}
+
 	~IndexedDeflateFileReaderState() {
 		LOG_VERBOSE("~IndexedDeflateFileReaderState\n");
-		inflateEnd(&strm);
+		if (strmInitialized) inflateEnd(&strm);
+		reader.file()->finish(rawState);
 	}
 
 	size_t availableBytes() {
@@ -167,7 +342,9 @@ public:
 			const unsigned char *data;
 			ssize_t datasize;
 			LOG_VERBOSE("fill_input_buffer: reading at offset %i\n", (int) reader.offset());
-			if (!reader.read(4*1024, data, datasize)) {
+			/* the reader is limited to the current block: with a mapped file this
+			 * hands the complete compressed block to the decoder in one piece */
+			if (!reader.readBlock(data, datasize)) {
 				error.assign(reader.lastError());
 				return false;
 			}
@@ -187,6 +364,11 @@ public:
 	bool loadBlock(std::string &error) {
 		position = -1;
 
+		if (IDXDEFL_BLOCK_DEFLATE != iter.type) {
+			error.assign("block is not deflate compressed");
+			return false;
+		}
+
 		//LOG_VERBOSE("seeking to offset %i", (int) iter.compressed_file_offset);
 		reader.seek(iter.compressed_offset, iter.compressed_length);
 		strm.avail_in = 0; /* make sure we read new data after lseek */
@@ -197,8 +379,20 @@ public:
 			return false;
 		}
 
-		inflateEnd(&strm);
-		int ret = inflateInit2(&strm, 0);
+		/* reuse the decoder (and its window) for all blocks; use the maximum
+		 * window size, so blocks with any (valid) zlib header can be decoded.
+		 * v2 blocks are raw deflate streams */
+		int ret;
+		if (strmInitialized) {
+			ret = inflateReset(&strm);
+		} else {
+			ret = inflateInit2(&strm, (IDXDEFL_VERSION_2 == index->version) ? -15 : 15);
+			strmInitialized = (Z_OK == ret);
+		}
+		if (Z_OK == ret && !index->dictionary.empty()) {
+			/* raw inflate takes the dictionary right away (instead of after Z_NEED_DICT) */
+			ret = inflateSetDictionary(&strm, index->dictionary.data(), index->dictionary.size());
+		}
 		if (Z_OK != ret) {
 			errnoZToStr("couldn't initialize block decoder", ret, error);
 			return false;
@@ -274,6 +468,7 @@ public:
 	}
 
 	bool decodeFillBuffer(std::string &error) {
+		blockEnd = false;
 		for (;0 != strm.avail_out;) {
 			LOG_VERBOSE("decodeFillBuffer: %i bytes to go\n", (int) strm.avail_out);
 
@@ -290,7 +485,11 @@ public:
 				return false;
 			}
 
-			if (0 == strm.avail_out) return true; // done filling buffer
+			if (0 == strm.avail_out) {
+				// done filling buffer
+				blockEnd = (Z_STREAM_END == ret);
+				return true;
+			}
 
 			if (Z_STREAM_END == ret) {
 				if (!iter.next()) {
@@ -299,20 +498,319 @@ public:
 				}
 				/* restart decoder */
 				if (!loadBlock(error)) return false;
+				/* the output buffer still contains data from the previous block */
+				position -= availableBytes();
 			}
 		}
 		return true;
 	}
+
+	/* decoder produced exactly the block data; let it consume the rest (adler32) */
+	bool finishBlock(std::string &error) {
+		if (blockEnd) return true; /* decoder already finished the block while filling the output */
+
+		/* need some output space, or inflate() wouldn't make progress */
+		unsigned char spare;
+		strm.next_out = &spare;
+		strm.avail_out = 1;
+
+		for (;;) {
+			if (!fill_input_buffer(error)) return false;
+
+			if (0 == strm.avail_in) {
+				error.assign("Unexpected end of file");
+				return false;
+			}
+
+			int ret = inflate(&strm, Z_SYNC_FLUSH);
+			if (Z_OK != ret && Z_STREAM_END != ret) {
+				errnoZToStr("failed decoding data", ret, error);
+				return false;
+			}
+
+			if (0 == strm.avail_out) {
+				error.assign("block larger than announced in index");
+				return false;
+			}
+
+			if (Z_STREAM_END == ret) return true;
+		}
+	}
+
+	/* decode a block in a single inflate() call: needs all its compressed data
+	 * in the input buffer and the output buffer sized exactly like the block.
+	 * with Z_FINISH (and enough output space) zlib doesn't maintain its window. */
+	bool inflateWholeBlock(std::string &error) {
+		int ret = inflate(&strm, Z_FINISH);
+		if (Z_STREAM_END == ret) {
+			if (0 != strm.avail_out) {
+				error.assign("block smaller than announced in index");
+				return false;
+			}
+			blockEnd = true;
+			return true;
+		}
+		if (Z_BUF_ERROR == ret || Z_OK == ret) {
+			if (0 == strm.avail_out) {
+				error.assign("block larger than announced in index");
+			} else {
+				error.assign("Unexpected end of file");
+			}
+			return false;
+		}
+		errnoZToStr("failed decoding data", ret, error);
+		return false;
+	}
+
+	/* check the decoded block blockIter in buf against its checksum (if the archive has them) */
+	bool verifyBlock(const IndexedDeflateFileIndexIter &blockIter, const unsigned char *buf, std::string &error) {
+		if (IDXDEFL_CHECKSUM_CRC32C == index->checksum_type
+			&& Crc32c::compute(buf, blockIter.uncompressed_length) != index->checksums[blockIter.block]) {
+			error.assign("block checksum mismatch");
+			return false;
+		}
+		return true;
+	}
+
+	/* copy length bytes at inBlock of a stored or zero block (which don't need the decoder) to buf */
+	bool copyRawBlock(const IndexedDeflateFileIndexIter &blockIter, int64_t inBlock, ssize_t length, unsigned char *buf, std::string &error) {
+		if (IDXDEFL_BLOCK_ZERO == blockIter.type) {
+			memset(buf, 0, length);
+			return true;
+		}
+		if (IDXDEFL_BLOCK_STORED != blockIter.type || blockIter.compressed_length != blockIter.uncompressed_length) {
+			error.assign("invalid stored block");
+			return false;
+		}
+		return reader.file()->readInto(rawState, blockIter.compressed_offset + inBlock, length, buf, error);
+	}
+
+	/* read() for stored blocks (returns the buffer of the underlying file, verified if it is the complete block) and zero blocks (returns zero_buffer) in cacheIter */
+	bool readRawBlock(int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error) {
+		int64_t inBlock = offset - cacheIter.uncompressed_offset;
+		ssize_t want = std::min<int64_t>(length, cacheIter.uncompressed_length - inBlock);
+		if (IDXDEFL_BLOCK_ZERO == cacheIter.type) {
+			data = zero_buffer;
+			datasize = std::min<ssize_t>(want, sizeof(zero_buffer));
+			return true;
+		}
+		if (IDXDEFL_BLOCK_STORED != cacheIter.type || cacheIter.compressed_length != cacheIter.uncompressed_length) {
+			error.assign("invalid stored block");
+			return false;
+		}
+		if (!reader.file()->read(rawState, cacheIter.compressed_offset + inBlock, want, data, datasize, error)) return false;
+		return (0 != inBlock || datasize != cacheIter.uncompressed_length) || verifyBlock(cacheIter, data, error);
+	}
+
+	/* decode the complete block blockIter into buf (needs blockIter.uncompressed_length bytes) */
+	bool decodeBlock(const IndexedDeflateFileIndexIter &blockIter, unsigned char *buf, std::string &error) {
+		if (IDXDEFL_BLOCK_DEFLATE != blockIter.type) {
+			return copyRawBlock(blockIter, 0, blockIter.uncompressed_length, buf, error) && verifyBlock(blockIter, buf, error);
+		}
+
+		discard_output();
+		iter = blockIter;
+		if (!loadBlock(error)) return false;
+
+		selectBuffer(buf, blockIter.uncompressed_length);
+		bool success;
+		if (0 != blockIter.uncompressed_length && strm.avail_in == blockIter.compressed_length) {
+			/* the complete compressed block is available in one piece (mapped file) */
+			success = inflateWholeBlock(error);
+		} else {
+			success = decodeFillBuffer(error) && finishBlock(error);
+		}
+		if (success) success = verifyBlock(blockIter, buf, error);
+		if (!success) {
+			position = -1;
+			selectDefaultBuffer();
+			return false;
+		}
+
+		/* don't keep the pointer to buf (without discard_output(): buf is full, not part of the default buffer) */
+		currentBuffer = defaultOutputBuffer;
+		currentBufferSize = sizeof(defaultOutputBuffer);
+		strm.next_out = currentBuffer;
+		strm.avail_out = currentBufferSize;
+		position = blockIter.uncompressed_offset + blockIter.uncompressed_length;
+		return true;
+	}
+
+	/* point cacheIter to the block containing offset (drops cachedBlock if it is another block) */
+	bool locateCacheBlock(int64_t offset, std::string &error) {
+		if (cacheIterValid
+			&& offset >= cacheIter.uncompressed_offset
+			&& offset < cacheIter.uncompressed_offset + cacheIter.uncompressed_length) {
+			return true;
+		}
+
+		cacheIterValid = false;
+		if (!cacheIter.seek(offset)) {
+			error.assign("couldn't find offset in index");
+			return false;
+		}
+		cacheIterValid = true;
+
+		/* reuse the memory of the old block if possible */
+		if (cachedBlock && (1 != cachedBlock.use_count() || (int64_t) cachedBlock->size != cacheIter.uncompressed_length)) {
+			cachedBlock.reset();
+		}
+		cachedBlockValid = false;
+		return true;
+	}
+
+	/**
+	 * set cachedBlock to the decoded block containing offset if it is small enough (or cacheable);
+	 * if the block is not in the cache and decodeMissing is set it is decoded (and inserted into
+	 * the cache if it is cacheable). cachedBlockValid tells whether the data is there
+	 */
+	bool loadCachedBlock(int64_t offset, bool decodeMissing, std::string &error) {
+		if (!locateCacheBlock(offset, error)) return false;
+		if (cachedBlockValid) return true;
+
+		size_t size = cacheIter.uncompressed_length;
+		BlockCache &cache = BlockCache::instance();
+		bool cacheable = cache.cacheable(size);
+		if (!cacheable && (0 == size || size > MAX_PINNED_BLOCK_SIZE)) return true;
+
+		DecodedBlockPtr found;
+		if (cacheable) found = cache.lookup(cacheId, cacheIter.source);
+		if (!found) {
+			if (!readahead.take(cacheIter.uncompressed_offset, found, error)) return false;
+			if (found && cacheable) cache.insert(cacheId, cacheIter.source, found);
+		}
+		if (found) {
+			cachedBlock = found;
+			cachedBlockValid = true;
+		}
+		/* only readers consuming (partial) blocks from the state, not complete readInto() ranges */
+		if (decodeMissing) readahead.access(cacheIter.uncompressed_offset, size);
+
+		if (cachedBlockValid || !decodeMissing) return true;
+
+		/* a kept allocation is never shared, see locateCacheBlock() */
+		if (!cachedBlock) cachedBlock.reset(new DecodedBlock(size));
+		if (!decodeBlock(cacheIter, cachedBlock->data, error)) return false;
+		cachedBlockValid = true;
+
+		if (cacheable) cache.insert(cacheId, cacheIter.source, cachedBlock);
+		return true;
+	}
+
+	/* returns a buffer of at least size bytes for read() */
+	unsigned char* readWindow(size_t size) {
+		if (windowSize < size) {
+			window.reset(new unsigned char[size]);
+			windowSize = size;
+		}
+		return window.get();
+	}
+
+	/* read exactly length bytes at offset into data */
+	bool readInto(int64_t offset, ssize_t length, unsigned char *data, std::string &error) {
+		/* copy from the kept block, decode partially needed ones completely and complete
+		 * blocks straight into data; use the streaming decoder for the parts of blocks too
+		 * large to keep. stored and zero blocks are copied (or filled) directly */
+		while (length > 0) {
+			if (!locateCacheBlock(offset, error)) return false;
+			int64_t inBlock = offset - cacheIter.uncompressed_offset;
+			int64_t blockSize = cacheIter.uncompressed_length;
+			bool complete = (0 == inBlock && length >= blockSize);
+			ssize_t n = std::min<int64_t>(length, blockSize - inBlock);
+
+			if (IDXDEFL_BLOCK_DEFLATE != cacheIter.type) {
+				if (!(complete ? decodeBlock(cacheIter, data, error) : copyRawBlock(cacheIter, inBlock, n, data, error))) return false;
+			} else {
+				if (!loadCachedBlock(offset, !complete, error)) return false;
+				if (cachedBlockValid) {
+					memcpy(data, cachedBlock->data + inBlock, n);
+				} else if (complete) {
+					if (!decodeBlock(cacheIter, data, error)) return false;
+				} else {
+					if (!streamInto(offset, n, data, error)) return false;
+				}
+			}
+			offset += n;
+			data += n;
+			length -= n;
+		}
+		return true;
+	}
+
+	/* read exactly length bytes at offset (within a single deflate block) into data with the streaming decoder */
+	bool streamInto(int64_t offset, ssize_t length, unsigned char *data, std::string &error) {
+		selectDefaultBuffer(); // always reset buffer, readInto might have left an old pointer
+		if (!seekBlockFor(offset, error)) return false;
+
+		ssize_t skipInBlock = offset - (position + (int64_t) availableBytes());
+		LOG_VERBOSE("have to skip %i bytes (negative: overlap)\n", (int) skipInBlock);
+
+		if (skipInBlock > 0) {
+			// read exactly skipInBlock bytes into our defaultOutputBuffer
+			discard_output();
+
+			for (; skipInBlock > 0; ) {
+				if ((ssize_t) strm.avail_out > skipInBlock) {
+					selectBuffer(defaultOutputBuffer, skipInBlock);
+				}
+				if (!decodeFillBuffer(error)) return false;
+				skipInBlock -= availableBytes();
+				discard_output();
+			}
+
+			// now the real output starts
+			selectBuffer(data, length);
+		} else {
+			// copy the (possible empty) overlap we need
+			ssize_t overlap = -skipInBlock;
+
+			if (overlap >= length) {
+				/* everything already decoded */
+				memmove(data, strm.next_out - overlap, length);
+				return true;
+			}
+			memmove(data, strm.next_out - overlap, overlap);
+			selectBuffer(data + overlap, length - overlap);
+		}
+
+		if (!decodeFillBuffer(error)) return false;
+
+		return true;
+	}
 };
 
 static IndexedDeflateFileIndex* read_index(File file, ssize_t memlimit, std::string &error);
+static IndexedDeflateFileIndex* read_sidecar_index(File file, SidecarReader &sidecar, std::string &error);
 
 IndexedDeflateFile::IndexedDeflateFile(File file, std::string &error /* out */)
-: m_file(file), m_index(nullptr) {
-	m_index = read_index(file, 16*1024*1024, error);
+: m_file(file), m_index(nullptr), m_cacheId(BlockCache::newFileId()), m_statePool(this, FileReaderStatePool::defaultMaxIdle()),
+  m_memory(m_cacheId, &m_statePool, [this]() { return m_index->memoryUsage(); }),
+  m_prefetcher([this](int64_t blockOffset, std::string &error) { return prefetchBlock(blockOffset, error); }) {
+	m_index = read_index(file, (ssize_t) std::min<size_t>(MemoryBudget::instance().indexLimit(IDXDEFL_INDEX_MEMLIMIT), std::numeric_limits<ssize_t>::max()), error);
+	if (nullptr != m_index) m_memory.attach();
+}
+
+IndexedDeflateFile::IndexedDeflateFile(File file, const char *sidecarFilename, std::string &error /* out */)
+: m_file(file), m_index(nullptr), m_cacheId(BlockCache::newFileId()), m_statePool(this, FileReaderStatePool::defaultMaxIdle()),
+  m_memory(m_cacheId, &m_statePool, [this]() { return m_index->memoryUsage(); }),
+  m_prefetcher([this](int64_t blockOffset, std::string &error) { return prefetchBlock(blockOffset, error); }) {
+	SidecarReader sidecar;
+	std::string sidecarError;
+	if (sidecar.open(sidecarFilename, file, SIDECAR_IDXDEFL, sidecarError)) {
+		m_index = read_sidecar_index(file, sidecar, sidecarError);
+	}
+	if (nullptr == m_index) {
+		LOG_VERBOSE("not using sidecar index: %s\n", sidecarError.c_str());
+		m_index = read_index(file, (ssize_t) std::min<size_t>(MemoryBudget::instance().indexLimit(IDXDEFL_INDEX_MEMLIMIT), std::numeric_limits<ssize_t>::max()), error);
+	}
+	if (nullptr != m_index) m_memory.attach();
 }
 
 IndexedDeflateFile::~IndexedDeflateFile() {
+	m_prefetcher.cancel();
+	m_memory.detach();
+	m_statePool.clear();
+	BlockCache::instance().removeFile(m_cacheId);
 	if (nullptr != m_index) {
 		delete m_index;
 		m_index = nullptr;
@@ -323,6 +821,30 @@ bool IndexedDeflateFile::valid() {
 	return (nullptr != m_index) && m_file;
 }
 
+bool IndexedDeflateFile::writeSidecar(const char *filename, std::string &error /* out */) {
+	if (!valid()) {
+		error.assign("Invalid file");
+		return false;
+	}
+	SidecarWriter sidecar;
+	sidecar.appendValue<uint64_t>(m_index->block_size);
+	sidecar.appendValue<uint64_t>(m_index->blocks);
+	sidecar.appendValue<int64_t>(m_index->uncompressed_size);
+	sidecar.appendValue<int64_t>(m_index->compressed_size);
+	sidecar.appendValue<uint64_t>(m_index->version);
+	sidecar.appendValue<uint64_t>(m_index->checksum_type | (m_index->dictionary.empty() ? 0 : IDXDEFL_FLAG_DICTIONARY)
+		| (nullptr != m_index->types ? IDXDEFL_FLAG_BLOCK_TYPES : 0));
+	sidecar.append(m_index->offsets, (m_index->blocks + 1) * sizeof(int64_t));
+	if (nullptr != m_index->uncompressed_offsets) sidecar.append(m_index->uncompressed_offsets, (m_index->blocks + 1) * sizeof(int64_t));
+	if (nullptr != m_index->checksums) sidecar.append(m_index->checksums, m_index->blocks * sizeof(uint32_t));
+	if (nullptr != m_index->types) {
+		sidecar.append(m_index->types, m_index->blocks);
+		sidecar.appendValue<uint64_t>(m_index->reference_count);
+		sidecar.append(m_index->references, m_index->reference_count * 2 * sizeof(uint64_t));
+	}
+	return sidecar.write(filename, m_file, SIDECAR_IDXDEFL, error);
+}
+
 int64_t IndexedDeflateFile::filesize() {
 	return (nullptr != m_index) ? m_index->uncompressed_size : 0;
 }
@@ -335,12 +857,36 @@ bool IndexedDeflateFile::read(FileReaderState* &internalState, int64_t offset, s
 
 	IndexedDeflateFileReaderState *state;
 	if (nullptr == internalState) {
-		internalState = state = new IndexedDeflateFileReaderState(m_file, m_index);
+		internalState = state = new IndexedDeflateFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
 	} else {
 		state = dynamic_cast<IndexedDeflateFileReaderState*>(internalState);
 		assert(nullptr != state);
 	}
 
+	/* stored and zero blocks don't need decoding (and aren't cached) */
+	if (!state->locateCacheBlock(offset, error)) return false;
+	if (IDXDEFL_BLOCK_DEFLATE != state->cacheIter.type) return state->readRawBlock(offset, length, data, datasize, error);
+
+	/* return (the rest of) the complete decoded block if possible; valid until the next call with the state */
+	if (!state->loadCachedBlock(offset, true, error)) return false;
+	if (state->cachedBlockValid) {
+		int64_t inBlock = offset - state->cacheIter.uncompressed_offset;
+		data = state->cachedBlock->data + inBlock;
+		datasize = std::min<int64_t>(length, state->cachedBlock->size - inBlock);
+		return true;
+	}
+
+	/* large block: decode the requested window (up to the end of the block) in one go */
+	if (length > (ssize_t) sizeof(state->defaultOutputBuffer)) {
+		int64_t end = state->cacheIter.uncompressed_offset + state->cacheIter.uncompressed_length;
+		ssize_t want = std::min<int64_t>(std::min<int64_t>(length, MAX_READ_WINDOW), end - offset);
+		unsigned char *buf = state->readWindow(want);
+		if (!state->readInto(offset, want, buf, error)) return false;
+		data = buf;
+		datasize = want;
+		return true;
+	}
+
 	state->selectDefaultBuffer(); // always reset buffer, readInto might have left an old pointer
 	if (!state->seekBlockFor(offset, error)) return false;
 
@@ -348,7 +894,7 @@ bool IndexedDeflateFile::read(FileReaderState* &internalState, int64_t offset, s
 		ssize_t have = state->availableBytes();
 		if (state->position + have > offset) {
 			ssize_t overlap = (state->position + have - offset);
-			data = state->strm.next_out - have;
+			data = state->strm.next_out - overlap;
 			datasize = overlap;
 			return true;
 		}
@@ -368,43 +914,59 @@ bool IndexedDeflateFile::readInto(FileReaderState* &internalState, int64_t offse
 
 	IndexedDeflateFileReaderState *state;
 	if (nullptr == internalState) {
-		internalState = state = new IndexedDeflateFileReaderState(m_file, m_index);
+		internalState = state = new IndexedDeflateFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
 	} else {
 		state = dynamic_cast<IndexedDeflateFileReaderState*>(internalState);
 		assert(nullptr != state);
 	}
 
-	state->selectDefaultBuffer(); // always reset buffer, readInto might have left an old pointer
-	if (!state->seekBlockFor(offset, error)) return false;
-
-	ssize_t skipInBlock = offset - state->position + state->availableBytes();
-	LOG_VERBOSE("have to skip %i bytes (negative: overlap)\n", (int) skipInBlock);
-
-	if (skipInBlock > 0) {
-		// read exactly skipInBlock bytes into our defaultOutputBuffer
-		state->discard_output();
-
-		for (; skipInBlock > 0; ) {
-			if ((ssize_t) state->strm.avail_out > skipInBlock) {
-				state->selectBuffer(state->defaultOutputBuffer, skipInBlock);
+	if (length >= PARALLEL_READ_MIN_LENGTH) {
+		/* blocks are independent: decode pieces of complete blocks with pooled states on all cores */
+		IndexedDeflateFileIndexIter iter(m_index);
+		std::vector<ReadRequest> pieces;
+		for (int64_t pos = offset, end = offset + length; pos < end; ) {
+			/* end the piece at the end of the block containing its last byte */
+			if (!iter.seek(std::min(end, pos + PARALLEL_READ_PIECE) - 1)) {
+				error.assign("couldn't find offset in index");
+				return false;
 			}
-			if (!state->decodeFillBuffer(error)) return false;
-			skipInBlock -= state->availableBytes();
-			state->discard_output();
+			int64_t pieceEnd = std::min(end, iter.uncompressed_offset + iter.uncompressed_length);
+			ReadRequest piece = { pos, (ssize_t) (pieceEnd - pos), data + (pos - offset) };
+			pieces.push_back(piece);
+			pos = pieceEnd;
 		}
+		if (pieces.size() > 1) return parallelPread(this, pieces, error);
+	}
 
-		// now the real output starts
-		state->selectBuffer(data, length);
-	} else {
-		// copy the (possible empty) overlap we need
-		ssize_t overlap = -skipInBlock;
+	return state->readInto(offset, length, data, error);
+}
 
-		memmove(data, state->strm.next_in - overlap, overlap);
-		state->selectBuffer(data + overlap, length - overlap);
+bool IndexedDeflateFile::readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */) {
+	if (!valid()) {
+		error.assign("Invalid file");
+		return false;
 	}
 
-	if (!state->decodeFillBuffer(error)) return false;
+	IndexedDeflateFileReaderState *state;
+	if (nullptr == internalState) {
+		internalState = state = new IndexedDeflateFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
+	} else {
+		state = dynamic_cast<IndexedDeflateFileReaderState*>(internalState);
+		assert(nullptr != state);
+	}
+
+	/* sorted and without overlaps the decoder only moves forward, so each needed block is decoded once:
+	 * partially needed blocks are kept in the state (and the cache), and seekBlockFor() continues
+	 * in the current block for the next read */
+	std::vector<ReadRequest> reads;
+	std::vector<ReadCopy> copies;
+	planReadMany(requests, reads, copies);
+
+	for (const ReadRequest &req : reads) {
+		if (!state->readInto(req.offset, req.length, req.data, error)) return false;
+	}
 
+	finishReadCopies(copies);
 	return true;
 }
 
@@ -417,9 +979,362 @@ void IndexedDeflateFile::finish(FileReaderState* &internalState) {
 	}
 }
 
+/* don't keep blocks alive through idle states (same as in XZFile) */
+static void releaseBlocks(FileReaderState *state) {
+	IndexedDeflateFileReaderState *idxstate = static_cast<IndexedDeflateFileReaderState*>(state);
+	idxstate->cachedBlock.reset();
+	idxstate->cachedBlockValid = false;
+}
+
+bool IndexedDeflateFile::pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	return m_statePool.pread(offset, length, data, error, releaseBlocks);
+}
+
+void IndexedDeflateFile::prefetch(int64_t offset, int64_t length, int flags) {
+	if (!valid() || offset < 0 || length <= 0 || offset >= filesize()) return;
+	int64_t end = offset + std::min(length, filesize() - offset);
+
+	IndexedDeflateFileIndexIter iter(m_index);
+	if (!iter.seek(offset)) return;
+
+	BlockCache &cache = BlockCache::instance();
+	bool decode = 0 != (flags & PREFETCH_DECODE);
+	/* don't prefetch more than fits into the cache, the first blocks would be evicted again */
+	size_t decodeBudget = cache.capacity() / 2;
+	std::vector<int64_t> decodeBlocks;
+
+	int64_t compressedStart = iter.compressed_offset, compressedEnd;
+	for (;;) {
+		compressedEnd = iter.compressed_offset + iter.compressed_length;
+		if (decode && IDXDEFL_BLOCK_DEFLATE == iter.type && cache.cacheable(iter.uncompressed_length) && (size_t) iter.uncompressed_length <= decodeBudget) {
+			decodeBudget -= iter.uncompressed_length;
+			decodeBlocks.push_back(iter.uncompressed_offset);
+		}
+		if (iter.uncompressed_offset + iter.uncompressed_length >= end || !iter.next()) break;
+	}
+
+	/* the kernel starts reading before the decoders ask for the data */
+	m_file->prefetch(compressedStart, compressedEnd - compressedStart);
+	for (int64_t blockOffset : decodeBlocks) {
+		if (!m_prefetcher.schedule(blockOffset)) break;
+	}
+}
+
+void IndexedDeflateFile::advise(int advice) {
+	if (m_file) m_file->advise(advice);
+}
+
+bool IndexedDeflateFile::prefetchBlock(int64_t blockOffset, std::string &error /* out */) {
+	IndexedDeflateFileIndexIter iter(m_index);
+	if (!iter.seek(blockOffset)) {
+		error.assign("couldn't find offset in index");
+		return false;
+	}
+
+	BlockCache &cache = BlockCache::instance();
+	if (IDXDEFL_BLOCK_DEFLATE != iter.type || !cache.cacheable(iter.uncompressed_length) || cache.lookup(m_cacheId, iter.source)) return true;
+
+	FileReaderState *state = m_statePool.acquire();
+	if (nullptr == state) state = new IndexedDeflateFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
+	DecodedBlockPtr data(new DecodedBlock(iter.uncompressed_length));
+	if (!static_cast<IndexedDeflateFileReaderState*>(state)->decodeBlock(iter, data->data, error)) {
+		/* don't reuse states after errors */
+		finish(state);
+		return false;
+	}
+	m_statePool.release(state);
+
+	cache.insert(m_cacheId, iter.source, data);
+	return true;
+}
+
+
+static uint32_t getUint32BE(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static uint64_t getUint64BE(const unsigned char *p) {
+	return ((uint64_t) getUint32BE(p) << 32) | getUint32BE(p + 4);
+}
+
+/* little endian base 128 */
+static bool getVarint(const unsigned char* &pos, const unsigned char *end, uint64_t &value /* out */) {
+	value = 0;
+	for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+		unsigned char byte = *pos++;
+		value |= (uint64_t) (byte & 0x7f) << shift;
+		if (0 == (byte & 0x80)) return true;
+	}
+	return false;
+}
+
+/* the preset dictionary after the header: <uint32 size> <dictionary> */
+static bool read_dictionary(File file, FileReaderState* &filestate, std::vector<unsigned char> &dictionary /* out */, std::string &error) {
+	unsigned char sizebuf[4];
+	if (file->filesize() < 12 || !file->readInto(filestate, 8, sizeof(sizebuf), sizebuf, error)) {
+		error.assign("missing preset dictionary");
+		return false;
+	}
+	uint32_t size = getUint32BE(sizebuf);
+	if (0 == size || size > IDXDEFL_MAX_DICTIONARY || size > file->filesize() - 12) {
+		error.assign("invalid preset dictionary size");
+		return false;
+	}
+	dictionary.resize(size);
+	return file->readInto(filestate, 12, size, dictionary.data(), error);
+}
+
+static IndexedDeflateFileIndex* read_index_v2(File file, ssize_t memlimit, std::string &error) {
+	/* header: "idxdefl\2", followed by the preset dictionary if IDXDEFL_FLAG_DICTIONARY is set */
+	/* big endian footer: <uint64 index size> <uint64 blocks> <uint64 uncompressed size> <uint32 flags> <uint32 version> */
+	unsigned char footer[32];
+
+	uint64_t index_size, blocks, uncompressed_size;
+	uint32_t flags, checksum_type, version;
+	size_t entry_max, memory_per_block;
+	int64_t index_offset, current, uncompressed_current;
+	uint32_t uniform_size;
+	bool uniform;
+
+	int64_t *compressed_offsets = nullptr, *uncompressed_offsets = nullptr;
+	uint32_t *checksums = nullptr;
+	unsigned char *types = nullptr;
+	uint64_t *references = nullptr;
+	std::vector<uint64_t> reference_pairs;
+	std::vector<unsigned char> compressed_index, index, dictionary;
+	const unsigned char *pos, *end;
+	IndexedDeflateFileIndex *result;
+
+	FileReaderState *filestate = nullptr;
+
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+
+	int64_t filesize = file->filesize();
+
+	if (filesize < (int64_t) (8 + sizeof(footer))) {
+		error.assign("invalid file (too small for header+footer)");
+		goto failed;
+	}
+
+	if (!file->readInto(filestate, filesize - sizeof(footer), sizeof(footer), footer, error)) goto failed;
+
+	index_size = getUint64BE(footer);
+	blocks = getUint64BE(footer + 8);
+	uncompressed_size = getUint64BE(footer + 16);
+	flags = getUint32BE(footer + 24);
+	checksum_type = flags & IDXDEFL_CHECKSUM_MASK;
+	version = getUint32BE(footer + 28);
+
+	if (IDXDEFL_VERSION_2 != version) {
+		error.assign("invalid footer version");
+		goto failed;
+	}
+	if (IDXDEFL_CHECKSUM_NONE != checksum_type && IDXDEFL_CHECKSUM_CRC32C != checksum_type) {
+		error.assign("unsupported block checksum type");
+		goto failed;
+	}
+	if (0 != (flags & ~(IDXDEFL_CHECKSUM_MASK | IDXDEFL_FLAG_DICTIONARY | IDXDEFL_FLAG_BLOCK_TYPES))) {
+		error.assign("unsupported flags in footer");
+		goto failed;
+	}
+	if (index_size > (uint64_t) (filesize - 8 - sizeof(footer))) {
+		error.assign("invalid index size");
+		goto failed;
+	}
+	if (uncompressed_size > (uint64_t) std::numeric_limits<int64_t>::max()) {
+		error.assign("invalid uncompressed size");
+		goto failed;
+	}
+
+	/* offsets for both sides (uncompressed ones are dropped again for uniform block sizes); types and (at most) a reference */
+	memory_per_block = 2 * sizeof(int64_t) + (IDXDEFL_CHECKSUM_NONE != checksum_type ? sizeof(uint32_t) : 0)
+		+ (0 != (flags & IDXDEFL_FLAG_BLOCK_TYPES) ? 1 + 2 * sizeof(uint64_t) : 0);
+	if (0 == blocks || memlimit < 4096 || blocks > (uint64_t) (memlimit - 4096) / memory_per_block) {
+		error.assign((0 == blocks) ? "invalid block count" : "too many blocks");
+		goto failed;
+	}
+	/* two varints (up to 10 bytes each), the reference and the checksum per block */
+	entry_max = 20 + (0 != (flags & IDXDEFL_FLAG_BLOCK_TYPES) ? 10 : 0) + (IDXDEFL_CHECKSUM_NONE != checksum_type ? 4 : 0);
+	if (index_size > blocks * entry_max + 1024) {
+		error.assign("invalid index size");
+		goto failed;
+	}
+
+	index_offset = filesize - sizeof(footer) - index_size;
+	compressed_index.resize(index_size);
+	if (!file->readInto(filestate, index_offset, index_size, compressed_index.data(), error)) goto failed;
+
+	/* the index is a zlib stream (with adler32) */
+	if (Z_OK != inflateInit2(&strm, 15)) {
+		error.assign("couldn't initialize index decoder");
+		goto failed;
+	}
+	strm.next_in = compressed_index.data();
+	strm.avail_in = compressed_index.size();
+	index.resize(std::min<size_t>(blocks * entry_max, 64*1024));
+	for (;;) {
+		strm.next_out = index.data() + strm.total_out;
+		strm.avail_out = index.size() - strm.total_out;
+		int ret = inflate(&strm, Z_FINISH);
+		if (Z_STREAM_END == ret) break;
+		if (Z_OK != ret && Z_BUF_ERROR != ret) {
+			errnoZToStr("failed decoding index data", ret, error);
+			goto failed;
+		}
+		if (0 != strm.avail_out) {
+			error.assign("truncated index");
+			goto failed;
+		}
+		if (index.size() >= blocks * entry_max) {
+			error.assign("decompressed index too large");
+			goto failed;
+		}
+		index.resize(std::min<size_t>(blocks * entry_max, 2 * index.size()));
+	}
+	if (0 != strm.avail_in) {
+		error.assign("garbage after index");
+		goto failed;
+	}
+	index.resize(strm.total_out);
+
+	compressed_offsets = new int64_t[blocks + 1];
+	uncompressed_offsets = new int64_t[blocks + 1];
+	if (IDXDEFL_CHECKSUM_NONE != checksum_type) checksums = new uint32_t[blocks];
+	if (0 != (flags & IDXDEFL_FLAG_BLOCK_TYPES)) types = new unsigned char[blocks];
+
+	pos = index.data();
+	end = pos + index.size();
+	current = 8;
+	if (0 != (flags & IDXDEFL_FLAG_DICTIONARY)) {
+		if (!read_dictionary(file, filestate, dictionary, error)) goto failed;
+		current += 4 + dictionary.size();
+		if (current > index_offset) {
+			error.assign("preset dictionary reaches into index");
+			goto failed;
+		}
+	}
+	uncompressed_current = 0;
+	uniform = true;
+	uniform_size = 0;
+	for (uint64_t i = 0; i < blocks; ++i) {
+		uint64_t compressed_length, uncompressed_length, distance = 0;
+		if (!getVarint(pos, end, compressed_length) || !getVarint(pos, end, uncompressed_length)) {
+			error.assign("decompressed index too small");
+			goto failed;
+		}
+		if (nullptr != types) {
+			/* <varint compressed length << 2 | type> <varint uncompressed length> [<varint distance of the referenced block>] */
+			unsigned char type = compressed_length & 3;
+			compressed_length >>= 2;
+			types[i] = type;
+			if (IDXDEFL_BLOCK_REFERENCE == type && !getVarint(pos, end, distance)) {
+				error.assign("decompressed index too small");
+				goto failed;
+			}
+			if ((IDXDEFL_BLOCK_STORED == type && compressed_length != uncompressed_length)
+				|| ((IDXDEFL_BLOCK_ZERO == type || IDXDEFL_BLOCK_REFERENCE == type) && 0 != compressed_length)) {
+				error.assign("invalid block length for block type");
+				goto failed;
+			}
+			if (IDXDEFL_BLOCK_REFERENCE == type) {
+				/* references point to earlier blocks of the same size, which aren't references themselves */
+				uint64_t source = i - distance;
+				if (0 == distance || distance > i || IDXDEFL_BLOCK_REFERENCE == types[source]
+					|| uncompressed_length != (uint64_t) (((source + 1 == i) ? uncompressed_current : uncompressed_offsets[source + 1]) - uncompressed_offsets[source])) {
+					error.assign("invalid block reference");
+					goto failed;
+				}
+				reference_pairs.push_back(i);
+				reference_pairs.push_back(source);
+			}
+		}
+		if (compressed_length > (uint64_t) (index_offset - current)) {
+			error.assign("decompressed data reaches into index");
+			goto failed;
+		}
+		if (uncompressed_length > uncompressed_size - uncompressed_current) {
+			error.assign("blocks larger than uncompressed size");
+			goto failed;
+		}
+		/* empty blocks would break the lookup by offset; only an empty file has one */
+		if (0 == uncompressed_length && 1 != blocks) {
+			error.assign("empty block");
+			goto failed;
+		}
+		if (nullptr != checksums) {
+			if (end - pos < 4) {
+				error.assign("decompressed index too small");
+				goto failed;
+			}
+			checksums[i] = getUint32BE(pos);
+			pos += 4;
+		}
+
+		if (0 == i) {
+			uniform_size = (uint32_t) std::min<uint64_t>(uncompressed_length, std::numeric_limits<int32_t>::max());
+			uniform = (uniform_size == uncompressed_length);
+		} else if (i + 1 < blocks ? uncompressed_length != uniform_size : uncompressed_length > uniform_size) {
+			uniform = false;
+		}
+
+		compressed_offsets[i] = current;
+		uncompressed_offsets[i] = uncompressed_current;
+		current += compressed_length;
+		uncompressed_current += uncompressed_length;
+	}
+	if (pos != end) {
+		error.assign("decompressed index too large");
+		goto failed;
+	}
+	if (current != index_offset) {
+		error.assign("blocks don't end at the index");
+		goto failed;
+	}
+	if ((uint64_t) uncompressed_current != uncompressed_size) {
+		error.assign("blocks smaller than uncompressed size");
+		goto failed;
+	}
+	compressed_offsets[blocks] = index_offset;
+	uncompressed_offsets[blocks] = uncompressed_current;
+
+	inflateEnd(&strm);
+	file->finish(filestate);
+
+	if (uniform && 0 != uniform_size) {
+		delete[] uncompressed_offsets;
+		uncompressed_offsets = nullptr;
+	} else {
+		uniform_size = 0;
+	}
+	if (!reference_pairs.empty()) {
+		references = new uint64_t[reference_pairs.size()];
+		std::copy(reference_pairs.begin(), reference_pairs.end(), references);
+	}
+	result = new IndexedDeflateFileIndex(uniform_size, blocks, uncompressed_size, filesize, compressed_offsets);
+	result->version = IDXDEFL_VERSION_2;
+	result->checksum_type = checksum_type;
+	result->uncompressed_offsets = uncompressed_offsets;
+	result->checksums = checksums;
+	result->types = types;
+	result->references = references;
+	result->reference_count = reference_pairs.size() / 2;
+	result->dictionary.swap(dictionary);
+	return result;
+
+failed:
+	inflateEnd(&strm);
+	delete[] compressed_offsets;
+	delete[] uncompressed_offsets;
+	delete[] checksums;
+	delete[] types;
+	file->finish(filestate);
+
+	return nullptr;
+}
 
 static IndexedDeflateFileIndex* read_index(File file, ssize_t memlimit, std::string &error) {
-	/* header: "idxdefl\0" */
+	/* header: "idxdefl\0" (v1) or "idxdefl\2" (v2) */
 	/* big endian footer: <index size> <block size> <full blocks> <last block size> */
 	static  const unsigned char magic_header[8] = "idxdefl";
 
@@ -442,6 +1357,7 @@ static IndexedDeflateFileIndex* read_index(File file, ssize_t memlimit, std::str
 	uint32_t intbuf[64];
 
 	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
 
 	int64_t filesize = file->filesize();
 
@@ -455,10 +1371,18 @@ static IndexedDeflateFileIndex* read_index(File file, ssize_t memlimit, std::str
 	}
 
 	if (!file->readInto(filestate, 0, sizeof(magic_header), header, error)) goto failed;
-	if (0 != memcmp(magic_header, header, sizeof(magic_header))) {
+	if (0 != memcmp(magic_header, header, sizeof(magic_header) - 1)) {
 		error.assign("invalid file header");
 		goto failed;
 	}
+	if (IDXDEFL_VERSION_2 == header[7]) {
+		file->finish(filestate);
+		return read_index_v2(file, memlimit, error);
+	}
+	if (0 != header[7]) {
+		error.assign("unsupported format version");
+		goto failed;
+	}
 
 	pos -= sizeof(footer);
 	if (!file->readInto(filestate, pos, sizeof(footer), (unsigned char*) footer, error)) goto failed;
@@ -508,8 +1432,6 @@ static IndexedDeflateFileIndex* read_index(File file, ssize_t memlimit, std::str
 	pos -= index_size;
 	index_offset = pos;
 
-	memset(&strm, 0, sizeof(strm));
-
 	inflateInit2(&strm, 0);
 
 	idx = 0;
@@ -586,3 +1508,113 @@ failed:
 
 	return nullptr;
 }
+
+/* the offsets are used from the mapped sidecar (see IndexedDeflateFile::writeSidecar) */
+static IndexedDeflateFileIndex* read_sidecar_index(File file, SidecarReader &sidecar, std::string &error) {
+	uint64_t block_size, blocks, version, flags, checksum_type, reference_count = 0;
+	int64_t uncompressed_size, compressed_size;
+	const int64_t *offsets = nullptr, *uncompressed_offsets = nullptr;
+	const uint32_t *checksums = nullptr;
+	const unsigned char *types = nullptr;
+	const uint64_t *references = nullptr;
+
+	if (!sidecar.takeValue(block_size) || !sidecar.takeValue(blocks)
+		|| !sidecar.takeValue(uncompressed_size) || !sidecar.takeValue(compressed_size)
+		|| !sidecar.takeValue(version) || !sidecar.takeValue(flags)) {
+		error.assign("truncated sidecar index");
+		return nullptr;
+	}
+	checksum_type = flags & IDXDEFL_CHECKSUM_MASK;
+	if (blocks > (uint64_t) std::numeric_limits<int64_t>::max() / sizeof(int64_t) - 1
+		|| nullptr == (offsets = sidecar.take<int64_t>(blocks + 1))
+		|| (0 == block_size && nullptr == (uncompressed_offsets = sidecar.take<int64_t>(blocks + 1)))
+		|| (IDXDEFL_CHECKSUM_NONE != checksum_type && nullptr == (checksums = sidecar.take<uint32_t>(blocks)))) {
+		error.assign("truncated sidecar index");
+		return nullptr;
+	}
+	if (0 != (flags & IDXDEFL_FLAG_BLOCK_TYPES)) {
+		if (nullptr == (types = sidecar.take<unsigned char>(blocks)) || !sidecar.takeValue(reference_count)
+			|| reference_count > blocks || nullptr == (references = sidecar.take<uint64_t>(reference_count * 2))) {
+			error.assign("truncated sidecar index");
+			return nullptr;
+		}
+	}
+
+	/* same limits as read_index(); the block offsets are checked when blocks are decoded */
+	bool valid = 0 != blocks && offsets[blocks] <= compressed_size
+		&& (IDXDEFL_VERSION_1 == version || IDXDEFL_VERSION_2 == version)
+		&& 0 == (flags & ~(IDXDEFL_CHECKSUM_MASK | IDXDEFL_FLAG_DICTIONARY | IDXDEFL_FLAG_BLOCK_TYPES))
+		&& (0 == (flags & IDXDEFL_FLAG_DICTIONARY) ? 8 == offsets[0] : IDXDEFL_VERSION_2 == version)
+		&& (0 == (flags & IDXDEFL_FLAG_BLOCK_TYPES) || IDXDEFL_VERSION_2 == version)
+		&& (IDXDEFL_CHECKSUM_NONE == checksum_type || (IDXDEFL_VERSION_2 == version && IDXDEFL_CHECKSUM_CRC32C == checksum_type));
+	if (0 == block_size) {
+		valid = valid && IDXDEFL_VERSION_2 == version && 0 == uncompressed_offsets[0] && uncompressed_size == uncompressed_offsets[blocks];
+	} else {
+		valid = valid && block_size <= (uint64_t) std::numeric_limits<int32_t>::max()
+			&& blocks <= (uint64_t) std::numeric_limits<int64_t>::max() / block_size
+			&& uncompressed_size >= (int64_t) ((blocks - 1) * block_size)
+			&& uncompressed_size <= (int64_t) (blocks * block_size);
+	}
+	if (valid && nullptr != types) {
+		/* same checks as read_index_v2(): the raw block types are read without further checks */
+		auto block_length = [&](uint64_t block) -> int64_t {
+			if (0 == block_size) return uncompressed_offsets[block + 1] - uncompressed_offsets[block];
+			return (block + 1 == blocks) ? uncompressed_size - (int64_t) (block * block_size) : (int64_t) block_size;
+		};
+		uint64_t type_references = 0;
+		for (uint64_t i = 0; valid && i < blocks; ++i) {
+			int64_t compressed_length = offsets[i + 1] - offsets[i];
+			switch (types[i]) {
+			case IDXDEFL_BLOCK_DEFLATE:
+				break;
+			case IDXDEFL_BLOCK_STORED:
+				valid = (compressed_length == block_length(i));
+				break;
+			case IDXDEFL_BLOCK_REFERENCE:
+				++type_references;
+				/* fall through */
+			case IDXDEFL_BLOCK_ZERO:
+				valid = (0 == compressed_length);
+				break;
+			default:
+				valid = false;
+			}
+		}
+		/* (block, source) pairs sorted by block: references point to earlier blocks of the same size, which aren't references themselves */
+		valid = valid && type_references == reference_count;
+		for (uint64_t i = 0; valid && i < reference_count; ++i) {
+			uint64_t block = references[2 * i], source = references[2 * i + 1];
+			valid = block < blocks && source < block && (0 == i || block > references[2 * i - 2])
+				&& IDXDEFL_BLOCK_REFERENCE == types[block] && IDXDEFL_BLOCK_REFERENCE != types[source]
+				&& block_length(block) == block_length(source);
+		}
+	}
+	if (!valid) {
+		error.assign("invalid sidecar index");
+		return nullptr;
+	}
+
+	/* the dictionary is only stored in the archive */
+	std::vector<unsigned char> dictionary;
+	if (0 != (flags & IDXDEFL_FLAG_DICTIONARY)) {
+		FileReaderState *filestate = nullptr;
+		bool found = read_dictionary(file, filestate, dictionary, error);
+		file->finish(filestate);
+		if (!found) return nullptr;
+		if (offsets[0] != (int64_t) (12 + dictionary.size())) {
+			error.assign("invalid sidecar index");
+			return nullptr;
+		}
+	}
+
+	IndexedDeflateFileIndex *index = new IndexedDeflateFileIndex(block_size, blocks, uncompressed_size, compressed_size, offsets, sidecar.file());
+	index->dictionary.swap(dictionary);
+	index->version = version;
+	index->checksum_type = checksum_type;
+	index->uncompressed_offsets = uncompressed_offsets;
+	index->checksums = checksums;
+	index->types = types;
+	index->references = references;
+	index->reference_count = reference_count;
+	return index;
+}
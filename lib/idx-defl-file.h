@@ -1,15 +1,46 @@
 #ifndef __MY_IDX_DEFL_FILE_H
 #define __MY_IDX_DEFL_FILE_H __MY_IDX_DEFL_FILE_H
 
+#include "block-prefetch.h"
 #include "file.h"
+#include "memory-budget.h"
 
 extern "C" {
 #include <zlib.h>
 }
 
+/* idxdefl format versions; v1 archives have a 0 in the last header byte, v2 archives a 2 */
+#define IDXDEFL_VERSION_1 1
+#define IDXDEFL_VERSION_2 2
+/* per block checksum types of v2 archives (the low bits of the footer flags) */
+#define IDXDEFL_CHECKSUM_NONE 0
+#define IDXDEFL_CHECKSUM_CRC32C 1
+#define IDXDEFL_CHECKSUM_MASK 0xff
+/* v2 footer flag: a preset dictionary for all blocks follows the header */
+#define IDXDEFL_FLAG_DICTIONARY 0x100
+/* largest useful preset dictionary (the deflate window) */
+#define IDXDEFL_MAX_DICTIONARY (32*1024)
+/* v2 footer flag: each index entry has a block type (IDXDEFL_BLOCK_*) */
+#define IDXDEFL_FLAG_BLOCK_TYPES 0x200
+/* v2 block types: raw deflate, uncompressed, all zeroes, same as an earlier block */
+#define IDXDEFL_BLOCK_DEFLATE 0
+#define IDXDEFL_BLOCK_STORED 1
+#define IDXDEFL_BLOCK_ZERO 2
+#define IDXDEFL_BLOCK_REFERENCE 3
+
 class IndexedDeflateFileIndex;
 
-/** abstraction for custom file compression format. see doc/indexed-deflate-format.txt */
+/**
+ * abstraction for custom file compression format (v1 and v2). see doc/indexed-deflate-format.txt
+ *
+ * block checksums (v2) are verified whenever a block is decoded completely, i.e. not when the
+ * file is opened; partial reads of blocks too large for the BlockCache are not verified.
+ *
+ * stored blocks (v2 block types) are read from the underlying file (read() returns its buffer,
+ * i.e. a pointer into the mapping of a MMappedFile) and zero blocks are filled with memset();
+ * stored blocks are only verified if a read covers the complete block. references share
+ * the decoded block of their source in the BlockCache.
+ */
 class IndexedDeflateFile : public IFile {
 private:
 	IndexedDeflateFile();
@@ -19,17 +50,40 @@ private:
 protected:
 	File m_file;
 	IndexedDeflateFileIndex *m_index;
+	uint64_t m_cacheId; /** key for the process wide BlockCache */
+	FileReaderStatePool m_statePool; /** warm states for pread() */
+	MemoryAccount m_memory; /** registered with MemoryBudget::instance() while the file is valid */
+	BlockPrefetcher m_prefetcher; /** decodes blocks for prefetch() in the background */
+
+	/** decode the block at blockOffset into the BlockCache (if it is cacheable and not cached yet) */
+	bool prefetchBlock(int64_t blockOffset, std::string &error /* out */);
 
 public:
 	IndexedDeflateFile(File file, std::string &error /* out */);
+	/** use the block table from a sidecar index (see sidecar-index.h) if it matches the file, otherwise read the index from the file */
+	IndexedDeflateFile(File file, const char *sidecarFilename, std::string &error /* out */);
 	virtual ~IndexedDeflateFile();
 
 	bool valid();
 
+	/** store the block table in a sidecar index for faster opening */
+	bool writeSidecar(const char *filename, std::string &error /* out */);
+
 	virtual int64_t filesize();
 	virtual bool read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */);
+	/** large reads are split at block boundaries and decoded in parallel (see parallelPread()) */
 	virtual bool readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+	virtual bool readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */);
 	virtual void finish(FileReaderState* &internalState);
+	/** uses (and returns) idle states from statePool() */
+	virtual bool pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+	/** prefetches the compressed blocks covering the range from the underlying file; PREFETCH_DECODE decodes them into the BlockCache */
+	virtual void prefetch(int64_t offset, int64_t length, int flags = 0);
+	/** passed to the underlying file */
+	virtual void advise(int advice);
+
+	FileReaderStatePool& statePool() { return m_statePool; }
+	const MemoryAccount& memory() const { return m_memory; }
 };
 
 #endif
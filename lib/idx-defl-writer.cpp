@@ -0,0 +1,626 @@
+#include "idx-defl-writer.h"
+
+#include "crc32c.h"
+#include "worker-pool.h"
+
+#include <algorithm>
+#include <climits>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* blocks being compressed (or waiting to be written) per worker thread */
+#define BLOCKS_IN_FLIGHT_PER_THREAD 4
+/* the format limits all counts and sizes to less than 2^31 */
+#define IDXDEFL_MAX_COUNT 0x7fffffffu
+/* dictionary training: length of the (hashed) substrings counted in the samples */
+#define DICT_KMER 8
+/* dictionary training: the dictionary is built from pieces of this size */
+#define DICT_SEGMENT 64
+/* dictionary training: log2 of the number of substring counters */
+#define DICT_HASH_LOG 20
+/* content hashes of at most this many blocks are remembered to find repeated blocks (about 70 bytes each) */
+#define DEDUP_MAX_BLOCKS (1024*1024)
+
+static const unsigned char idxdefl_magic_header[8] = "idxdefl";
+
+static void putUint32BE(std::vector<unsigned char> &out, uint32_t value) {
+	for (int shift = 24; shift >= 0; shift -= 8) out.push_back((unsigned char) (value >> shift));
+}
+
+static void putUint64BE(std::vector<unsigned char> &out, uint64_t value) {
+	putUint32BE(out, (uint32_t) (value >> 32));
+	putUint32BE(out, (uint32_t) value);
+}
+
+/* little endian base 128 */
+static void putVarint(std::vector<unsigned char> &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back((unsigned char) (value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((unsigned char) value);
+}
+
+static void errnoToSt(const char *prefix, std::string &error) {
+	error.assign(prefix);
+	error.append(strerror(errno));
+}
+
+static void errnoFnameToSt(const char *prefix, const char *filename, std::string &error) {
+	error.assign(prefix);
+	error.push_back(' ');
+	error.append(filename);
+	error.push_back(':');
+	error.append(strerror(errno));
+}
+
+/* zlib stream for one worker thread; reset for each block */
+class IndexedDeflateWriter::Compressor {
+private:
+	Compressor();
+	Compressor(const Compressor &);
+	Compressor& operator=(const Compressor &);
+
+	z_stream m_strm;
+	bool m_valid;
+	const std::vector<unsigned char> *m_dictionary;
+
+public:
+	/* windowBits -15: raw deflate; the dictionary (if not empty) is set for each block */
+	Compressor(int level, int strategy, int windowBits, const std::vector<unsigned char> *dictionary = nullptr)
+	: m_dictionary(dictionary) {
+		memset(&m_strm, 0, sizeof(m_strm));
+		m_valid = (Z_OK == deflateInit2(&m_strm, level, Z_DEFLATED, windowBits, 8, strategy));
+	}
+
+	~Compressor() {
+		if (m_valid) deflateEnd(&m_strm);
+	}
+
+	bool valid() { return m_valid; }
+
+	/* compress data into out as a complete stream */
+	bool compress(const unsigned char *data, size_t datasize, std::vector<unsigned char> &out /* out */, std::string &error /* out */) {
+		deflateReset(&m_strm);
+		if (nullptr != m_dictionary && !m_dictionary->empty()) {
+			deflateSetDictionary(&m_strm, m_dictionary->data(), m_dictionary->size());
+		}
+		out.resize(deflateBound(&m_strm, datasize));
+
+		m_strm.next_in = const_cast<unsigned char*>(data);
+		m_strm.avail_in = datasize;
+		m_strm.next_out = out.data();
+		m_strm.avail_out = out.size();
+		int ret = deflate(&m_strm, Z_FINISH);
+		if (Z_STREAM_END != ret) {
+			error.assign("deflate failed: ");
+			error.append(m_strm.msg ? m_strm.msg : "unknown error");
+			return false;
+		}
+		out.resize(out.size() - m_strm.avail_out);
+		return true;
+	}
+};
+
+/* 64-bit hash of a block; together with its crc32c and size it identifies repeated blocks */
+static uint64_t hashBlock(const unsigned char *data, size_t size) {
+	uint64_t h = 0x243F6A8885A308D3ull ^ size;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t word;
+		memcpy(&word, data, sizeof(word));
+		h = (h ^ word) * 0x9E3779B97F4A7C15ull;
+		h ^= h >> 29;
+	}
+	for (; size > 0; ++data, --size) h = (h ^ *data) * 0x100000001B3ull;
+	return h ^ (h >> 32);
+}
+
+/* inflate a raw deflate stream (with the preset dictionary, if not empty) into exactly out.size() bytes */
+static bool inflateBlock(const std::vector<unsigned char> &data, const std::vector<unsigned char> &dictionary, std::vector<unsigned char> &out /* out */) {
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if (Z_OK != inflateInit2(&strm, -15)) return false;
+	bool ok = dictionary.empty() || Z_OK == inflateSetDictionary(&strm, dictionary.data(), dictionary.size());
+	strm.next_in = const_cast<unsigned char*>(data.data());
+	strm.avail_in = data.size();
+	strm.next_out = out.data();
+	strm.avail_out = out.size();
+	ok = ok && Z_STREAM_END == inflate(&strm, Z_FINISH) && 0 == strm.avail_out;
+	inflateEnd(&strm);
+	return ok;
+}
+
+static bool allZero(const unsigned char *data, size_t size) {
+	return size > 0 && 0 == data[0] && 0 == memcmp(data, data + 1, size - 1);
+}
+
+/* a block being filled, compressed or waiting to be written */
+struct IndexedDeflateWriter::Slot {
+	Slot() : checksum(0), type(IDXDEFL_BLOCK_DEFLATE), distance(0), hash(0), source(false), busy(false), done(false), ok(false) { }
+
+	std::vector<unsigned char> input, output;
+	uint32_t checksum; /* of input, if the archive has checksums (or block types) */
+	int type; /* IDXDEFL_BLOCK_*; output is only used for IDXDEFL_BLOCK_DEFLATE */
+	uint64_t distance; /* to the referenced block for IDXDEFL_BLOCK_REFERENCE */
+	uint64_t hash; /* content hash, if source */
+	bool source; /* in m_blockHashes: remember where the block data is written */
+	bool busy; /* submitted, not written yet */
+	bool done; /* compressed (or failed); protected by m_mutex */
+	bool ok;
+	std::string error;
+};
+
+IndexedDeflateWriter::IndexedDeflateWriter(int fd, uint32_t blockSize, int level, int strategy, std::string &error /* out */)
+: m_fd(fd), m_ownFd(false), m_blockSize(blockSize), m_level(level), m_strategy(strategy),
+  m_version(IDXDEFL_VERSION_1), m_checksumType(IDXDEFL_CHECKSUM_NONE), m_blockTypes(false), m_pool(nullptr),
+  m_nextBlock(0), m_nextWrite(0), m_readBack(false), m_lastBlockSize(0), m_uncompressedSize(0), m_compressedSize(0), m_failed(false), m_finished(false) {
+	if (!init(error)) m_fd = -1;
+}
+
+IndexedDeflateWriter::IndexedDeflateWriter(const char *filename, bool overwrite, uint32_t blockSize, int level, int strategy, std::string &error /* out */)
+: m_fd(-1), m_ownFd(true), m_blockSize(blockSize), m_level(level), m_strategy(strategy),
+  m_version(IDXDEFL_VERSION_1), m_checksumType(IDXDEFL_CHECKSUM_NONE), m_blockTypes(false), m_pool(nullptr),
+  m_nextBlock(0), m_nextWrite(0), m_readBack(false), m_lastBlockSize(0), m_uncompressedSize(0), m_compressedSize(0), m_failed(false), m_finished(false) {
+	/* readable too: repeated blocks are compared with the earlier blocks written before */
+	m_fd = ::open(filename, O_RDWR | O_CREAT | (overwrite ? O_TRUNC : O_EXCL), 0644);
+	if (-1 == m_fd) {
+		errnoFnameToSt("Couldn't create file", filename, error);
+		return;
+	}
+	if (!init(error)) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+IndexedDeflateWriter::~IndexedDeflateWriter() {
+	drain();
+	if (m_ownFd && -1 != m_fd) ::close(m_fd);
+}
+
+bool IndexedDeflateWriter::init(std::string &error /* out */) {
+	if (0 == m_blockSize || m_blockSize > IDXDEFL_MAX_COUNT) {
+		error.assign("Invalid block size");
+		return false;
+	}
+	if (m_level < Z_DEFAULT_COMPRESSION || m_level > Z_BEST_COMPRESSION) {
+		error.assign("Invalid compression level");
+		return false;
+	}
+	Compressor compressor(m_level, m_strategy, 15);
+	if (!compressor.valid()) {
+		error.assign("Invalid compression parameters");
+		return false;
+	}
+	return true;
+}
+
+bool IndexedDeflateWriter::valid() {
+	return -1 != m_fd;
+}
+
+void IndexedDeflateWriter::setWorkerPool(WorkerPool *pool) {
+	if (m_slots.empty()) m_pool = pool;
+}
+
+bool IndexedDeflateWriter::setFormat(int version, int checksumType, std::string &error /* out */) {
+	if (!m_slots.empty()) {
+		error.assign("Archive already started");
+		return false;
+	}
+	if ((IDXDEFL_VERSION_1 != version && IDXDEFL_VERSION_2 != version)
+		|| (IDXDEFL_CHECKSUM_NONE != checksumType && (IDXDEFL_VERSION_2 != version || IDXDEFL_CHECKSUM_CRC32C != checksumType))) {
+		error.assign("Unsupported archive format");
+		return false;
+	}
+	if (IDXDEFL_VERSION_2 != version && !m_dictionary.empty()) {
+		error.assign("Preset dictionaries need the v2 format");
+		return false;
+	}
+	m_version = version;
+	m_checksumType = checksumType;
+	m_blockTypes = (IDXDEFL_VERSION_2 == version);
+	return true;
+}
+
+bool IndexedDeflateWriter::setBlockTypes(bool enable, std::string &error /* out */) {
+	if (!m_slots.empty()) {
+		error.assign("Archive already started");
+		return false;
+	}
+	if (enable && IDXDEFL_VERSION_2 != m_version) {
+		error.assign("Block types need the v2 format");
+		return false;
+	}
+	m_blockTypes = enable;
+	return true;
+}
+
+bool IndexedDeflateWriter::setDictionary(const unsigned char *data, size_t size, std::string &error /* out */) {
+	if (!m_slots.empty()) {
+		error.assign("Archive already started");
+		return false;
+	}
+	if (IDXDEFL_VERSION_2 != m_version) {
+		error.assign("Preset dictionaries need the v2 format");
+		return false;
+	}
+	if (size > IDXDEFL_MAX_DICTIONARY) {
+		error.assign("Preset dictionary too large");
+		return false;
+	}
+	m_dictionary.assign(data, data + size);
+	return true;
+}
+
+static size_t hashKmer(const unsigned char *data) {
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return (size_t) ((value * 0x9E3779B97F4A7C15ull) >> (64 - DICT_HASH_LOG));
+}
+
+void IndexedDeflateWriter::trainDictionary(const unsigned char *samples, size_t size, size_t sampleSize, size_t dictSize, std::vector<unsigned char> &dictionary /* out */) {
+	dictionary.clear();
+	dictSize = std::min<size_t>(dictSize, IDXDEFL_MAX_DICTIONARY);
+	if (0 == sampleSize || sampleSize > size) sampleSize = size;
+	if (size < DICT_SEGMENT || dictSize < DICT_SEGMENT) return;
+
+	/* in how many samples each substring occurs */
+	std::vector<uint32_t> freq(1u << DICT_HASH_LOG, 0), lastSample(1u << DICT_HASH_LOG, UINT32_MAX);
+	for (size_t pos = 0; pos + DICT_KMER <= size; ++pos) {
+		size_t h = hashKmer(samples + pos);
+		uint32_t sample = pos / sampleSize;
+		if (lastSample[h] != sample) {
+			lastSample[h] = sample;
+			++freq[h];
+		}
+	}
+	/* substrings only found in one sample don't help other blocks */
+	uint32_t minFreq = (size > sampleSize) ? 2 : 1;
+
+	/* pick the best segment from each epoch (part of the samples), and stop counting its substrings */
+	size_t segments = dictSize / DICT_SEGMENT;
+	size_t epochSize = std::max<size_t>(size / segments, DICT_SEGMENT);
+	std::vector<std::pair<uint64_t, size_t>> chosen; /* score, offset */
+	for (size_t epoch = 0; epoch + DICT_SEGMENT <= size; epoch += epochSize) {
+		size_t epochEnd = std::min(size, epoch + epochSize);
+		uint64_t best = 0, score = 0;
+		size_t bestPos = 0;
+		/* sliding sum over the substrings of the segment starting at pos */
+		for (size_t pos = epoch; pos + DICT_KMER <= epochEnd; ++pos) {
+			uint32_t f = freq[hashKmer(samples + pos)];
+			score += (f >= minFreq) ? f : 0;
+			if (pos >= epoch + DICT_SEGMENT - DICT_KMER) {
+				size_t start = pos - (DICT_SEGMENT - DICT_KMER);
+				if (score > best) {
+					best = score;
+					bestPos = start;
+				}
+				uint32_t first = freq[hashKmer(samples + start)];
+				score -= (first >= minFreq) ? first : 0;
+			}
+		}
+		if (0 == best) continue;
+		chosen.push_back(std::make_pair(best, bestPos));
+		for (size_t pos = bestPos; pos + DICT_KMER <= bestPos + DICT_SEGMENT; ++pos) freq[hashKmer(samples + pos)] = 0;
+	}
+
+	/* the most useful segments last: they are closest to the block data (shortest distances) */
+	std::sort(chosen.begin(), chosen.end());
+	if (chosen.size() > segments) chosen.erase(chosen.begin(), chosen.end() - segments);
+	for (const std::pair<uint64_t, size_t> &segment : chosen) {
+		dictionary.insert(dictionary.end(), samples + segment.second, samples + segment.second + DICT_SEGMENT);
+	}
+}
+
+bool IndexedDeflateWriter::start(std::string &error /* out */) {
+	if (!m_slots.empty()) return true;
+	if (nullptr == m_pool) m_pool = &WorkerPool::instance();
+
+	/* header: "idxdefl\0" (v1) or "idxdefl\2" (v2) */
+	unsigned char header[sizeof(idxdefl_magic_header)];
+	memcpy(header, idxdefl_magic_header, sizeof(header));
+	if (IDXDEFL_VERSION_2 == m_version) header[7] = IDXDEFL_VERSION_2;
+	if (!output(header, sizeof(header), error)) return false;
+	/* pipes, write only descriptors and archives not starting at offset 0 aren't read back */
+	struct stat st;
+	unsigned char check[sizeof(header)];
+	m_readBack = m_blockTypes && 0 == fstat(m_fd, &st) && S_ISREG(st.st_mode) && lseek(m_fd, 0, SEEK_CUR) == m_compressedSize
+		&& (ssize_t) sizeof(check) == pread(m_fd, check, sizeof(check), 0) && 0 == memcmp(check, header, sizeof(header));
+	if (!m_dictionary.empty()) {
+		/* <uint32 size> <dictionary> */
+		std::vector<unsigned char> dictionary;
+		putUint32BE(dictionary, m_dictionary.size());
+		dictionary.insert(dictionary.end(), m_dictionary.begin(), m_dictionary.end());
+		if (!output(dictionary.data(), dictionary.size(), error)) return false;
+	}
+
+	unsigned int threads = std::max(1u, m_pool->threads());
+	for (unsigned int i = 0; i < threads; ++i) {
+		m_compressors.emplace_back(new Compressor(m_level, m_strategy, (IDXDEFL_VERSION_2 == m_version) ? -15 : 15, &m_dictionary));
+		if (!m_compressors.back()->valid()) return fail("Couldn't initialize deflate", error);
+	}
+	for (unsigned int i = 0; i < BLOCKS_IN_FLIGHT_PER_THREAD * threads; ++i) {
+		m_slots.emplace_back(new Slot());
+	}
+	return true;
+}
+
+bool IndexedDeflateWriter::fail(const std::string &error, std::string &errorOut /* out */) {
+	if (!m_failed) {
+		m_failed = true;
+		m_error = error;
+	}
+	errorOut = m_error;
+	return false;
+}
+
+bool IndexedDeflateWriter::output(const unsigned char *data, size_t size, std::string &error /* out */) {
+	while (size > 0) {
+		ssize_t r = ::write(m_fd, data, size);
+		if (r < 0) {
+			if (EINTR == errno) continue;
+			errnoToSt("Couldn't write archive: ", error);
+			return fail(error, error);
+		}
+		data += r;
+		size -= r;
+		m_compressedSize += r;
+	}
+	return true;
+}
+
+bool IndexedDeflateWriter::submitBlock(std::string &error /* out */) {
+	if (IDXDEFL_VERSION_1 == m_version && m_nextBlock >= IDXDEFL_MAX_COUNT) return fail("Too many blocks for the v1 format", error);
+
+	Slot *slot = m_slots[m_nextBlock % m_slots.size()].get();
+	slot->busy = true;
+	slot->done = false;
+	slot->type = IDXDEFL_BLOCK_DEFLATE;
+	uint64_t block = m_nextBlock++;
+
+	bool checksum = (IDXDEFL_CHECKSUM_CRC32C == m_checksumType);
+	if (m_blockTypes && !slot->input.empty()) {
+		/* zero and repeated blocks are found here, in order (the crc32c is part of the content hash, and the checksum) */
+		const unsigned char *data = slot->input.data();
+		size_t size = slot->input.size();
+		slot->checksum = Crc32c::compute(data, size);
+		checksum = false;
+		if (allZero(data, size)) {
+			slot->type = IDXDEFL_BLOCK_ZERO;
+		} else {
+			uint64_t hash = hashBlock(data, size), id = ((uint64_t) slot->checksum << 32) | size;
+			auto found = m_blockHashes.find(hash);
+			slot->source = false;
+			if (m_blockHashes.end() != found) {
+				/* equal hashes don't make equal blocks (and the checksum of the reference would match anyway) */
+				if (id == found->second.id && sameBlock(found->second, data, size)) {
+					slot->type = IDXDEFL_BLOCK_REFERENCE;
+					slot->distance = block - found->second.block;
+				}
+			} else if (m_blockHashes.size() < DEDUP_MAX_BLOCKS) {
+				BlockSource source = { id, block, -1, 0, IDXDEFL_BLOCK_DEFLATE };
+				m_blockHashes[hash] = source;
+				slot->hash = hash;
+				slot->source = true;
+			}
+		}
+		if (IDXDEFL_BLOCK_DEFLATE != slot->type) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			slot->ok = true;
+			slot->done = true;
+			return true;
+		}
+	}
+
+	bool stored = m_blockTypes;
+	m_pool->submit([this, slot, checksum, stored](unsigned int worker) {
+		std::string error;
+		bool ok = m_compressors[worker]->compress(slot->input.data(), slot->input.size(), slot->output, error);
+		if (checksum) slot->checksum = Crc32c::compute(slot->input.data(), slot->input.size());
+		if (ok && stored && slot->output.size() >= slot->input.size()) slot->type = IDXDEFL_BLOCK_STORED;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		slot->ok = ok;
+		slot->error.swap(error);
+		slot->done = true;
+		m_cond.notify_all();
+	});
+	return true;
+}
+
+bool IndexedDeflateWriter::writeBlock(std::string &error /* out */) {
+	Slot &slot = *m_slots[m_nextWrite % m_slots.size()];
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!slot.done) m_cond.wait(lock);
+	}
+	if (!slot.ok) return fail(slot.error, error);
+
+	/* block data: stored blocks are the input, zero blocks and references have none */
+	const unsigned char *data = slot.output.data();
+	size_t size = slot.output.size();
+	if (IDXDEFL_BLOCK_STORED == slot.type) {
+		data = slot.input.data();
+		size = slot.input.size();
+	} else if (IDXDEFL_BLOCK_DEFLATE != slot.type) {
+		size = 0;
+	}
+
+	if (IDXDEFL_VERSION_2 == m_version) {
+		/* <varint compressed length [<< 2 | type]> <varint uncompressed length> [<varint reference distance>] [<uint32 checksum>] */
+		putVarint(m_index, m_blockTypes ? ((uint64_t) size << 2) | slot.type : size);
+		putVarint(m_index, slot.input.size());
+		if (IDXDEFL_BLOCK_REFERENCE == slot.type) putVarint(m_index, slot.distance);
+		if (IDXDEFL_CHECKSUM_NONE != m_checksumType) putUint32BE(m_index, slot.checksum);
+	} else {
+		if (size > IDXDEFL_MAX_COUNT) return fail("Compressed block too large", error);
+		putUint32BE(m_index, size);
+	}
+	if (slot.source) {
+		BlockSource &source = m_blockHashes[slot.hash];
+		source.offset = m_compressedSize;
+		source.length = size;
+		source.type = slot.type;
+		slot.source = false;
+	}
+	if (!output(data, size, error)) return false;
+	m_lastBlockSize = slot.input.size();
+
+	slot.input.clear();
+	slot.busy = false;
+	++m_nextWrite;
+	return true;
+}
+
+bool IndexedDeflateWriter::sameBlock(const BlockSource &source, const unsigned char *data, size_t size) {
+	if (source.block >= m_nextWrite) {
+		/* not written yet: still in its slot */
+		const std::vector<unsigned char> &input = m_slots[source.block % m_slots.size()]->input;
+		return input.size() == size && 0 == memcmp(input.data(), data, size);
+	}
+	if (!m_readBack || source.offset < 0) return false;
+
+	std::vector<unsigned char> written(source.length);
+	for (size_t pos = 0; pos < written.size(); ) {
+		ssize_t r = pread(m_fd, written.data() + pos, written.size() - pos, source.offset + pos);
+		if (r < 0 && EINTR == errno) continue;
+		if (r <= 0) return false;
+		pos += r;
+	}
+	if (IDXDEFL_BLOCK_STORED == source.type) return written.size() == size && 0 == memcmp(written.data(), data, size);
+
+	std::vector<unsigned char> inflated(size);
+	return inflateBlock(written, m_dictionary, inflated) && 0 == memcmp(inflated.data(), data, size);
+}
+
+void IndexedDeflateWriter::drain() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (std::unique_ptr<Slot> &slot : m_slots) {
+		while (slot->busy && !slot->done) m_cond.wait(lock);
+	}
+}
+
+bool IndexedDeflateWriter::write(const unsigned char *data, size_t size, std::string &error /* out */) {
+	if (m_finished) {
+		error.assign("Archive already finished");
+		return false;
+	}
+	if (!valid()) {
+		error.assign("Archive not opened");
+		return false;
+	}
+	if (m_failed) return fail(m_error, error);
+	if (!start(error)) return false;
+
+	while (size > 0) {
+		/* the slot for the next block is free once the block using it before was written */
+		while (m_nextBlock - m_nextWrite >= m_slots.size()) {
+			if (!writeBlock(error)) return false;
+		}
+
+		Slot &slot = *m_slots[m_nextBlock % m_slots.size()];
+		if (slot.input.size() == m_blockSize) {
+			/* only submit a full block when more data follows: the last block is written by finish() */
+			if (!submitBlock(error)) return false;
+			continue;
+		}
+
+		size_t take = std::min<size_t>(size, m_blockSize - slot.input.size());
+		slot.input.insert(slot.input.end(), data, data + take);
+		data += take;
+		size -= take;
+		m_uncompressedSize += take;
+	}
+
+	return true;
+}
+
+bool IndexedDeflateWriter::endBlock(std::string &error /* out */) {
+	if (m_finished) {
+		error.assign("Archive already finished");
+		return false;
+	}
+	if (!valid()) {
+		error.assign("Archive not opened");
+		return false;
+	}
+	if (m_failed) return fail(m_error, error);
+	if (IDXDEFL_VERSION_2 != m_version) {
+		error.assign("Variable block sizes need the v2 format");
+		return false;
+	}
+	if (!start(error)) return false;
+
+	/* the slot of the next block is free, see write() */
+	while (m_nextBlock - m_nextWrite >= m_slots.size()) {
+		if (!writeBlock(error)) return false;
+	}
+	if (m_slots[m_nextBlock % m_slots.size()]->input.empty()) return true;
+	return submitBlock(error);
+}
+
+bool IndexedDeflateWriter::finish(std::string &error /* out */) {
+	if (m_finished) return true;
+	if (!valid()) {
+		error.assign("Archive not opened");
+		return false;
+	}
+	if (m_failed) return fail(m_error, error);
+	if (!start(error)) return false;
+
+	/* the last block; only empty in empty archives (after endBlock() the current one is empty too) */
+	while (m_nextBlock - m_nextWrite >= m_slots.size()) {
+		if (!writeBlock(error)) return false;
+	}
+	if (0 == m_nextBlock || !m_slots[m_nextBlock % m_slots.size()]->input.empty()) {
+		if (!submitBlock(error)) return false;
+	}
+	while (m_nextWrite < m_nextBlock) {
+		if (!writeBlock(error)) return false;
+	}
+
+	/* v1: the index only stores the compressed length of the full blocks */
+	if (IDXDEFL_VERSION_1 == m_version) m_index.resize(m_index.size() - 4);
+
+	/* the index is always a zlib stream */
+	std::vector<unsigned char> index;
+	Compressor compressor(m_level, m_strategy, 15);
+	if (!compressor.compress(m_index.data(), m_index.size(), index, error)) return fail(error, error);
+	if (!output(index.data(), index.size(), error)) return false;
+
+	std::vector<unsigned char> footer;
+	if (IDXDEFL_VERSION_2 == m_version) {
+		/* big endian footer: <uint64 index size> <uint64 blocks> <uint64 uncompressed size> <uint32 flags> <uint32 version> */
+		putUint64BE(footer, index.size());
+		putUint64BE(footer, m_nextBlock);
+		putUint64BE(footer, m_uncompressedSize);
+		putUint32BE(footer, m_checksumType | (m_dictionary.empty() ? 0 : IDXDEFL_FLAG_DICTIONARY)
+			| (m_blockTypes ? IDXDEFL_FLAG_BLOCK_TYPES : 0));
+		putUint32BE(footer, IDXDEFL_VERSION_2);
+	} else {
+		/* big endian footer: <index size> <block size> <full blocks> <last block size> */
+		putUint32BE(footer, index.size());
+		putUint32BE(footer, m_blockSize);
+		putUint32BE(footer, m_nextBlock - 1);
+		putUint32BE(footer, m_lastBlockSize);
+	}
+	if (!output(footer.data(), footer.size(), error)) return false;
+
+	if (m_ownFd) {
+		int fd = m_fd;
+		m_fd = -1;
+		if (0 != ::close(fd)) {
+			errnoToSt("Couldn't write archive: ", error);
+			return fail(error, error);
+		}
+	}
+
+	m_finished = true;
+	return true;
+}
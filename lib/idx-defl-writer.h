@@ -0,0 +1,137 @@
+#ifndef __MY_IDX_DEFL_WRITER_H
+#define __MY_IDX_DEFL_WRITER_H __MY_IDX_DEFL_WRITER_H
+
+#include <cstdint>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "idx-defl-file.h"
+
+class WorkerPool;
+
+/* default uncompressed block size for new archives */
+#define IDXDEFL_DEFAULT_BLOCK_SIZE (64*1024)
+/* default zlib compression level for new archives */
+#define IDXDEFL_DEFAULT_LEVEL 7
+
+/**
+ * writes an indexed deflate archive (see doc/indexed-deflate-format.txt) from data passed
+ * in pieces of any size; the output is only appended to, so it can be a pipe.
+ * writes v1 archives unless setFormat() selects v2.
+ *
+ * v2 archives use block types (unless disabled with setBlockTypes()): all zero blocks and
+ * repeated blocks (found by a hash of their content, and compared with the earlier block) aren't
+ * stored again, and blocks deflate can't make smaller are stored uncompressed. earlier blocks
+ * which were already written are read back from the output, so they are only referenced when
+ * writing to a regular file opened for reading too (always the case when passing a filename).
+ *
+ * blocks are compressed in parallel on a WorkerPool and written in order; the output doesn't
+ * depend on the number of threads. memory is bounded: a few blocks per worker thread, a few
+ * bytes per block for the index, and up to about 70 MiB for the hashes of the first
+ * DEDUP_MAX_BLOCKS (2^20) distinct blocks.
+ *
+ * not thread safe (one producer). an archive is only complete after finish() succeeded.
+ */
+class IndexedDeflateWriter {
+private:
+	IndexedDeflateWriter();
+	IndexedDeflateWriter(const IndexedDeflateWriter &);
+	IndexedDeflateWriter& operator=(const IndexedDeflateWriter &);
+
+	class Compressor;
+	struct Slot;
+
+	/* an earlier block with a given content hash */
+	struct BlockSource {
+		uint64_t id; /* crc32c << 32 | size */
+		uint64_t block;
+		int64_t offset; /* of the block data in the output, once written */
+		uint32_t length; /* of the block data */
+		int type; /* IDXDEFL_BLOCK_DEFLATE or IDXDEFL_BLOCK_STORED, once written */
+	};
+
+	int m_fd;
+	bool m_ownFd; /* close m_fd in the destructor */
+	uint32_t m_blockSize;
+	int m_level, m_strategy;
+	int m_version, m_checksumType;
+	bool m_blockTypes; /* IDXDEFL_FLAG_BLOCK_TYPES (v2) */
+	std::vector<unsigned char> m_dictionary; /* preset dictionary for all blocks (v2), or empty */
+	WorkerPool *m_pool;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::vector<std::unique_ptr<Compressor>> m_compressors; /* one per worker thread */
+	std::vector<std::unique_ptr<Slot>> m_slots; /* blocks in flight, reused round robin */
+	uint64_t m_nextBlock, m_nextWrite; /* next block to fill and to write */
+
+	std::unordered_map<uint64_t, BlockSource> m_blockHashes; /* content hash -> earlier block */
+	bool m_readBack; /* the output is a regular file which can be read with pread() */
+	std::vector<unsigned char> m_index; /* uncompressed index entries of the written blocks */
+	uint32_t m_lastBlockSize; /* uncompressed size of the last written block */
+	int64_t m_uncompressedSize, m_compressedSize;
+	bool m_failed, m_finished;
+	std::string m_error; /* reason for m_failed */
+
+	bool init(std::string &error /* out */);
+	/* write the header and create the compressors and slots for the pool on first use */
+	bool start(std::string &error /* out */);
+	bool fail(const std::string &error, std::string &errorOut /* out */);
+	bool output(const unsigned char *data, size_t size, std::string &error /* out */);
+	/* hand the block in the current slot to the pool */
+	bool submitBlock(std::string &error /* out */);
+	/* write the oldest block in flight (waiting for it); returns false on errors */
+	bool writeBlock(std::string &error /* out */);
+	/* whether the earlier block source has the content data (compared in memory, or read back from the output) */
+	bool sameBlock(const BlockSource &source, const unsigned char *data, size_t size);
+	/* wait until no task uses the slots anymore */
+	void drain();
+
+public:
+	/** write to fd (which is not closed) */
+	IndexedDeflateWriter(int fd, uint32_t blockSize, int level, int strategy, std::string &error /* out */);
+	/** create filename; an existing file is only replaced with overwrite */
+	IndexedDeflateWriter(const char *filename, bool overwrite, uint32_t blockSize, int level, int strategy, std::string &error /* out */);
+	/** without finish() the archive is incomplete */
+	~IndexedDeflateWriter();
+
+	bool valid();
+
+	/** compress on pool (which has to outlive the writer) instead of WorkerPool::instance(); only before the first write() */
+	void setWorkerPool(WorkerPool *pool);
+
+	/** IDXDEFL_VERSION_* and IDXDEFL_CHECKSUM_* (checksums and a preset dictionary need v2); only before the first write() */
+	bool setFormat(int version, int checksumType, std::string &error /* out */);
+
+	/** stored, zero and reference blocks (IDXDEFL_FLAG_BLOCK_TYPES); enabled by setFormat() for v2, only before the first write() */
+	bool setBlockTypes(bool enable, std::string &error /* out */);
+
+	/** preset dictionary (up to IDXDEFL_MAX_DICTIONARY bytes) for all blocks; needs v2, only before the first write() */
+	bool setDictionary(const unsigned char *data, size_t size, std::string &error /* out */);
+
+	/**
+	 * build a preset dictionary of up to dictSize bytes from samples (consecutive pieces of sampleSize
+	 * bytes, usually blocks of the data): picks the pieces with the most substrings that also occur
+	 * in other samples. the result is empty if the samples have nothing in common.
+	 */
+	static void trainDictionary(const unsigned char *samples, size_t size, size_t sampleSize, size_t dictSize, std::vector<unsigned char> &dictionary /* out */);
+
+	/** append uncompressed data */
+	bool write(const unsigned char *data, size_t size, std::string &error /* out */);
+	/** end the current block before it reaches the block size (v2 only; no-op if it is empty) */
+	bool endBlock(std::string &error /* out */);
+	/** write the remaining blocks, the index and the footer */
+	bool finish(std::string &error /* out */);
+
+	/** uncompressed bytes passed to write() */
+	int64_t uncompressedSize() const { return m_uncompressedSize; }
+	/** archive bytes written so far */
+	int64_t compressedSize() const { return m_compressedSize; }
+};
+
+#endif
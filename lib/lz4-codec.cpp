@@ -0,0 +1,236 @@
+#include "lz4-codec.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(HAVE_LZ4)
+
+#include <climits>
+
+#include <lz4.h>
+
+size_t LZ4Codec::compressBound(size_t size) {
+	return (size > LZ4_MAX_INPUT_SIZE) ? 0 : (size_t) LZ4_compressBound((int) size);
+}
+
+size_t LZ4Codec::compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity) {
+	if (size > LZ4_MAX_INPUT_SIZE) return 0;
+	if (capacity > INT_MAX) capacity = INT_MAX;
+	int result = LZ4_compress_default((const char*) src, (char*) dst, (int) size, (int) capacity);
+	return (result > 0) ? (size_t) result : 0;
+}
+
+bool LZ4Codec::decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t size) {
+	if (srcSize > INT_MAX || size > INT_MAX) return false;
+	int result = LZ4_decompress_safe((const char*) src, (char*) dst, (int) srcSize, (int) size);
+	return result >= 0 && (size_t) result == size;
+}
+
+#else
+
+/* matches are at least this long */
+#define LZ4_MIN_MATCH 4
+/* the last bytes of a block are always literals */
+#define LZ4_LAST_LITERALS 5
+/* the last match has to start at least this many bytes before the end of the block */
+#define LZ4_MFLIMIT 12
+/* largest offset a match can reference */
+#define LZ4_MAX_DISTANCE 65535
+/* log2 of the number of entries in the hash table of the compressor (16KB on the stack) */
+#define LZ4_HASH_LOG 12
+/* skip faster through incompressible data: the step grows by one every 2^LZ4_SKIP_TRIGGER misses */
+#define LZ4_SKIP_TRIGGER 6
+
+static inline uint32_t read32(const unsigned char *p) {
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+/* copies in 16 byte chunks: may read and write up to 15 bytes more than size */
+static inline void wildCopy(unsigned char *dst, const unsigned char *src, size_t size) {
+	unsigned char *const end = dst + size;
+	do {
+		memcpy(dst, src, 16);
+		dst += 16;
+		src += 16;
+	} while (dst < end);
+}
+
+static inline uint32_t hash32(uint32_t sequence) {
+	return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/* length continuation bytes after a token nibble of 15 */
+static inline unsigned char* writeLength(unsigned char *op, size_t length) {
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (unsigned char) length;
+	return op;
+}
+
+static inline bool readLength(const unsigned char *&ip, const unsigned char *iend, size_t &length /* in+out */) {
+	unsigned char b;
+	do {
+		if (ip >= iend) return false;
+		b = *ip++;
+		length += b;
+	} while (255 == b);
+	return true;
+}
+
+size_t LZ4Codec::compressBound(size_t size) {
+	return size + size / 255 + 16;
+}
+
+size_t LZ4Codec::compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity) {
+	const unsigned char *ip = src, *anchor = src;
+	const unsigned char *const end = src + size;
+	unsigned char *op = dst;
+	unsigned char *const oend = dst + capacity;
+
+	if (size > LZ4_MFLIMIT) {
+		const unsigned char *const mflimit = end - LZ4_MFLIMIT;
+		const unsigned char *const matchLimit = end - LZ4_LAST_LITERALS;
+		uint32_t table[1 << LZ4_HASH_LOG];
+		memset(table, 0, sizeof(table));
+		size_t misses = 0;
+
+		while (ip < mflimit) {
+			uint32_t sequence = read32(ip);
+			uint32_t h = hash32(sequence);
+			const unsigned char *ref = src + table[h];
+			table[h] = (uint32_t) (ip - src);
+
+			if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE || read32(ref) != sequence) {
+				ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+				continue;
+			}
+			misses = 0;
+
+			const unsigned char *matchEnd = ip + LZ4_MIN_MATCH, *refEnd = ref + LZ4_MIN_MATCH;
+			while (matchEnd + 8 <= matchLimit) {
+				uint64_t diff = read64(matchEnd) ^ read64(refEnd);
+				if (0 != diff) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+					matchEnd += __builtin_ctzll(diff) >> 3;
+#else
+					matchEnd += __builtin_clzll(diff) >> 3;
+#endif
+					goto matchFound;
+				}
+				matchEnd += 8;
+				refEnd += 8;
+			}
+			while (matchEnd < matchLimit && *matchEnd == *refEnd) { ++matchEnd; ++refEnd; }
+matchFound:
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) { --ip; --ref; }
+
+			size_t literals = (size_t) (ip - anchor);
+			size_t matchLength = (size_t) (matchEnd - ip) - LZ4_MIN_MATCH;
+			/* token, literals with length, offset, match length */
+			if ((size_t) (oend - op) < 1 + literals + literals / 255 + 1 + 2 + matchLength / 255 + 1) return 0;
+
+			unsigned char *token = op++;
+			if (literals >= 15) {
+				*token = 15 << 4;
+				op = writeLength(op, literals - 15);
+			} else {
+				*token = (unsigned char) (literals << 4);
+			}
+			memcpy(op, anchor, literals);
+			op += literals;
+
+			size_t offset = (size_t) (ip - ref);
+			*op++ = (unsigned char) (offset & 0xff);
+			*op++ = (unsigned char) (offset >> 8);
+
+			if (matchLength >= 15) {
+				*token |= 15;
+				op = writeLength(op, matchLength - 15);
+			} else {
+				*token |= (unsigned char) matchLength;
+			}
+
+			ip = anchor = matchEnd;
+			/* positions inside the match are not hashed, but the one right before its end is */
+			if (ip - 2 > src && ip < mflimit) table[hash32(read32(ip - 2))] = (uint32_t) (ip - 2 - src);
+		}
+	}
+
+	/* the remaining bytes as last literals */
+	size_t literals = (size_t) (end - anchor);
+	if ((size_t) (oend - op) < 1 + literals + literals / 255 + 1) return 0;
+	if (literals >= 15) {
+		*op++ = 15 << 4;
+		op = writeLength(op, literals - 15);
+	} else {
+		*op++ = (unsigned char) (literals << 4);
+	}
+	memcpy(op, anchor, literals);
+	op += literals;
+
+	return (size_t) (op - dst);
+}
+
+bool LZ4Codec::decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t size) {
+	const unsigned char *ip = src;
+	const unsigned char *const iend = src + srcSize;
+	unsigned char *op = dst;
+	unsigned char *const oend = dst + size;
+
+	for (;;) {
+		if (ip >= iend) return false;
+		unsigned int token = *ip++;
+
+		size_t literals = token >> 4;
+		if (15 == literals && !readLength(ip, iend, literals)) return false;
+		if (literals > (size_t) (iend - ip) || literals > (size_t) (oend - op)) return false;
+		if ((size_t) (iend - ip) - literals >= 16 && (size_t) (oend - op) - literals >= 16) {
+			wildCopy(op, ip, literals);
+		} else {
+			memcpy(op, ip, literals);
+		}
+		op += literals;
+		ip += literals;
+
+		/* the last sequence has no match */
+		if (ip == iend) return op == oend;
+
+		if (iend - ip < 2) return false;
+		size_t offset = ip[0] | ((size_t) ip[1] << 8);
+		ip += 2;
+		if (0 == offset || offset > (size_t) (op - dst)) return false;
+
+		size_t matchLength = token & 15;
+		if (15 == matchLength && !readLength(ip, iend, matchLength)) return false;
+		matchLength += LZ4_MIN_MATCH;
+		if (matchLength > (size_t) (oend - op)) return false;
+
+		const unsigned char *match = op - offset;
+		if (offset >= 16 && (size_t) (oend - op) - matchLength >= 16) {
+			wildCopy(op, match, matchLength);
+			op += matchLength;
+		} else if (offset >= matchLength) {
+			memcpy(op, match, matchLength);
+			op += matchLength;
+		} else if (offset >= 8) {
+			unsigned char *const matchEnd = op + matchLength;
+			for (; matchEnd - op >= 8; op += 8, match += 8) memcpy(op, match, 8);
+			while (op < matchEnd) *op++ = *match++;
+		} else {
+			/* overlapping copy repeats the last offset bytes */
+			for (size_t i = 0; i < matchLength; ++i) *op++ = *match++;
+		}
+	}
+}
+
+#endif
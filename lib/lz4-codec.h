@@ -0,0 +1,28 @@
+#ifndef __MY_LZ4_CODEC_H
+#define __MY_LZ4_CODEC_H __MY_LZ4_CODEC_H
+
+#include <cstddef>
+
+/**
+ * very fast compression in the LZ4 block format (no frames, no checksums); used to keep
+ * more decoded blocks in memory (see BlockCache).
+ *
+ * uses liblz4 if it was found (HAVE_LZ4), otherwise a simple built-in implementation
+ * of the same format (greedy matching with a small hash table, no dictionary).
+ */
+class LZ4Codec {
+private:
+	LZ4Codec();
+
+public:
+	/** buffer size that is always large enough for compress() */
+	static size_t compressBound(size_t size);
+
+	/** returns compressed size, or 0 if the result doesn't fit into capacity (incompressible data) */
+	static size_t compress(const unsigned char *src, size_t size, unsigned char *dst, size_t capacity);
+
+	/** size has to be the exact uncompressed size; false if the data is corrupted */
+	static bool decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t size);
+};
+
+#endif
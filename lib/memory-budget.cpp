@@ -0,0 +1,181 @@
+#include "memory-budget.h"
+
+#include "block-cache.h"
+#include "decoder-arena.h"
+
+#include <algorithm>
+
+/* share of the budget the indexes of all open files may use together */
+#define INDEX_BUDGET_SHARE 2
+/* share of the memory left for caching that is kept as idle decoder memory (the rest goes to the block cache) */
+#define IDLE_DECODER_SHARE 8
+/* share of the block cache budget that is used for the packed (LZ4 compressed) tier */
+#define PACKED_CACHE_SHARE 2
+/* decoder memory changes below this share of the limit don't rebalance (see decodersChanged()) */
+#define DECODER_UPDATE_SHARE 32
+
+MemoryBudget::MemoryBudget()
+: m_limit(0), m_balancedDecoders(0) {
+}
+
+MemoryBudget& MemoryBudget::instance() {
+	/* never destroyed: files in static objects might be closed during exit */
+	static MemoryBudget *budget = new MemoryBudget();
+	return *budget;
+}
+
+size_t MemoryBudget::indexBytes() {
+	size_t bytes = 0;
+	for (MemoryAccount *account : m_accounts) bytes += account->indexBytes();
+	return bytes;
+}
+
+size_t MemoryBudget::idleStateBytes() {
+	size_t bytes = 0;
+	for (MemoryAccount *account : m_accounts) bytes += account->idleStateBytes();
+	return bytes;
+}
+
+void MemoryBudget::rebalance() {
+	size_t decoders = DecoderArena::instance().usedBytes();
+	m_balancedDecoders = decoders;
+	size_t limit = m_limit;
+	if (0 == limit) return;
+
+	/* the decoders of idle states count as idle decoder memory, not as used */
+	size_t idleStates = std::min(idleStateBytes(), decoders);
+	size_t fixed = indexBytes() + decoders - idleStates;
+	size_t available = (limit > fixed) ? limit - fixed : 0;
+	size_t idleDecoders = available / IDLE_DECODER_SHARE;
+
+	size_t cache = available - idleDecoders;
+	size_t packed = cache / PACKED_CACHE_SHARE;
+
+	DecoderArena::instance().setMaxIdle((idleDecoders > idleStates) ? idleDecoders - idleStates : 0);
+	BlockCache::instance().setCapacity(cache - packed);
+	BlockCache::instance().setPackedCapacity(packed);
+}
+
+void MemoryBudget::setLimit(size_t limit) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_limit = limit;
+	rebalance();
+}
+
+size_t MemoryBudget::limit() {
+	return m_limit;
+}
+
+MemoryBudget::Usage MemoryBudget::usage() {
+	Usage usage;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	usage.indexes = indexBytes();
+	usage.cache = BlockCache::instance().size();
+	usage.packedCache = BlockCache::instance().packedSize();
+	usage.decoders = DecoderArena::instance().usedBytes();
+	usage.idleDecoders = DecoderArena::instance().idleBytes();
+	usage.idleStates = 0;
+	for (MemoryAccount *account : m_accounts) usage.idleStates += account->idleStates();
+	usage.idleStateBytes = idleStateBytes();
+	usage.files = m_accounts.size();
+	return usage;
+}
+
+size_t MemoryBudget::indexLimit(size_t defaultLimit) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (0 == m_limit) return defaultLimit;
+
+	size_t used = indexBytes();
+	size_t share = m_limit / INDEX_BUDGET_SHARE;
+	return (share > used) ? share - used : 0;
+}
+
+void MemoryBudget::trim(int level) {
+	if (level < TRIM_IDLE) return;
+
+	/* finishing the idle states runs without m_mutex (it frees decoder memory, and the files
+	 * might be in use); remove() waits until the accounts collected here are released */
+	std::vector<MemoryAccount*> accounts;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		accounts = m_accounts;
+		m_trimming.insert(m_trimming.end(), accounts.begin(), accounts.end());
+	}
+
+	/* finished states give their decoder memory back to the arena, so trim that afterwards */
+	for (MemoryAccount *account : accounts) account->releaseIdle();
+	DecoderArena::instance().trim();
+
+	if (level >= TRIM_ALL) {
+		BlockCache::instance().clear();
+	} else if (level >= TRIM_CACHE) {
+		BlockCache::instance().shrink(BlockCache::instance().size() / 2);
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (MemoryAccount *account : accounts) m_trimming.erase(std::find(m_trimming.begin(), m_trimming.end(), account));
+	m_trimmed.notify_all();
+	rebalance();
+}
+
+void MemoryBudget::update() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	rebalance();
+}
+
+void MemoryBudget::decodersChanged() {
+	size_t limit = m_limit;
+	if (0 == limit) return;
+
+	size_t decoders = DecoderArena::instance().usedBytes(), balanced = m_balancedDecoders;
+	size_t change = (decoders > balanced) ? decoders - balanced : balanced - decoders;
+	if (change < limit / DECODER_UPDATE_SHARE) return;
+
+	update();
+}
+
+void MemoryBudget::add(MemoryAccount *account) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_accounts.push_back(account);
+	rebalance();
+}
+
+void MemoryBudget::remove(MemoryAccount *account) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_accounts.erase(std::remove(m_accounts.begin(), m_accounts.end(), account), m_accounts.end());
+	m_trimmed.wait(lock, [this, account]() {
+		return m_trimming.end() == std::find(m_trimming.begin(), m_trimming.end(), account);
+	});
+	rebalance();
+}
+
+
+/********************************************************************************
+ *                                                                              *
+ *                               MemoryAccount                                  *
+ *                                                                              *
+ ********************************************************************************/
+
+MemoryAccount::MemoryAccount(uint64_t cacheId, FileReaderStatePool *pool, IndexBytes indexBytes)
+: m_cacheId(cacheId), m_pool(pool), m_indexBytes(indexBytes), m_attached(false) {
+}
+
+MemoryAccount::~MemoryAccount() {
+	detach();
+}
+
+void MemoryAccount::attach() {
+	if (m_attached) return;
+	m_attached = true;
+	MemoryBudget::instance().add(this);
+}
+
+void MemoryAccount::detach() {
+	if (!m_attached) return;
+	m_attached = false;
+	MemoryBudget::instance().remove(this);
+}
+
+size_t MemoryAccount::cacheBytes() const {
+	return (0 != m_cacheId) ? BlockCache::instance().fileSize(m_cacheId) : 0;
+}
@@ -0,0 +1,121 @@
+#ifndef __MY_MEMORY_BUDGET_H
+#define __MY_MEMORY_BUDGET_H __MY_MEMORY_BUDGET_H
+
+#include "file.h"
+
+#include <condition_variable>
+#include <functional>
+
+class MemoryAccount;
+
+/**
+ * process wide memory budget for the compressed files: block tables ("indexes") of the open files,
+ * decoder memory (see DecoderArena), decoded blocks (see BlockCache) and idle reader states.
+ *
+ * with a limit the indexes may use up to half of it (see indexLimit()); whatever the indexes
+ * and the decoders in use leave is split between the block cache (half of it for the packed tier)
+ * and idle decoder memory (including the memory of idle states), which are shrunk when files are
+ * opened, lazy indexes are loaded or the decoder memory grows. trim() releases memory on demand.
+ *
+ * thread safe.
+ */
+class MemoryBudget {
+public:
+	enum TrimLevel {
+		/** release idle reader states and idle decoder memory */
+		TRIM_IDLE = 1,
+		/** also drop the older half of the block cache */
+		TRIM_CACHE = 2,
+		/** also empty the block cache */
+		TRIM_ALL = 3,
+	};
+
+	struct Usage {
+		size_t indexes;
+		size_t cache; /** both tiers */
+		size_t packedCache; /** compressed bytes in the packed tier */
+		size_t decoders; /** handed out by the DecoderArena (includes the dictionaries of idle states) */
+		size_t idleDecoders; /** kept by the DecoderArena for reuse */
+		size_t idleStates; /** number of idle reader states */
+		size_t idleStateBytes; /** decoder memory and buffers of the idle states */
+		size_t files;
+	};
+
+private:
+	MemoryBudget(const MemoryBudget &);
+	MemoryBudget& operator=(const MemoryBudget &);
+
+	std::mutex m_mutex;
+	std::atomic<size_t> m_limit;
+	std::atomic<size_t> m_balancedDecoders; /** DecoderArena::usedBytes() at the last rebalance() */
+	std::vector<MemoryAccount*> m_accounts;
+	std::vector<MemoryAccount*> m_trimming; /** accounts trim() is releasing; remove() waits for them */
+	std::condition_variable m_trimmed;
+
+	size_t indexBytes(); /* needs m_mutex */
+	size_t idleStateBytes(); /* needs m_mutex */
+	void rebalance(); /* needs m_mutex */
+
+public:
+	MemoryBudget();
+
+	/** the process wide budget */
+	static MemoryBudget& instance();
+
+	/** total limit in bytes; 0 (default) means no limit, the caches keep their configured sizes then */
+	void setLimit(size_t limit);
+	size_t limit();
+
+	Usage usage();
+
+	/** maximum size for the index of a file opened now; defaultLimit if there is no budget */
+	size_t indexLimit(size_t defaultLimit);
+
+	/** release memory; see TrimLevel */
+	void trim(int level);
+
+	/** recompute the cache sizes (after the usage of an account changed) */
+	void update();
+	/** update() if the decoder memory changed noticeably since the last rebalance; cheap otherwise (called for each decoder allocation) */
+	void decodersChanged();
+
+	void add(MemoryAccount *account);
+	void remove(MemoryAccount *account);
+};
+
+/**
+ * memory used by an open compressed file: its index, its blocks in the BlockCache and its idle states.
+ * attach() it once the file is ready; the file has to detach() it before it destroys the index or the pool.
+ */
+class MemoryAccount {
+public:
+	typedef std::function<size_t()> IndexBytes;
+
+private:
+	MemoryAccount();
+	MemoryAccount(const MemoryAccount &);
+	MemoryAccount& operator=(const MemoryAccount &);
+
+	uint64_t m_cacheId;
+	FileReaderStatePool *m_pool;
+	IndexBytes m_indexBytes;
+	bool m_attached;
+
+public:
+	/** cacheId is 0 if the file doesn't use the BlockCache */
+	MemoryAccount(uint64_t cacheId, FileReaderStatePool *pool, IndexBytes indexBytes);
+	~MemoryAccount();
+
+	void attach();
+	void detach();
+
+	size_t indexBytes() const { return m_indexBytes(); }
+	size_t cacheBytes() const;
+	size_t idleStates() const { return m_pool->idle(); }
+	size_t idleStateBytes() const { return m_pool->idleBytes(); }
+
+	/** finish the idle states */
+	void releaseIdle() { m_pool->clear(); }
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include "readahead.h"
+
+#include "worker-pool.h"
+
+#include <algorithm>
+#include <condition_variable>
+
+/* start after the reader moved to the following block this often in a row */
+#define READAHEAD_MIN_SEQUENTIAL 2
+/* maximum number of blocks decoded ahead */
+#define READAHEAD_MAX_DEPTH 8
+/* maximum size of the blocks decoded ahead (per reader) */
+#define READAHEAD_MAX_BYTES (16*1024*1024)
+/* readahead is speculative; run it after other work in the pool */
+#define READAHEAD_PRIORITY (-1)
+
+struct Readahead::Pending {
+	enum Status { QUEUED, RUNNING, DONE, CANCELLED };
+
+	Pending(int64_t offset, size_t size)
+	: offset(offset), size(size), status(QUEUED), success(false) { }
+
+	int64_t offset;
+	size_t size;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	Status status;
+	bool success;
+	std::string error;
+	DecodedBlockPtr block;
+};
+
+Readahead::Readahead(NextBlock nextBlock, AcquireHelper acquireHelper, DecodeBlock decodeBlock, ReleaseHelper releaseHelper)
+: m_nextBlock(nextBlock), m_acquireHelper(acquireHelper), m_decodeBlock(decodeBlock), m_releaseHelper(releaseHelper),
+  m_blockOffset(-1), m_blockEnd(-1), m_sequential(0), m_depth(1) {
+}
+
+Readahead::~Readahead() {
+	clear();
+
+	/* running tasks use the helpers (and the callbacks) */
+	for (PendingPtr &pending : m_dropped) {
+		std::unique_lock<std::mutex> lock(pending->mutex);
+		while (Pending::RUNNING == pending->status) pending->cond.wait(lock);
+	}
+	m_dropped.clear();
+}
+
+/* static, as the readahead might be gone when a cancelled task starts */
+void Readahead::run(Readahead *readahead, PendingPtr pending) {
+	{
+		std::lock_guard<std::mutex> lock(pending->mutex);
+		if (Pending::QUEUED != pending->status) return;
+		pending->status = Pending::RUNNING;
+	}
+
+	/* the readahead waits for RUNNING blocks before it is destroyed */
+	DecodedBlockPtr block(new DecodedBlock(pending->size));
+	std::string error;
+	FileReaderState *helper = readahead->m_acquireHelper();
+	bool success = readahead->m_decodeBlock(helper, pending->offset, block->data, pending->size, error);
+	readahead->m_releaseHelper(helper, success);
+
+	{
+		std::lock_guard<std::mutex> lock(pending->mutex);
+		pending->status = Pending::DONE;
+		pending->success = success;
+		if (success) {
+			pending->block = block;
+		} else {
+			pending->error.swap(error);
+		}
+	}
+	pending->cond.notify_all();
+}
+
+void Readahead::drop(PendingPtr pending) {
+	std::lock_guard<std::mutex> lock(pending->mutex);
+	if (Pending::QUEUED == pending->status) {
+		pending->status = Pending::CANCELLED;
+	} else if (Pending::RUNNING == pending->status) {
+		m_dropped.push_back(pending);
+	}
+}
+
+void Readahead::clear() {
+	for (PendingPtr &pending : m_pending) drop(pending);
+	m_pending.clear();
+}
+
+bool Readahead::take(int64_t blockOffset, DecodedBlockPtr &block /* out */, std::string &error /* out */) {
+	block.reset();
+
+	while (!m_pending.empty() && m_pending.front()->offset < blockOffset) {
+		drop(m_pending.front());
+		m_pending.pop_front();
+	}
+	if (m_pending.empty() || m_pending.front()->offset != blockOffset) return true;
+
+	PendingPtr pending = m_pending.front();
+	m_pending.pop_front();
+
+	bool waited = false;
+	{
+		std::unique_lock<std::mutex> lock(pending->mutex);
+		if (Pending::QUEUED == pending->status) {
+			/* the workers didn't even start: faster to decode it in the reader */
+			pending->status = Pending::CANCELLED;
+			m_depth = std::min<unsigned int>(2*m_depth, READAHEAD_MAX_DEPTH);
+			return true;
+		}
+		while (Pending::RUNNING == pending->status) {
+			waited = true;
+			pending->cond.wait(lock);
+		}
+		if (!pending->success) {
+			error.assign(pending->error);
+			return false;
+		}
+		block = pending->block;
+	}
+
+	if (waited) {
+		m_depth = std::min<unsigned int>(2*m_depth, READAHEAD_MAX_DEPTH);
+	} else if (m_depth > 1 && !m_pending.empty()) {
+		/* the next block is ready too: the reader is the bottleneck */
+		std::lock_guard<std::mutex> lock(m_pending.front()->mutex);
+		if (Pending::DONE == m_pending.front()->status) --m_depth;
+	}
+	return true;
+}
+
+void Readahead::access(int64_t blockOffset, size_t size) {
+	if (blockOffset == m_blockOffset) return;
+
+	bool sequential = (blockOffset == m_blockEnd);
+	m_blockOffset = blockOffset;
+	m_blockEnd = blockOffset + size;
+
+	/* forget finished tasks */
+	m_dropped.erase(std::remove_if(m_dropped.begin(), m_dropped.end(), [](const PendingPtr &pending) {
+		std::lock_guard<std::mutex> lock(pending->mutex);
+		return Pending::RUNNING != pending->status;
+	}), m_dropped.end());
+
+	if (!sequential) {
+		m_sequential = 0;
+		clear();
+		return;
+	}
+
+	if (++m_sequential < READAHEAD_MIN_SEQUENTIAL) return;
+	schedule(blockOffset);
+}
+
+void Readahead::schedule(int64_t blockOffset) {
+	while (!m_pending.empty() && m_pending.front()->offset <= blockOffset) {
+		drop(m_pending.front());
+		m_pending.pop_front();
+	}
+
+	size_t bytes = 0;
+	for (PendingPtr &pending : m_pending) bytes += pending->size;
+
+	int64_t last = m_pending.empty() ? blockOffset : m_pending.back()->offset;
+	while (m_pending.size() < m_depth) {
+		int64_t nextOffset;
+		size_t nextSize;
+		if (!m_nextBlock(last, nextOffset, nextSize)) break;
+		if (0 == nextSize || bytes + nextSize > READAHEAD_MAX_BYTES) break;
+
+		PendingPtr pending(new Pending(nextOffset, nextSize));
+		m_pending.push_back(pending);
+		bytes += nextSize;
+		last = nextOffset;
+
+		Readahead *readahead = this;
+		WorkerPool::instance().submit([readahead, pending](unsigned int) {
+			run(readahead, pending);
+		}, READAHEAD_PRIORITY);
+	}
+}
@@ -0,0 +1,82 @@
+#ifndef __MY_READAHEAD_H
+#define __MY_READAHEAD_H __MY_READAHEAD_H
+
+#include "block-cache.h"
+#include "file.h"
+
+#include <deque>
+#include <functional>
+
+/**
+ * decodes the blocks following a forward sequential reader in the background
+ * (on WorkerPool::instance()), so decoding overlaps with consuming the data.
+ *
+ * belongs to a single reader state and is not thread safe itself; blocks are
+ * identified by their uncompressed offset. readahead starts after the reader moved
+ * to the next block a few times in a row, and stops when it seeks elsewhere.
+ *
+ * the depth (number of blocks decoded ahead) adapts to the reader: it doubles each
+ * time the reader had to wait for a block (or decode it itself), and shrinks by one
+ * when decoded blocks pile up.
+ *
+ * the workers decode with helper states borrowed from the file (its FileReaderStatePool),
+ * so idle helpers are limited and accounted like the other idle states of the file.
+ */
+class Readahead {
+public:
+	/** find the block following the block at blockOffset; returns false at the end of the file. called by the reader */
+	typedef std::function<bool(int64_t blockOffset, int64_t &nextOffset /* out */, size_t &nextSize /* out */)> NextBlock;
+	/** returns a decoder state for a worker (an idle state of the file, or a new one); called in worker threads */
+	typedef std::function<FileReaderState*()> AcquireHelper;
+	/** decode the complete block at blockOffset into buf (size bytes) with helper; called in worker threads */
+	typedef std::function<bool(FileReaderState *helper, int64_t blockOffset, unsigned char *buf, size_t size, std::string &error /* out */)> DecodeBlock;
+	/** return helper to the file after decoding (success) or free it (errors); called in worker threads */
+	typedef std::function<void(FileReaderState* &helper, bool success)> ReleaseHelper;
+
+private:
+	Readahead();
+	Readahead(const Readahead &);
+	Readahead& operator=(const Readahead &);
+
+	struct Pending;
+	typedef std::shared_ptr<Pending> PendingPtr;
+
+	NextBlock m_nextBlock;
+	AcquireHelper m_acquireHelper;
+	DecodeBlock m_decodeBlock;
+	ReleaseHelper m_releaseHelper;
+
+	int64_t m_blockOffset, m_blockEnd; /** last block the reader moved to */
+	unsigned int m_sequential; /** how often the reader moved to the following block in a row */
+	unsigned int m_depth;
+
+	std::deque<PendingPtr> m_pending; /** blocks after the current one, in file order */
+	std::vector<PendingPtr> m_dropped; /** dropped while decoding, still using helpers */
+
+	static void run(Readahead *readahead, PendingPtr pending);
+
+	void drop(PendingPtr pending);
+	void schedule(int64_t blockOffset);
+
+public:
+	Readahead(NextBlock nextBlock, AcquireHelper acquireHelper, DecodeBlock decodeBlock, ReleaseHelper releaseHelper);
+	/** cancels queued blocks, waits for the running ones */
+	~Readahead();
+
+	/**
+	 * returns (in block) the block at blockOffset if it was decoded ahead, waiting for it if it is
+	 * still being decoded; block is nullptr if it wasn't scheduled (or the reader was faster).
+	 * returns false if decoding the block failed.
+	 */
+	bool take(int64_t blockOffset, DecodedBlockPtr &block /* out */, std::string &error /* out */);
+
+	/** the reader moved to the block at blockOffset: detects sequential access and schedules the following blocks */
+	void access(int64_t blockOffset, size_t size);
+
+	/** drop all blocks decoded ahead (and cancel the queued ones) */
+	void clear();
+
+	unsigned int depth() const { return m_depth; }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include "sidecar-index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* bump when the layout of the header or any section changes */
+#define SIDECAR_VERSION 2
+/* written in native byte order; sidecars from machines with another byte order are ignored */
+#define SIDECAR_BYTE_ORDER 0x01020304
+/* number of bytes at the end of the archive stored to detect changes (covers index crc and footer for xz) */
+#define SIDECAR_TAIL_SIZE 32
+
+static const unsigned char sidecarMagic[8] = { 'x', 'z', 'j', 'n', 'i', 's', 'd', 'x' };
+
+namespace {
+	struct SidecarHeader {
+		unsigned char magic[8];
+		uint32_t byteOrder;
+		uint32_t version;
+		uint32_t type;
+		uint32_t tailSize;
+		uint64_t archiveSize;
+		int64_t archiveMtime; /** 0 if unknown */
+		unsigned char archiveTail[SIDECAR_TAIL_SIZE];
+		uint64_t dataSize; /** size of the sections following the header */
+	};
+}
+
+static void errnoFnameToSt(const char *prefix, const char *filename, std::string &error) {
+	error.assign(prefix);
+	error.push_back(' ');
+	error.append(filename);
+	error.push_back(':');
+	error.append(strerror(errno));
+}
+
+/* header for the current state of archive (dataSize not set) */
+static bool fingerprint(File archive, SidecarType type, SidecarHeader &header /* out */, std::string &error /* out */) {
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, sidecarMagic, sizeof(header.magic));
+	header.byteOrder = SIDECAR_BYTE_ORDER;
+	header.version = SIDECAR_VERSION;
+	header.type = type;
+
+	int64_t size = archive->filesize();
+	header.archiveSize = size;
+	NormalFile *normal = dynamic_cast<NormalFile*>(archive.get());
+	header.archiveMtime = (nullptr != normal) ? normal->mtime() : 0;
+
+	header.tailSize = (uint32_t) std::min<int64_t>(SIDECAR_TAIL_SIZE, size);
+	FileReaderState *state = nullptr;
+	bool success = archive->readInto(state, size - header.tailSize, header.tailSize, header.archiveTail, error);
+	archive->finish(state);
+	return success;
+}
+
+static bool writeAll(int fd, const unsigned char *data, size_t size) {
+	while (size > 0) {
+		ssize_t r = ::write(fd, data, size);
+		if (r < 0) {
+			if (EINTR == errno) continue;
+			return false;
+		}
+		data += r;
+		size -= r;
+	}
+	return true;
+}
+
+
+/********************************************************************************
+ *                                                                              *
+ *                               SidecarWriter                                  *
+ *                                                                              *
+ ********************************************************************************/
+
+void SidecarWriter::append(const void *data, size_t size) {
+	const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+	m_data.insert(m_data.end(), bytes, bytes + size);
+	m_data.resize((m_data.size() + 7) & ~(size_t) 7, 0);
+}
+
+bool SidecarWriter::write(const char *filename, File archive, SidecarType type, std::string &error /* out */) {
+	SidecarHeader header;
+	if (!fingerprint(archive, type, header, error)) return false;
+	header.dataSize = m_data.size();
+
+	std::string tmpname(filename);
+	tmpname.append(".tmp");
+
+	int fd = ::open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (-1 == fd) {
+		errnoFnameToSt("Couldn't create file", tmpname.c_str(), error);
+		return false;
+	}
+
+	if (!writeAll(fd, reinterpret_cast<const unsigned char*>(&header), sizeof(header))
+		|| !writeAll(fd, m_data.data(), m_data.size())) {
+		errnoFnameToSt("Couldn't write file", tmpname.c_str(), error);
+		::close(fd);
+		::unlink(tmpname.c_str());
+		return false;
+	}
+
+	if (0 != ::close(fd) || 0 != ::rename(tmpname.c_str(), filename)) {
+		errnoFnameToSt("Couldn't write file", filename, error);
+		::unlink(tmpname.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+
+/********************************************************************************
+ *                                                                              *
+ *                               SidecarReader                                  *
+ *                                                                              *
+ ********************************************************************************/
+
+bool SidecarReader::open(const char *filename, File archive, SidecarType type, std::string &error /* out */) {
+	m_file.reset();
+	m_pos = m_end = nullptr;
+
+	std::shared_ptr<MMappedFile> file(new MMappedFile(filename, error));
+	if (!file->valid()) return false;
+	if (!file->mapped()) {
+		error.assign("couldn't map sidecar index");
+		return false;
+	}
+
+	int64_t size = file->filesize();
+	if (size < (int64_t) sizeof(SidecarHeader) || size > std::numeric_limits<ssize_t>::max()) {
+		error.assign("invalid sidecar index size");
+		return false;
+	}
+
+	/* the complete file is mapped: the pointer stays valid as long as the file */
+	const unsigned char *data;
+	ssize_t datasize;
+	FileReaderState *state = nullptr;
+	bool success = file->read(state, 0, (ssize_t) size, data, datasize, error);
+	file->finish(state);
+	if (!success) return false;
+
+	const SidecarHeader *header = reinterpret_cast<const SidecarHeader*>(data);
+	if (0 != memcmp(header->magic, sidecarMagic, sizeof(sidecarMagic))
+		|| SIDECAR_BYTE_ORDER != header->byteOrder
+		|| SIDECAR_VERSION != header->version
+		|| (uint32_t) type != header->type) {
+		error.assign("invalid (or incompatible) sidecar index");
+		return false;
+	}
+	if (header->dataSize != (uint64_t) (size - sizeof(SidecarHeader))) {
+		error.assign("truncated sidecar index");
+		return false;
+	}
+
+	SidecarHeader expected;
+	if (!fingerprint(archive, type, expected, error)) return false;
+	if (expected.archiveSize != header->archiveSize
+		|| expected.tailSize != header->tailSize
+		|| 0 != memcmp(expected.archiveTail, header->archiveTail, expected.tailSize)
+		|| (0 != expected.archiveMtime && 0 != header->archiveMtime && expected.archiveMtime != header->archiveMtime)) {
+		error.assign("sidecar index doesn't match the archive");
+		return false;
+	}
+
+	m_file = file;
+	m_pos = data + sizeof(SidecarHeader);
+	m_end = data + size;
+	return true;
+}
@@ -0,0 +1,77 @@
+#ifndef __MY_SIDECAR_INDEX_H
+#define __MY_SIDECAR_INDEX_H __MY_SIDECAR_INDEX_H
+
+#include "file.h"
+
+/**
+ * sidecar index files store the block table of a compressed archive, so opening the
+ * archive doesn't need to parse (xz) or inflate (idxdefl) its index. see doc/sidecar-index-format.txt
+ *
+ * the data is stored in native byte order, with all sections 8-byte aligned, so the
+ * tables can be used directly from the mapped file. a sidecar is only used if it
+ * still matches the archive (size, modification time and the last bytes of the archive);
+ * otherwise the archive is opened the normal way.
+ */
+
+/** archive format the sidecar index belongs to */
+enum SidecarType {
+	SIDECAR_XZ = 1,
+	SIDECAR_IDXDEFL = 2,
+};
+
+/** collects the sections of a sidecar index and writes it */
+class SidecarWriter {
+private:
+	SidecarWriter(const SidecarWriter &);
+	SidecarWriter& operator=(const SidecarWriter &);
+
+	std::vector<unsigned char> m_data;
+
+public:
+	SidecarWriter() { }
+
+	/** append a section; padded to a multiple of 8 bytes */
+	void append(const void *data, size_t size);
+	template<typename T>
+	void appendValue(const T &value) { append(&value, sizeof(value)); }
+
+	/** write header and sections to filename (replaced atomically with rename()) */
+	bool write(const char *filename, File archive, SidecarType type, std::string &error /* out */);
+};
+
+/** mapped sidecar index; returns the sections in the order they were appended */
+class SidecarReader {
+private:
+	SidecarReader(const SidecarReader &);
+	SidecarReader& operator=(const SidecarReader &);
+
+	File m_file;
+	const unsigned char *m_pos, *m_end;
+
+public:
+	SidecarReader() : m_pos(nullptr), m_end(nullptr) { }
+
+	/** map filename and check it belongs to archive; returns false if it doesn't (or doesn't exist) */
+	bool open(const char *filename, File archive, SidecarType type, std::string &error /* out */);
+
+	/** the mapped sidecar; the pointers returned by take() are valid as long as it is referenced */
+	File file() const { return m_file; }
+
+	/** next section with count elements of type T; nullptr if the sidecar is too short */
+	template<typename T>
+	const T* take(size_t count) {
+		if (count > (size_t) (m_end - m_pos) / sizeof(T)) return nullptr;
+		const T *data = reinterpret_cast<const T*>(m_pos);
+		m_pos += std::min<size_t>((count * sizeof(T) + 7) & ~(size_t) 7, m_end - m_pos);
+		return data;
+	}
+	template<typename T>
+	bool takeValue(T &value /* out */) {
+		const T *data = take<T>(1);
+		if (nullptr == data) return false;
+		value = *data;
+		return true;
+	}
+};
+
+#endif
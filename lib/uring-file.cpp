@@ -0,0 +1,409 @@
+#include "uring-file.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+#endif
+
+/* size of the (registered) buffer used for read() */
+#define URING_READ_BUFFER_SIZE (64*1024)
+/* split larger reads into chunks of this size, so they can be processed in parallel */
+#define URING_CHUNK_SIZE (128*1024)
+/* how often to check the completion queue before sleeping with POLL_COMPLETIONS */
+#define URING_POLL_SPINS 20000
+
+static void errnumToSt(const char *prefix, int errnum, std::string &error) {
+	error.assign(prefix);
+	error.append(strerror(errnum));
+}
+
+namespace {
+	/* part of a read request; (offset, length, data) are advanced after short reads */
+	struct URingChunk {
+		int64_t offset;
+		size_t length;
+		unsigned char *data;
+		bool fixed; /* data is in the registered buffer */
+#ifdef HAVE_IO_URING
+		struct iovec iov; /* must stay valid until the request is completed */
+#endif
+	};
+}
+
+#ifdef HAVE_IO_URING
+
+/* minimal io_uring wrapper (no liburing), only supporting what we need: reads */
+class URing {
+private:
+	URing(const URing &);
+	URing& operator=(const URing &);
+
+	int m_fd;
+	unsigned int m_entries;
+
+	void *m_sqPtr, *m_cqPtr;
+	size_t m_sqLen, m_cqLen;
+	struct io_uring_sqe *m_sqes;
+	size_t m_sqesLen;
+
+	unsigned int *m_sqHead, *m_sqTail, *m_sqMask, *m_sqArray;
+	unsigned int *m_cqHead, *m_cqTail, *m_cqMask;
+	struct io_uring_cqe *m_cqes;
+
+	bool m_registered;
+
+	int enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+		return (int) syscall(__NR_io_uring_enter, m_fd, toSubmit, minComplete, flags, NULL, 0);
+	}
+
+public:
+	URing()
+	: m_fd(-1), m_entries(0), m_sqPtr(MAP_FAILED), m_cqPtr(MAP_FAILED), m_sqLen(0), m_cqLen(0), m_sqes((struct io_uring_sqe*) MAP_FAILED), m_sqesLen(0), m_registered(false) {
+	}
+
+	~URing() {
+		if (MAP_FAILED != (void*) m_sqes) munmap(m_sqes, m_sqesLen);
+		if (MAP_FAILED != m_cqPtr && m_cqPtr != m_sqPtr) munmap(m_cqPtr, m_cqLen);
+		if (MAP_FAILED != m_sqPtr) munmap(m_sqPtr, m_sqLen);
+		if (-1 != m_fd) close(m_fd);
+	}
+
+	unsigned int entries() const { return m_entries; }
+	bool registered() const { return m_registered; }
+
+	bool setup(unsigned int entries, std::string &error) {
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+
+		m_fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+		if (m_fd < 0) {
+			m_fd = -1;
+			errnumToSt("Couldn't setup io_uring: ", errno, error);
+			return false;
+		}
+		m_entries = p.sq_entries;
+
+		m_sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+		m_cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		bool single = (0 != (p.features & IORING_FEAT_SINGLE_MMAP));
+		if (single) m_sqLen = m_cqLen = std::max(m_sqLen, m_cqLen);
+
+		m_sqPtr = mmap(NULL, m_sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		if (MAP_FAILED == m_sqPtr) {
+			errnumToSt("Couldn't map io_uring: ", errno, error);
+			return false;
+		}
+		if (single) {
+			m_cqPtr = m_sqPtr;
+		} else {
+			m_cqPtr = mmap(NULL, m_cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+			if (MAP_FAILED == m_cqPtr) {
+				errnumToSt("Couldn't map io_uring: ", errno, error);
+				return false;
+			}
+		}
+
+		m_sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+		m_sqes = (struct io_uring_sqe*) mmap(NULL, m_sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+		if (MAP_FAILED == (void*) m_sqes) {
+			errnumToSt("Couldn't map io_uring: ", errno, error);
+			return false;
+		}
+
+		unsigned char *sq = (unsigned char*) m_sqPtr, *cq = (unsigned char*) m_cqPtr;
+		m_sqHead = (unsigned int*) (sq + p.sq_off.head);
+		m_sqTail = (unsigned int*) (sq + p.sq_off.tail);
+		m_sqMask = (unsigned int*) (sq + p.sq_off.ring_mask);
+		m_sqArray = (unsigned int*) (sq + p.sq_off.array);
+		m_cqHead = (unsigned int*) (cq + p.cq_off.head);
+		m_cqTail = (unsigned int*) (cq + p.cq_off.tail);
+		m_cqMask = (unsigned int*) (cq + p.cq_off.ring_mask);
+		m_cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+		return true;
+	}
+
+	/* failing is not an error (RLIMIT_MEMLOCK), just don't use IORING_OP_READ_FIXED then */
+	void registerBuffer(void *buf, size_t len) {
+		struct iovec iov;
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		m_registered = (0 == syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov, 1));
+	}
+
+	/* caller has to make sure there are never more than entries() requests in flight */
+	void queueRead(int fd, URingChunk &chunk, uint64_t userData) {
+		unsigned int tail = *m_sqTail;
+		unsigned int ndx = tail & *m_sqMask;
+		struct io_uring_sqe *sqe = &m_sqes[ndx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = fd;
+		sqe->off = chunk.offset;
+		if (chunk.fixed) {
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->addr = (uint64_t) (uintptr_t) chunk.data;
+			sqe->len = chunk.length;
+			sqe->buf_index = 0;
+		} else {
+			/* IORING_OP_READ needs linux 5.6, READV works with all io_uring kernels */
+			chunk.iov.iov_base = chunk.data;
+			chunk.iov.iov_len = chunk.length;
+			sqe->opcode = IORING_OP_READV;
+			sqe->addr = (uint64_t) (uintptr_t) &chunk.iov;
+			sqe->len = 1;
+		}
+		sqe->user_data = userData;
+
+		m_sqArray[ndx] = ndx;
+		__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	}
+
+	bool completionsAvailable() {
+		return *m_cqHead != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+	}
+
+	/* submit queued requests; wait for at least one completion if wait is set */
+	bool submit(unsigned int toSubmit, bool wait, bool poll, std::string &error) {
+		if (poll && wait) {
+			/* only submit, then spin on the completion queue */
+			while (toSubmit > 0) {
+				int r = enter(toSubmit, 0, 0);
+				if (r < 0) {
+					if (EINTR == errno) continue;
+					errnumToSt("io_uring_enter failed: ", errno, error);
+					return false;
+				}
+				toSubmit -= r;
+			}
+			for (int i = 0; i < URING_POLL_SPINS; ++i) {
+				if (completionsAvailable()) return true;
+			}
+		}
+
+		for (;;) {
+			unsigned int minComplete = wait ? 1 : 0;
+			int r = enter(toSubmit, minComplete, wait ? IORING_ENTER_GETEVENTS : 0);
+			if (r < 0) {
+				if (EINTR == errno) continue;
+				errnumToSt("io_uring_enter failed: ", errno, error);
+				return false;
+			}
+			toSubmit -= r;
+			if (0 == toSubmit) return true;
+		}
+	}
+
+	/* returns false if no completion is available */
+	bool popCompletion(uint64_t &userData, int &res) {
+		unsigned int head = *m_cqHead;
+		if (head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) return false;
+
+		struct io_uring_cqe *cqe = &m_cqes[head & *m_cqMask];
+		userData = cqe->user_data;
+		res = cqe->res;
+
+		__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+#endif
+
+class URingFileReaderState : public FileReaderState {
+public:
+	URingFileReaderState() : ringReady(false) { }
+
+	unsigned char buf[URING_READ_BUFFER_SIZE];
+	bool ringReady;
+#ifdef HAVE_IO_URING
+	URing ring;
+#endif
+
+	/* read all chunks completely */
+	bool readChunks(int fd, std::vector<URingChunk> &chunks, bool poll, std::string &error) {
+#ifdef HAVE_IO_URING
+		size_t next = 0, inflight = 0, done = 0;
+		std::vector<size_t> retry; /* chunks to submit again after short reads */
+
+		while (done < chunks.size()) {
+			unsigned int queued = 0;
+			while (inflight + queued < ring.entries() && (!retry.empty() || next < chunks.size())) {
+				size_t ndx;
+				if (!retry.empty()) {
+					ndx = retry.back();
+					retry.pop_back();
+				} else {
+					ndx = next++;
+				}
+				ring.queueRead(fd, chunks[ndx], ndx);
+				++queued;
+			}
+			inflight += queued;
+
+			if (!ring.submit(queued, true, poll, error)) return false;
+
+			uint64_t ndx;
+			int res;
+			while (ring.popCompletion(ndx, res)) {
+				--inflight;
+				URingChunk &chunk = chunks[ndx];
+				if (res < 0) {
+					if (-EINTR == res || -EAGAIN == res) {
+						retry.push_back(ndx);
+						continue;
+					}
+					errnumToSt("Couldn't read file:", -res, error);
+					return false;
+				}
+				if (0 == res) {
+					error.assign("Couldn't read file: didn't get enough data");
+					return false;
+				}
+				if ((size_t) res < chunk.length) {
+					chunk.offset += res;
+					chunk.length -= res;
+					chunk.data += res;
+					retry.push_back(ndx);
+				} else {
+					++done;
+				}
+			}
+		}
+		return true;
+#else
+		(void) fd; (void) chunks; (void) poll;
+		error.assign("io_uring not supported");
+		return false;
+#endif
+	}
+};
+
+static void addChunks(std::vector<URingChunk> &chunks, int64_t offset, ssize_t length, unsigned char *data, bool fixed) {
+	while (length > 0) {
+		URingChunk chunk;
+		chunk.offset = offset;
+		chunk.length = std::min<ssize_t>(length, URING_CHUNK_SIZE);
+		chunk.data = data;
+		chunk.fixed = fixed;
+		chunks.push_back(chunk);
+
+		offset += chunk.length;
+		length -= chunk.length;
+		data += chunk.length;
+	}
+}
+
+URingFile::URingFile(const char *filename, std::string &error /* out */, unsigned int queueDepth, int flags)
+: NormalFile(filename, error), m_queueDepth(queueDepth), m_flags(flags), m_available(true), m_statePool(this, FileReaderStatePool::defaultMaxIdle()) {
+#ifndef HAVE_IO_URING
+	m_available = false;
+#endif
+	if (0 == m_queueDepth) m_queueDepth = 1;
+}
+
+URingFile::~URingFile() {
+	m_statePool.clear();
+}
+
+static URingFileReaderState* uringState(FileReaderState* &internalState) {
+	URingFileReaderState *state;
+	if (nullptr == internalState) {
+		internalState = state = new URingFileReaderState();
+	} else {
+		state = dynamic_cast<URingFileReaderState*>(internalState);
+		assert(nullptr != state);
+	}
+	return state;
+}
+
+bool URingFile::read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */) {
+	URingFileReaderState *state = uringState(internalState);
+
+	if (length > (ssize_t) sizeof(state->buf)) length = sizeof(state->buf);
+
+	if (!readInto(internalState, offset, length, state->buf, error)) return false;
+
+	data = state->buf;
+	datasize = length;
+
+	return true;
+}
+
+bool URingFile::readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	ReadRequest req = { offset, length, data };
+	return readMany(internalState, std::vector<ReadRequest>(1, req), error);
+}
+
+bool URingFile::readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */) {
+	if (-1 == m_fd) {
+		error.assign("File not opened");
+		return false;
+	}
+
+	URingFileReaderState *state = uringState(internalState);
+
+#ifdef HAVE_IO_URING
+	if (!state->ringReady && m_available) {
+		std::string ringError;
+		if (state->ring.setup(m_queueDepth, ringError)) {
+			if (0 != (m_flags & REGISTER_BUFFERS)) state->ring.registerBuffer(state->buf, sizeof(state->buf));
+			state->ringReady = true;
+		} else {
+			/* don't try again for other states */
+			m_available = false;
+		}
+	}
+#endif
+
+	if (!state->ringReady) {
+		/* fallback to pread() */
+		for (const ReadRequest &req : requests) {
+			if (!NormalFile::readInto(internalState, req.offset, req.length, req.data, error)) return false;
+		}
+		return true;
+	}
+
+	std::vector<ReadRequest> reads;
+	std::vector<ReadCopy> copies;
+	planReadMany(requests, reads, copies);
+
+	int64_t filesize = m_filesize;
+	std::vector<URingChunk> chunks;
+	for (const ReadRequest &req : reads) {
+		if (req.length < 0 || req.offset < 0 || req.length > filesize || req.offset > filesize - req.length) {
+			error.assign("Invalid offset/length");
+			return false;
+		}
+#ifdef HAVE_IO_URING
+		bool fixed = state->ring.registered() && req.data >= state->buf && req.data + req.length <= state->buf + sizeof(state->buf);
+#else
+		bool fixed = false;
+#endif
+		addChunks(chunks, req.offset, req.length, req.data, fixed);
+	}
+
+	if (!state->readChunks(m_fd, chunks, 0 != (m_flags & POLL_COMPLETIONS), error)) return false;
+
+	finishReadCopies(copies);
+	return true;
+}
+
+void URingFile::finish(FileReaderState* &internalState) {
+	if (nullptr != internalState) {
+		URingFileReaderState *state = dynamic_cast<URingFileReaderState*>(internalState);
+		assert(nullptr != state);
+		delete state;
+		internalState = nullptr;
+	}
+}
+
+bool URingFile::pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	return m_statePool.pread(offset, length, data, error);
+}
@@ -0,0 +1,55 @@
+#ifndef __MY_URING_FILE_H
+#define __MY_URING_FILE_H __MY_URING_FILE_H
+
+#include "file.h"
+
+/**
+ * OS provided file, reading through io_uring (linux >= 5.1).
+ *
+ * each state owns its own ring (so different threads don't share anything);
+ * large readInto() requests are split into chunks and readMany() requests are
+ * submitted as one batch, so the device sees more than one request at a time.
+ *
+ * falls back to pread() (NormalFile) if io_uring isn't available (old kernel,
+ * seccomp, not compiled with HAVE_IO_URING, ...).
+ */
+class URingFile : public NormalFile {
+private:
+	URingFile();
+	URingFile(const IFile &);
+	URingFile& operator=(const URingFile &);
+
+public:
+	enum Flags {
+		/** register the read() buffer of each state with the kernel (IORING_OP_READ_FIXED) */
+		REGISTER_BUFFERS = 1,
+		/** busy-poll the completion queue for a while before sleeping in io_uring_enter() */
+		POLL_COMPLETIONS = 2,
+	};
+
+protected:
+	unsigned int m_queueDepth;
+	int m_flags;
+	std::atomic<bool> m_available; /** false once ring setup failed; use pread() for all states then */
+	FileReaderStatePool m_statePool; /** idle states (with their rings) for pread() */
+
+public:
+	/** queueDepth is the ring size (and the maximum of requests in flight) per state */
+	URingFile(const char *filename, std::string &error /* out */, unsigned int queueDepth = 32, int flags = REGISTER_BUFFERS);
+	virtual ~URingFile();
+
+	/** whether io_uring is used (might change to false after the first state failed to setup its ring) */
+	bool uringAvailable() { return m_available; }
+
+	virtual bool read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */);
+	virtual bool readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+	/** submits all (non-overlapping) reads in batches of queueDepth */
+	virtual bool readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */);
+	virtual void finish(FileReaderState* &internalState);
+	/** uses (and returns) idle states from statePool() */
+	virtual bool pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+
+	FileReaderStatePool& statePool() { return m_statePool; }
+};
+
+#endif
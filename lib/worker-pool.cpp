@@ -0,0 +1,113 @@
+#include "worker-pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace {
+	/* shared between parallelFor() and its tasks; tasks might start after parallelFor() returned */
+	struct ParallelForContext {
+		ParallelForContext(size_t count, WorkerPool::Job job)
+		: job(job), count(count), next(0), failed(false), finished(0) { }
+
+		WorkerPool::Job job;
+		size_t count;
+		std::atomic<size_t> next;
+		std::atomic<bool> failed;
+
+		std::mutex mutex;
+		std::condition_variable cond;
+		size_t finished;
+		std::string error;
+
+		void runJobs() {
+			for (;;) {
+				size_t index = next++;
+				if (index >= count) return;
+
+				std::string joberror;
+				bool success = failed || job(index, joberror);
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!success && !failed) {
+					failed = true;
+					error.swap(joberror);
+				}
+				if (++finished == count) cond.notify_all();
+			}
+		}
+	};
+}
+
+WorkerPool& WorkerPool::instance() {
+	/* never destroyed: tasks might still run during exit */
+	static WorkerPool *pool = new WorkerPool();
+	return *pool;
+}
+
+WorkerPool::WorkerPool(unsigned int threads)
+: m_sequence(0), m_stop(false) {
+	if (0 == threads) threads = std::thread::hardware_concurrency();
+	if (0 == threads) threads = 1;
+
+	for (unsigned int i = 0; i < threads; ++i) {
+		m_threads.push_back(std::thread(&WorkerPool::run, this, i));
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		while (!m_queue.empty()) m_queue.pop();
+	}
+	m_cond.notify_all();
+
+	for (std::thread &t : m_threads) t.join();
+}
+
+void WorkerPool::submit(Task task, int priority) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_stop) return;
+		QueuedTask queued = { priority, m_sequence++, task };
+		m_queue.push(queued);
+	}
+	m_cond.notify_one();
+}
+
+void WorkerPool::run(unsigned int worker) {
+	for (;;) {
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stop && m_queue.empty()) m_cond.wait(lock);
+			if (m_stop) return;
+
+			task = m_queue.top().task;
+			m_queue.pop();
+		}
+
+		task(worker);
+	}
+}
+
+bool WorkerPool::parallelFor(size_t count, Job job, std::string &error /* out */) {
+	if (0 == count) return true;
+
+	std::shared_ptr<ParallelForContext> context(new ParallelForContext(count, job));
+	size_t helpers = std::min<size_t>(threads(), count - 1);
+	for (size_t i = 0; i < helpers; ++i) {
+		submit([context](unsigned int) { context->runJobs(); });
+	}
+
+	context->runJobs();
+
+	std::unique_lock<std::mutex> lock(context->mutex);
+	while (context->finished < count) context->cond.wait(lock);
+	if (context->failed) {
+		error.swap(context->error);
+		return false;
+	}
+	return true;
+}
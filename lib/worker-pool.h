@@ -0,0 +1,75 @@
+#ifndef __MY_WORKER_POOL_H
+#define __MY_WORKER_POOL_H __MY_WORKER_POOL_H
+
+#include <cstdint>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * fixed number of worker threads processing tasks by priority
+ * (higher priority first, same priority in submission order).
+ *
+ * tasks get the index of the worker thread running them (0 <= worker < threads()),
+ * so callers can keep per-thread data (like FileReaderStates) without locking.
+ *
+ * the destructor waits for running tasks; tasks still queued are dropped without running.
+ */
+class WorkerPool {
+public:
+	typedef std::function<void(unsigned int worker)> Task;
+
+private:
+	WorkerPool(const WorkerPool &);
+	WorkerPool& operator=(const WorkerPool &);
+
+	struct QueuedTask {
+		int priority;
+		uint64_t sequence;
+		Task task;
+
+		bool operator<(const QueuedTask &other) const {
+			/* std::priority_queue returns the largest element first */
+			if (priority != other.priority) return priority < other.priority;
+			return sequence > other.sequence;
+		}
+	};
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::priority_queue<QueuedTask> m_queue;
+	uint64_t m_sequence;
+	bool m_stop;
+	std::vector<std::thread> m_threads;
+
+	void run(unsigned int worker);
+
+public:
+	/** threads == 0: use std::thread::hardware_concurrency() */
+	explicit WorkerPool(unsigned int threads = 0);
+	~WorkerPool();
+
+	/** process wide pool (hardware_concurrency() threads) for decoding large reads in parallel */
+	static WorkerPool& instance();
+
+	unsigned int threads() const { return m_threads.size(); }
+
+	void submit(Task task, int priority = 0);
+
+	typedef std::function<bool(size_t index, std::string &error /* out */)> Job;
+
+	/**
+	 * run job(0), ..., job(count-1) on the pool and wait for them.
+	 * the calling thread runs jobs too, so this doesn't deadlock when called
+	 * from a task (even if all workers are busy).
+	 * once a job failed the remaining ones are skipped; returns the first error.
+	 */
+	bool parallelFor(size_t count, Job job, std::string &error /* out */);
+};
+
+#endif
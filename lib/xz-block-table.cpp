@@ -0,0 +1,712 @@
+#include "xz-block-table.h"
+
+#include "memory-budget.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <sstream>
+
+/* limits for the unpadded size of a block (see xz file format specification, and liblzma's common/index.h) */
+#define UNPADDED_SIZE_MIN LZMA_VLI_C(5)
+#define UNPADDED_SIZE_MAX (LZMA_VLI_MAX & ~LZMA_VLI_C(3))
+
+static void errnoLzmaToStr(const char *prefix, lzma_ret res, std::string &error) {
+	std::ostringstream s;
+	s << prefix << ": ";
+	switch (res) {
+	case LZMA_FORMAT_ERROR:
+		s << "File format not recognized";
+		break;
+	case LZMA_OPTIONS_ERROR:
+		s << "Invalid or unsupported options";
+		break;
+	case LZMA_DATA_ERROR:
+		s << "Data is corrupt";
+		break;
+	case LZMA_PROG_ERROR:
+		s << "Programming error";
+		break;
+	default:
+		s << "Unknown error (" << ((int) res) << ")";
+		break;
+	}
+	error.assign(s.str());
+}
+
+/* blocks and indexes are padded to a multiple of four bytes */
+static lzma_vli paddedSize(lzma_vli size) {
+	return (size + 3) & ~LZMA_VLI_C(3);
+}
+
+/* index of the last value <= value in the sorted values; needs n > 0 and values[0] <= value */
+template<typename T>
+static size_t findLastNotGreater(const T *values, size_t n, T value) {
+	/* branchless binary search: the conditional becomes a cmov, and there are no mispredictions */
+	const T *base = values;
+	while (n > 1) {
+		size_t half = n / 2;
+		base = (base[half] <= value) ? base + half : base;
+		n -= half;
+	}
+	return base - values;
+}
+
+/* same for an array of structs, comparing the given member */
+template<typename S, typename T>
+static size_t findLastMember(const S *values, size_t n, T S::*member, T value) {
+	const S *base = values;
+	while (n > 1) {
+		size_t half = n / 2;
+		base = (base[half].*member <= value) ? base + half : base;
+		n -= half;
+	}
+	return base - values;
+}
+
+
+/********************************************************************************
+ *                                                                              *
+ *                              XZPackedOffsets                                 *
+ *                                                                              *
+ ********************************************************************************/
+
+void XZPackedOffsets::push_back(uint64_t value) {
+	if (m_isFull) {
+		m_full.push_back(value);
+	} else if (0 == m_size % GROUP) {
+		m_bases.push_back(value);
+		m_deltas.push_back(0);
+	} else if (value - m_bases.back() <= std::numeric_limits<uint32_t>::max()) {
+		m_deltas.push_back((uint32_t) (value - m_bases.back()));
+	} else {
+		/* difference too large, switch to plain values */
+		m_full.reserve(std::max(m_deltas.capacity(), m_size + 1));
+		for (size_t i = 0; i < m_size; ++i) m_full.push_back((*this)[i]);
+		m_full.push_back(value);
+		m_isFull = true;
+		std::vector<uint64_t>().swap(m_bases);
+		std::vector<uint32_t>().swap(m_deltas);
+	}
+	++m_size;
+	updateData();
+}
+
+void XZPackedOffsets::reserve(size_t size) {
+	if (m_isFull) {
+		m_full.reserve(size);
+	} else {
+		m_bases.reserve((size + GROUP - 1) / GROUP);
+		m_deltas.reserve(size);
+	}
+	updateData();
+}
+
+void XZPackedOffsets::updateData() {
+	m_basesData = m_bases.data();
+	m_deltasData = m_deltas.data();
+	m_fullData = m_full.data();
+}
+
+void XZPackedOffsets::clear() {
+	std::vector<uint64_t>().swap(m_bases);
+	std::vector<uint32_t>().swap(m_deltas);
+	std::vector<uint64_t>().swap(m_full);
+	m_isFull = false;
+	m_size = 0;
+	updateData();
+}
+
+void XZPackedOffsets::shrink_to_fit() {
+	m_bases.shrink_to_fit();
+	m_deltas.shrink_to_fit();
+	m_full.shrink_to_fit();
+	updateData();
+}
+
+size_t XZPackedOffsets::memoryUsage() const {
+	return m_bases.capacity() * sizeof(uint64_t) + m_deltas.capacity() * sizeof(uint32_t) + m_full.capacity() * sizeof(uint64_t);
+}
+
+size_t XZPackedOffsets::findLast(uint64_t value) const {
+	assert(m_size > 0);
+	if (m_isFull) return findLastNotGreater(m_fullData, m_size, value);
+
+	size_t group = findLastNotGreater(m_basesData, (m_size + GROUP - 1) / GROUP, value);
+	size_t first = group * GROUP;
+	uint64_t delta = value - m_basesData[group];
+	uint32_t delta32 = (delta > std::numeric_limits<uint32_t>::max()) ? std::numeric_limits<uint32_t>::max() : (uint32_t) delta;
+	return first + findLastNotGreater(m_deltasData + first, std::min<size_t>(GROUP, m_size - first), delta32);
+}
+
+void XZPackedOffsets::save(SidecarWriter &sidecar) const {
+	sidecar.appendValue<uint64_t>(m_size);
+	sidecar.appendValue<uint64_t>(m_isFull ? 1 : 0);
+	if (m_isFull) {
+		sidecar.append(m_fullData, m_size * sizeof(uint64_t));
+	} else {
+		sidecar.append(m_basesData, (m_size + GROUP - 1) / GROUP * sizeof(uint64_t));
+		sidecar.append(m_deltasData, m_size * sizeof(uint32_t));
+	}
+}
+
+bool XZPackedOffsets::load(SidecarReader &sidecar) {
+	clear();
+
+	uint64_t size, isFull;
+	if (!sidecar.takeValue(size) || !sidecar.takeValue(isFull)) return false;
+	if (size > std::numeric_limits<size_t>::max()) return false;
+
+	if (0 != isFull) {
+		m_fullData = sidecar.take<uint64_t>(size);
+		if (nullptr == m_fullData) return false;
+	} else {
+		m_basesData = sidecar.take<uint64_t>((size + GROUP - 1) / GROUP);
+		m_deltasData = sidecar.take<uint32_t>(size);
+		if (nullptr == m_basesData || nullptr == m_deltasData) return false;
+	}
+	m_isFull = (0 != isFull);
+	m_size = size;
+	return true;
+}
+
+
+/********************************************************************************
+ *                                                                              *
+ *                                XZBlockTable                                  *
+ *                                                                              *
+ ********************************************************************************/
+
+namespace {
+	struct IndexInfo {
+		lzma_vli records;
+		lzma_vli blocksSize; /* sum of the (padded) total sizes */
+		lzma_vli uncompressedSize;
+	};
+
+	/* called for each record; returning false aborts parsing (error has to be set) */
+	typedef std::function<bool(lzma_vli unpaddedSize, lzma_vli uncompressedSize, std::string &error)> IndexRecord;
+}
+
+/* parse (and verify) the index field of a stream at pos (size bytes); calls record() for each block (if set) */
+static bool parseIndex(File file, FileReaderState* &filestate, int64_t pos, int64_t size, const IndexRecord &record, IndexInfo &info /* out */, std::string &error /* out */) {
+	enum { INDICATOR, COUNT, UNPADDED, UNCOMPRESSED, PADDING, CRC } field = INDICATOR;
+	lzma_vli vli = 0, count = 0, unpadded = 0;
+	unsigned int vliBytes = 0, crcBytes = 0;
+	uint32_t crc = 0, storedCrc = 0;
+
+	info.records = 0;
+	info.blocksSize = 0;
+	info.uncompressedSize = 0;
+
+	for (int64_t done = 0; done < size; ) {
+		const unsigned char *data;
+		ssize_t datasize;
+		if (!file->read(filestate, pos + done, (ssize_t) std::min<int64_t>(size - done, 64*1024), data, datasize, error)) return false;
+		if (0 == datasize) {
+			error.assign("Unexpected end of file in index");
+			return false;
+		}
+
+		/* the crc covers everything before the CRC field */
+		ssize_t covered = (CRC == field) ? 0 : datasize;
+		for (ssize_t i = 0; i < datasize; ++i) {
+			unsigned char c = data[i];
+			int64_t fieldEnd = done + i + 1; /* offset in the index after this byte */
+
+			switch (field) {
+			case INDICATOR:
+				if (0 != c) goto invalid;
+				field = COUNT;
+				continue;
+			case PADDING:
+				if (0 != c) goto invalid;
+				if (0 == fieldEnd % 4) {
+					field = CRC;
+					covered = i + 1;
+				}
+				continue;
+			case CRC:
+				if (crcBytes >= 4) goto invalid;
+				storedCrc |= ((uint32_t) c) << (8 * crcBytes++);
+				continue;
+			default:
+				break;
+			}
+
+			/* variable length integer; reject overlong encodings like liblzma */
+			if (vliBytes >= LZMA_VLI_BYTES_MAX || (vliBytes > 0 && 0 == c)) goto invalid;
+			vli |= ((lzma_vli) (c & 0x7F)) << (7 * vliBytes++);
+			if (0 != (c & 0x80)) continue;
+
+			lzma_vli value = vli;
+			vli = 0;
+			vliBytes = 0;
+
+			if (COUNT == field) {
+				count = value;
+				field = UNPADDED;
+			} else if (UNPADDED == field) {
+				if (value < UNPADDED_SIZE_MIN || value > UNPADDED_SIZE_MAX) goto invalid;
+				unpadded = value;
+				field = UNCOMPRESSED;
+				continue;
+			} else {
+				if (value > LZMA_VLI_MAX) goto invalid;
+				info.uncompressedSize += value;
+				if (info.uncompressedSize > LZMA_VLI_MAX) goto invalid;
+				if (record && !record(unpadded, value, error)) return false;
+				++info.records;
+				info.blocksSize += paddedSize(unpadded);
+				if (info.blocksSize > LZMA_VLI_MAX) goto invalid;
+				field = UNPADDED;
+			}
+
+			if (info.records == count) {
+				if (0 == fieldEnd % 4) {
+					field = CRC;
+					covered = i + 1;
+				} else {
+					field = PADDING;
+				}
+			}
+		}
+
+		crc = lzma_crc32(data, covered, crc);
+		done += datasize;
+	}
+
+	if (CRC != field || 4 != crcBytes) goto invalid;
+	if (crc != storedCrc) {
+		error.assign("decoding index failed: crc mismatch");
+		return false;
+	}
+	return true;
+
+invalid:
+	error.assign("decoding index failed: Data is corrupt");
+	return false;
+}
+
+XZBlockTable::XZBlockTable()
+: m_blocks(0), m_uniformSize(0), m_uncompressedSize(0), m_lazy(false) {
+}
+
+XZBlockTable::~XZBlockTable() {
+	if (m_lazy) {
+		for (size_t i = 0; i < m_streams.size(); ++i) delete m_streamBlocks[i].load();
+	}
+}
+
+size_t XZBlockTable::memoryUsage() const {
+	size_t usage = sizeof(*this) + m_compressed.memoryUsage() + m_uncompressed.memoryUsage() + m_streams.capacity() * sizeof(Stream);
+	if (m_lazy) {
+		usage += m_streams.size() * sizeof(m_streamBlocks[0]);
+		for (size_t i = 0; i < m_streams.size(); ++i) {
+			const StreamBlocks *blocks = m_streamBlocks[i].load();
+			if (nullptr != blocks) usage += sizeof(*blocks) + blocks->compressed.memoryUsage() + blocks->uncompressed.memoryUsage();
+		}
+	}
+	return usage;
+}
+
+/* stream walking adapted from official xz source: xz/src/xz/list.c */
+XZBlockTable* XZBlockTable::load(File file, uint64_t memlimit, bool lazy, std::string &error /* out */) {
+	union {
+		unsigned char u8[LZMA_STREAM_HEADER_SIZE];
+		uint32_t u32[LZMA_STREAM_HEADER_SIZE/4];
+	} buf;
+
+	struct StreamPos {
+		int64_t blocksStart, indexStart, indexSize;
+		lzma_vli records, uncompressedSize;
+		lzma_check check;
+	};
+	std::vector<StreamPos> streams; /* last stream first */
+	lzma_vli records = 0;
+
+	XZBlockTable *table = nullptr;
+	FileReaderState *filestate = nullptr;
+	lzma_stream_flags header_flags;
+	lzma_stream_flags footer_flags;
+	lzma_ret ret;
+
+	int64_t uncompressedOffset = 0, firstSize = -1, lastSize = -1;
+	bool uniform = true;
+
+	// Current position in the file. We parse the file backwards so
+	// initialize it to point to the end of the file.
+	int64_t pos = file->filesize();
+
+	// First pass: locate the streams (and verify their indexes) from the end.
+	do {
+		lzma_vli index_size;
+		IndexInfo info;
+
+		// Check that there is enough data left to contain at least
+		// the Stream Header and Stream Footer. This check cannot
+		// fail in the first pass of this loop.
+		if (pos < 2 * LZMA_STREAM_HEADER_SIZE) {
+			error.assign("file too small for xz archive");
+			goto failed;
+		}
+
+		pos -= LZMA_STREAM_HEADER_SIZE;
+
+		// Locate the Stream Footer. There may be Stream Padding which
+		// we must skip when reading backwards.
+		for (;;) {
+			if (pos < LZMA_STREAM_HEADER_SIZE) {
+				error.assign("file too small for xz archive");
+				goto failed;
+			}
+
+			if (!file->readInto(filestate, pos, LZMA_STREAM_HEADER_SIZE, buf.u8, error)) goto failed;
+
+			/* padding must be a multiple of 4; read the footer again after skipping it */
+			if (buf.u32[2] != 0) break;
+			if (buf.u32[1] != 0) {
+				pos -= 4;
+			} else if (buf.u32[0] != 0) {
+				pos -= 8;
+			} else {
+				pos -= 12;
+			}
+		}
+
+		// Decode the Stream Footer.
+		ret = lzma_stream_footer_decode(&footer_flags, buf.u8);
+		if (LZMA_OK != ret) {
+			errnoLzmaToStr("invalid footer", ret, error);
+			goto failed;
+		}
+
+		// Check that the size of the Index field looks sane.
+		index_size = footer_flags.backward_size;
+		if ((lzma_vli)(pos) < index_size + LZMA_STREAM_HEADER_SIZE) {
+			error.assign("invalid index size");
+			goto failed;
+		}
+
+		// Set pos to the beginning of the Index.
+		pos -= index_size;
+
+		if (!parseIndex(file, filestate, pos, index_size, IndexRecord(), info, error)) goto failed;
+
+		// Decode the Stream Header and check that its Stream Flags
+		// match the Stream Footer.
+		if ((lzma_vli)(pos) < info.blocksSize + LZMA_STREAM_HEADER_SIZE) {
+			error.assign("invalid archive - index large than available data");
+			goto failed;
+		}
+
+		StreamPos stream = { (int64_t) (pos - info.blocksSize), pos, (int64_t) index_size, info.records, info.uncompressedSize, footer_flags.check };
+		streams.push_back(stream);
+		records += info.records;
+
+		pos = stream.blocksStart - LZMA_STREAM_HEADER_SIZE;
+		if (!file->readInto(filestate, pos, LZMA_STREAM_HEADER_SIZE, buf.u8, error)) goto failed;
+
+		ret = lzma_stream_header_decode(&header_flags, buf.u8);
+		if (ret != LZMA_OK) {
+			errnoLzmaToStr("invalid header", ret, error);
+			goto failed;
+		}
+
+		ret = lzma_stream_flags_compare(&header_flags, &footer_flags);
+		if (ret != LZMA_OK) {
+			errnoLzmaToStr("invalid stream: footer doesn't match header", ret, error);
+			goto failed;
+		}
+	} while (pos > 0);
+
+	// Two packed arrays with 32-bit entries (and a 64-bit base for each 64 entries);
+	// the uncompressed offsets are dropped later if the blocks are uniform.
+	if (records > (memlimit / 9)) {
+		error.assign("mem limit hit: too many blocks");
+		goto failed;
+	}
+
+	table = new XZBlockTable();
+
+	if (lazy) {
+		// Only remember where the streams are; their blocks are loaded in streamBlocks().
+		table->m_lazy = true;
+		table->m_file = file;
+		for (std::vector<StreamPos>::reverse_iterator stream = streams.rbegin(); stream != streams.rend(); ++stream) {
+			if (0 == stream->records) continue;
+			if (stream->uncompressedSize > (lzma_vli) (std::numeric_limits<int64_t>::max() - uncompressedOffset)) {
+				error.assign("invalid archive - uncompressed size too large");
+				goto failed;
+			}
+			Stream entry = { table->m_blocks, stream->indexStart, stream->check, stream->records, stream->blocksStart, stream->indexSize, uncompressedOffset };
+			table->m_streams.push_back(entry);
+			table->m_blocks += stream->records;
+			uncompressedOffset += stream->uncompressedSize;
+		}
+		table->m_uncompressedSize = uncompressedOffset;
+		table->m_streams.shrink_to_fit();
+		table->m_streamBlocks.reset(new std::atomic<StreamBlocks*>[table->m_streams.size()]);
+		for (size_t i = 0; i < table->m_streams.size(); ++i) table->m_streamBlocks[i] = nullptr;
+
+		file->finish(filestate);
+		return table;
+	}
+
+	// Second pass: build the table, streams in file order. Reserve the exact size, so
+	// doubling the vectors doesn't hit the memory limit.
+	table->m_compressed.reserve(records);
+	table->m_uncompressed.reserve(records + 1);
+	for (std::vector<StreamPos>::reverse_iterator stream = streams.rbegin(); stream != streams.rend(); ++stream) {
+		IndexInfo info;
+		if (stream->records > 0) {
+			Stream entry = { table->blocks(), stream->indexStart, stream->check, stream->records, stream->blocksStart, stream->indexSize, uncompressedOffset };
+			table->m_streams.push_back(entry);
+		}
+
+		int64_t compressedOffset = stream->blocksStart;
+		bool success = parseIndex(file, filestate, stream->indexStart, stream->indexSize,
+			[&](lzma_vli unpaddedSize, lzma_vli uncompressedSize, std::string &recordError) {
+				if (uncompressedSize > (lzma_vli) (std::numeric_limits<int64_t>::max() - uncompressedOffset)) {
+					recordError.assign("invalid archive - uncompressed size too large");
+					return false;
+				}
+				table->m_compressed.push_back(compressedOffset | (unpaddedSize & 3));
+				table->m_uncompressed.push_back(uncompressedOffset);
+				++table->m_blocks;
+				compressedOffset += paddedSize(unpaddedSize);
+				uncompressedOffset += uncompressedSize;
+
+				if (lastSize >= 0 && lastSize != firstSize) uniform = false;
+				if (firstSize < 0) firstSize = uncompressedSize;
+				lastSize = uncompressedSize;
+				return true;
+			}, info, error);
+		if (!success) goto failed;
+
+		if (table->memoryUsage() > memlimit) {
+			error.assign("mem limit hit");
+			goto failed;
+		}
+	}
+	table->m_uncompressed.push_back(uncompressedOffset);
+	table->m_uncompressedSize = uncompressedOffset;
+
+	if (uniform && firstSize > 0 && lastSize <= firstSize) {
+		table->m_uniformSize = firstSize;
+		table->m_uncompressed.clear();
+	}
+	table->m_compressed.shrink_to_fit();
+	table->m_uncompressed.shrink_to_fit();
+	table->m_streams.shrink_to_fit();
+
+	file->finish(filestate);
+	return table;
+
+failed:
+	delete table;
+	file->finish(filestate);
+	return nullptr;
+}
+
+namespace {
+	/* stream entry in a sidecar index */
+	struct SidecarStream {
+		uint64_t firstBlock;
+		int64_t blocksEnd;
+		uint64_t check;
+	};
+}
+
+bool XZBlockTable::save(SidecarWriter &sidecar, std::string &error /* out */) const {
+	/* sidecars always store the complete table */
+	XZPackedOffsets lazyCompressed, lazyUncompressed;
+	const XZPackedOffsets *compressed = &m_compressed, *uncompressed = &m_uncompressed;
+	if (m_lazy) {
+		XZBlock block;
+		for (uint64_t number = 0; number < m_blocks; ++number) {
+			if (!get(number, block)) {
+				error.assign("couldn't load stream index");
+				return false;
+			}
+			lazyCompressed.push_back(block.compressedOffset | (block.unpaddedSize & 3));
+			lazyUncompressed.push_back(block.uncompressedOffset);
+		}
+		lazyUncompressed.push_back(m_uncompressedSize);
+		compressed = &lazyCompressed;
+		uncompressed = &lazyUncompressed;
+	}
+
+	sidecar.appendValue<int64_t>(m_uncompressedSize);
+	sidecar.appendValue<int64_t>(m_uniformSize);
+	sidecar.appendValue<uint64_t>(m_streams.size());
+	for (const Stream &stream : m_streams) {
+		SidecarStream entry = { stream.firstBlock, stream.blocksEnd, (uint64_t) stream.check };
+		sidecar.appendValue(entry);
+	}
+	compressed->save(sidecar);
+	uncompressed->save(sidecar);
+	return true;
+}
+
+XZBlockTable* XZBlockTable::load(File file, SidecarReader &sidecar, std::string &error /* out */) {
+	XZBlockTable *table = new XZBlockTable();
+	const SidecarStream *streams = nullptr;
+	uint64_t streamCount = 0;
+
+	if (!sidecar.takeValue(table->m_uncompressedSize)
+		|| !sidecar.takeValue(table->m_uniformSize)
+		|| !sidecar.takeValue(streamCount)
+		|| nullptr == (streams = sidecar.take<SidecarStream>(streamCount))
+		|| !table->m_compressed.load(sidecar)
+		|| !table->m_uncompressed.load(sidecar)) {
+		error.assign("truncated sidecar index");
+		delete table;
+		return nullptr;
+	}
+
+	uint64_t blocks = table->m_blocks = table->m_compressed.size();
+	bool valid = (table->m_uncompressedSize >= 0 && table->m_uniformSize >= 0)
+		&& (table->m_uncompressed.size() == ((table->m_uniformSize > 0) ? 0 : blocks + 1))
+		&& ((0 == blocks) == (0 == streamCount))
+		&& (0 == streamCount || 0 == streams[0].firstBlock);
+	for (uint64_t i = 0; valid && i < streamCount; ++i) {
+		valid = (streams[i].firstBlock < blocks) && (streams[i].check <= LZMA_CHECK_ID_MAX)
+			&& (0 == i || streams[i].firstBlock > streams[i-1].firstBlock);
+		if (valid) {
+			Stream stream = { streams[i].firstBlock, streams[i].blocksEnd, (lzma_check) streams[i].check };
+			table->m_streams.push_back(stream);
+		}
+	}
+
+	/* get() trusts the offsets: the blocks of each stream have to be ordered and end before
+	 * its index, and the streams (with at least an index and the footer) inside the archive */
+	int64_t archiveSize = file->filesize();
+	int64_t end = 0; /* end of the previous stream */
+	for (uint64_t i = 0; valid && i < streamCount; ++i) {
+		uint64_t last = (i + 1 < streamCount) ? streams[i+1].firstBlock : blocks;
+		int64_t offset = end + LZMA_STREAM_HEADER_SIZE;
+		for (uint64_t number = streams[i].firstBlock; valid && number < last; ++number) {
+			int64_t blockOffset = (int64_t) (table->m_compressed[number] & ~UINT64_C(3));
+			valid = (blockOffset >= offset);
+			offset = blockOffset + 1;
+		}
+		valid = valid && (streams[i].blocksEnd >= offset) && (streams[i].blocksEnd <= archiveSize - LZMA_STREAM_HEADER_SIZE);
+		end = streams[i].blocksEnd + LZMA_STREAM_HEADER_SIZE;
+	}
+	if (valid && table->m_uniformSize > 0) {
+		int64_t size = table->m_uncompressedSize, uniform = table->m_uniformSize;
+		valid = (blocks == (uint64_t) (size / uniform + (0 != size % uniform ? 1 : 0)));
+	} else if (valid) {
+		valid = (0 == table->m_uncompressed[0]) && ((int64_t) table->m_uncompressed[blocks] == table->m_uncompressedSize);
+		for (uint64_t number = 0; valid && number < blocks; ++number) {
+			valid = (table->m_uncompressed[number] <= table->m_uncompressed[number + 1]);
+		}
+	}
+	if (!valid) {
+		error.assign("invalid sidecar index");
+		delete table;
+		return nullptr;
+	}
+
+	table->m_sidecar = sidecar.file();
+	return table;
+}
+
+XZBlockTable::StreamBlocks* XZBlockTable::streamBlocks(size_t streamNdx) const {
+	StreamBlocks *blocks = m_streamBlocks[streamNdx].load(std::memory_order_acquire);
+	if (nullptr != blocks) return blocks;
+
+	std::unique_lock<std::mutex> lock(m_loadMutex);
+	blocks = m_streamBlocks[streamNdx].load(std::memory_order_relaxed);
+	if (nullptr != blocks) return blocks;
+
+	/* the index was already verified when the file was opened */
+	const Stream &stream = m_streams[streamNdx];
+	blocks = new StreamBlocks();
+	blocks->compressed.reserve(stream.blocks);
+	blocks->uncompressed.reserve(stream.blocks + 1);
+	int64_t compressedOffset = stream.blocksStart, uncompressedOffset = 0;
+	FileReaderState *filestate = nullptr;
+	IndexInfo info;
+	std::string error;
+	bool success = parseIndex(m_file, filestate, stream.blocksEnd, stream.indexSize,
+		[&](lzma_vli unpaddedSize, lzma_vli uncompressedSize, std::string &) {
+			blocks->compressed.push_back(compressedOffset | (unpaddedSize & 3));
+			blocks->uncompressed.push_back(uncompressedOffset);
+			compressedOffset += paddedSize(unpaddedSize);
+			uncompressedOffset += uncompressedSize;
+			return true;
+		}, info, error);
+	m_file->finish(filestate);
+	if (!success || info.records != stream.blocks) {
+		delete blocks;
+		return nullptr;
+	}
+	blocks->uncompressed.push_back(uncompressedOffset);
+	blocks->compressed.shrink_to_fit();
+	blocks->uncompressed.shrink_to_fit();
+
+	m_streamBlocks[streamNdx].store(blocks, std::memory_order_release);
+	lock.unlock();
+
+	/* the index grew */
+	MemoryBudget::instance().update();
+	return blocks;
+}
+
+bool XZBlockTable::locate(int64_t offset, XZBlock &block /* out */) const {
+	if (offset < 0 || offset >= m_uncompressedSize) return false;
+
+	if (m_lazy) {
+		/* the stream containing offset, then the block in the stream */
+		size_t streamNdx = findLastMember(m_streams.data(), m_streams.size(), &Stream::uncompressedOffset, offset);
+		const StreamBlocks *blocks = streamBlocks(streamNdx);
+		if (nullptr == blocks) return false;
+		const Stream &stream = m_streams[streamNdx];
+		return get(stream.firstBlock + blocks->uncompressed.findLast(offset - stream.uncompressedOffset), block);
+	}
+
+	uint64_t number = (m_uniformSize > 0) ? (uint64_t) (offset / m_uniformSize) : m_uncompressed.findLast(offset);
+	return get(number, block);
+}
+
+bool XZBlockTable::get(uint64_t number, XZBlock &block /* out */) const {
+	if (number >= blocks()) return false;
+
+	/* streams are sorted by firstBlock; the block belongs to the last one starting before it */
+	size_t streamNdx = findLastMember(m_streams.data(), m_streams.size(), &Stream::firstBlock, number);
+	const Stream &stream = m_streams[streamNdx];
+	block.number = number;
+	block.check = stream.check;
+
+	uint64_t packed;
+	int64_t end;
+	if (m_lazy) {
+		const StreamBlocks *blocks = streamBlocks(streamNdx);
+		if (nullptr == blocks) return false;
+		uint64_t local = number - stream.firstBlock;
+		block.uncompressedOffset = stream.uncompressedOffset + blocks->uncompressed[local];
+		block.uncompressedSize = blocks->uncompressed[local + 1] - blocks->uncompressed[local];
+		packed = blocks->compressed[local];
+		end = (local + 1 == stream.blocks) ? stream.blocksEnd : (int64_t) (blocks->compressed[local + 1] & ~UINT64_C(3));
+	} else {
+		if (m_uniformSize > 0) {
+			block.uncompressedOffset = number * m_uniformSize;
+			block.uncompressedSize = std::min<int64_t>(m_uniformSize, m_uncompressedSize - block.uncompressedOffset);
+		} else {
+			block.uncompressedOffset = m_uncompressed[number];
+			block.uncompressedSize = m_uncompressed[number + 1] - block.uncompressedOffset;
+		}
+
+		bool lastInStream = (number + 1 == blocks())
+			|| (streamNdx + 1 < m_streams.size() && number + 1 == m_streams[streamNdx + 1].firstBlock);
+		packed = m_compressed[number];
+		end = lastInStream ? stream.blocksEnd : (int64_t) (m_compressed[number + 1] & ~UINT64_C(3));
+	}
+
+	block.compressedOffset = packed & ~UINT64_C(3);
+	block.totalSize = end - block.compressedOffset;
+	block.unpaddedSize = block.totalSize - ((4 - (packed & 3)) & 3);
+	return true;
+}
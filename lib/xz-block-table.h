@@ -0,0 +1,152 @@
+#ifndef __MY_XZ_BLOCK_TABLE_H
+#define __MY_XZ_BLOCK_TABLE_H __MY_XZ_BLOCK_TABLE_H
+
+#include "file.h"
+#include "sidecar-index.h"
+
+extern "C" {
+#include <lzma.h>
+}
+
+/**
+ * position of a block in an xz file (see XZBlockTable)
+ */
+struct XZBlock {
+	uint64_t number; /** index of the block in the file (0 based, across all streams) */
+	int64_t uncompressedOffset, uncompressedSize;
+	int64_t compressedOffset; /** file offset of the block header */
+	int64_t totalSize; /** compressed size, including header, padding and check */
+	lzma_vli unpaddedSize;
+	lzma_check check;
+};
+
+/**
+ * monotonic (non-decreasing) sequence of 64-bit values; stored as 32-bit differences to
+ * a 64-bit base for each group of values (falls back to plain 64-bit values if a difference
+ * gets too large).
+ *
+ * the values are either owned (built with push_back()) or point into a mapped sidecar index.
+ */
+class XZPackedOffsets {
+private:
+	enum { GROUP = 64 };
+
+	std::vector<uint64_t> m_bases;
+	std::vector<uint32_t> m_deltas;
+	std::vector<uint64_t> m_full; /** used instead of m_bases/m_deltas if m_isFull */
+	bool m_isFull;
+	size_t m_size;
+
+	/** data of the vectors above, or the arrays in a sidecar index */
+	const uint64_t *m_basesData;
+	const uint32_t *m_deltasData;
+	const uint64_t *m_fullData;
+
+	void updateData();
+
+public:
+	XZPackedOffsets() : m_isFull(false), m_size(0), m_basesData(nullptr), m_deltasData(nullptr), m_fullData(nullptr) { }
+
+	void push_back(uint64_t value);
+	/** room for size values without reallocating (unless they have to switch to plain values) */
+	void reserve(size_t size);
+	void clear();
+	void shrink_to_fit();
+
+	size_t size() const { return m_size; }
+	size_t memoryUsage() const;
+
+	uint64_t operator[](size_t i) const {
+		return m_isFull ? m_fullData[i] : m_basesData[i / GROUP] + m_deltasData[i];
+	}
+
+	/** index of the last value <= value; needs size() > 0 and (*this)[0] <= value */
+	size_t findLast(uint64_t value) const;
+
+	void save(SidecarWriter &sidecar) const;
+	/** use the arrays in the sidecar (not copied); false if the sidecar is too short */
+	bool load(SidecarReader &sidecar);
+};
+
+/**
+ * flat table of all blocks in an xz file (all streams), built from the stream indexes when
+ * the file is opened. replaces lzma_index, which needs up to four times the memory and a tree
+ * walk for each lookup.
+ *
+ * struct of arrays: per block the compressed offset (the low two bits of the always 4-byte aligned
+ * offsets store the low bits of the unpadded size) and the uncompressed offset; the latter is
+ * omitted if all blocks (but the last) have the same size, lookups are a division then.
+ * the check type and the end of the blocks are stored per stream.
+ *
+ * read only after loading (lazily loaded streams are protected by a mutex), so it can be shared by all threads.
+ */
+class XZBlockTable {
+private:
+	XZBlockTable(const XZBlockTable &);
+	XZBlockTable& operator=(const XZBlockTable &);
+
+	struct Stream {
+		uint64_t firstBlock;
+		int64_t blocksEnd; /** file offset of the stream index (end of the last block) */
+		lzma_check check;
+		/* only set when not loaded from a sidecar index */
+		uint64_t blocks;
+		int64_t blocksStart, indexSize;
+		int64_t uncompressedOffset;
+	};
+
+	/** blocks of a stream in lazy mode, loaded on the first access */
+	struct StreamBlocks {
+		XZPackedOffsets compressed; /** per block: offset | (unpadded size & 3) */
+		XZPackedOffsets uncompressed; /** per block + end of stream, relative to the stream */
+	};
+
+	uint64_t m_blocks;
+	XZPackedOffsets m_compressed; /** per block: offset | (unpadded size & 3); empty if m_lazy */
+	XZPackedOffsets m_uncompressed; /** per block + end of file; empty if m_uniformSize > 0 or m_lazy */
+	int64_t m_uniformSize;
+	int64_t m_uncompressedSize;
+	std::vector<Stream> m_streams; /** streams without blocks are dropped */
+	File m_sidecar; /** mapped sidecar index the offsets point into (if loaded from one) */
+
+	bool m_lazy;
+	File m_file; /** lazy: the stream indexes are read from it */
+	std::unique_ptr<std::atomic<StreamBlocks*>[]> m_streamBlocks; /** lazy: per stream, nullptr until loaded */
+	mutable std::mutex m_loadMutex;
+
+	XZBlockTable();
+
+	/** lazy: blocks of the stream (loaded if needed); nullptr if reading the stream index failed */
+	StreamBlocks* streamBlocks(size_t streamNdx) const;
+
+public:
+	/**
+	 * read the indexes of all streams; returns nullptr if this fails or the table would need more than memlimit bytes.
+	 * if lazy the indexes are only verified (the stream boundaries are only known after reading them), and the
+	 * blocks of a stream are loaded the first time it is accessed.
+	 */
+	static XZBlockTable* load(File file, uint64_t memlimit, bool lazy, std::string &error /* out */);
+	/**
+	 * use the table stored in an (already validated) sidecar index of file; doesn't copy the offsets.
+	 * the table is checked to be ordered and to end inside file, as the offsets are used unchecked later
+	 */
+	static XZBlockTable* load(File file, SidecarReader &sidecar, std::string &error /* out */);
+	/** loads all streams in lazy mode */
+	bool save(SidecarWriter &sidecar, std::string &error /* out */) const;
+	~XZBlockTable();
+
+	uint64_t blocks() const { return m_blocks; }
+	int64_t uncompressedSize() const { return m_uncompressedSize; }
+	/** size of all blocks if they have the same size (but the last one), otherwise 0 */
+	int64_t uniformBlockSize() const { return m_uniformSize; }
+	size_t memoryUsage() const;
+
+	/** find the block containing the uncompressed offset; false if offset is out of range (or loading the stream failed) */
+	bool locate(int64_t offset, XZBlock &block /* out */) const;
+	/** block by number; false if number >= blocks() */
+	bool get(uint64_t number, XZBlock &block /* out */) const;
+	/** replace block with the following block; false at the end of the file */
+	bool next(XZBlock &block /* in+out */) const { return get(block.number + 1, block); }
+};
+
+#endif
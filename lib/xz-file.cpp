@@ -1,5 +1,10 @@
 #include "xz-file.h"
 
+#include "block-cache.h"
+#include "decoder-arena.h"
+#include "memory-budget.h"
+#include "readahead.h"
+
 #include <sstream>
 #include <string.h>
 
@@ -21,6 +26,17 @@
 # define LOG_VERBOSE(...) do { } while(0)
 #endif
 
+/* blocks up to this size are decoded completely and kept in the state, even if the cache doesn't take them */
+#define MAX_PINNED_BLOCK_SIZE (4*1024*1024)
+/* maximum size read() returns at once for blocks too large to keep them completely */
+#define MAX_READ_WINDOW (4*1024*1024)
+/* readInto() requests of at least this size are split at block boundaries and decoded in parallel */
+#define PARALLEL_READ_MIN_LENGTH (4*1024*1024)
+/* (minimum) size of the pieces of a parallel read */
+#define PARALLEL_READ_PIECE (2*1024*1024)
+/* maximum memory for the block table of a file (without a MemoryBudget limit) */
+#define XZ_INDEX_MEMLIMIT (16*1024*1024)
+
 static void errnoLzmaToStr(const char *prefix, lzma_ret res, std::string &error) {
 	std::ostringstream s;
 	s << prefix << ": ";
@@ -68,6 +84,19 @@ static void errnoLzmaToStr(const char *prefix, lzma_ret res, std::string &error)
 	error.assign(s.str());
 }
 
+/* lzma memory comes from the DecoderArena; opaque points to the byte counter of the state */
+static void* arenaLzmaAlloc(void *opaque, size_t nmemb, size_t size) {
+	void *ptr = DecoderArena::instance().allocate(nmemb * size);
+	if (nullptr != ptr) *static_cast<size_t*>(opaque) += nmemb * size;
+	MemoryBudget::instance().decodersChanged();
+	return ptr;
+}
+
+static void arenaLzmaFree(void *opaque, void *ptr) {
+	*static_cast<size_t*>(opaque) -= DecoderArena::allocationSize(ptr);
+	DecoderArena::instance().release(ptr);
+}
+
 
 class XZFileReaderState : public FileReaderState {
 public:
@@ -76,13 +105,18 @@ public:
 	/* if position >= 0 the folling data is "active" */
 	/* decoder for current block */
 	lzma_stream strm;
+	/* arena hooks for strm, counting the decoder memory in decoderBytes */
+	lzma_allocator allocator;
+	size_t decoderBytes;
 	/* current block (checksums, flags, filters, ...) */
 	lzma_block block;
 	/* block needs a reference to this list of filters (why on earth do you have to setup this manually? -.-)
 	 * also these filters have pointers that needs to be free()d with clearFilters() */
 	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	/* block table of the file (owned by XZFile) */
+	const XZBlockTable *index;
 	/* current block offset and size (uncompressed, compressed) */
-	lzma_index_iter iter;
+	XZBlock iter;
 
 	unsigned char *currentBuffer;
 	size_t currentBufferSize;
@@ -91,10 +125,66 @@ public:
 
 	FileReader reader;
 
-	XZFileReaderState(File file, lzma_index *index)
-	: currentBuffer(nullptr), currentBufferSize(0), reader(file) {
+	/* last decodeFillBuffer() call reached the end of the block */
+	bool blockEnd;
+
+	/* block cache key of the file */
+	uint64_t cacheId;
+	/* block of the last cache lookup (if cacheIterValid), and its decoded data if it is cacheable
+	 * or small enough to keep it in the state ("private", not in the cache) */
+	XZBlock cacheIter;
+	bool cacheIterValid;
+	DecodedBlockPtr cachedBlock;
+	bool cachedBlockPrivate;
+	DecodedBlockPtr spareBlock; /* last private block, reused for the next one if the size matches */
+
+	/* buffer for read() with large blocks */
+	std::unique_ptr<unsigned char[]> window;
+	size_t windowSize;
+
+	/* decodes the following blocks in the background for sequential readers */
+	XZBlock readaheadIter;
+	Readahead readahead;
+
+	/* pool: the idle states of the file, also used for the readahead helpers */
+	XZFileReaderState(File file, const XZBlockTable *index, uint64_t cacheId, FileReaderStatePool *pool)
+	: index(index), currentBuffer(nullptr), currentBufferSize(0), reader(file), blockEnd(false), cacheId(cacheId), cacheIterValid(false), cachedBlockPrivate(false), windowSize(0),
+	  readahead(
+		[this](int64_t blockOffset, int64_t &nextOffset, size_t &nextSize) {
+			if (!this->index->locate(blockOffset, readaheadIter)) return false;
+			if (!this->index->next(readaheadIter)) return false;
+			nextOffset = readaheadIter.uncompressedOffset;
+			nextSize = readaheadIter.uncompressedSize;
+			return true;
+		},
+		[file, index, cacheId, pool]() -> FileReaderState* {
+			FileReaderState *helper = pool->acquire();
+			return (nullptr != helper) ? helper : new XZFileReaderState(file, index, cacheId, pool);
+		},
+		[index](FileReaderState *helper, int64_t blockOffset, unsigned char *buf, size_t size, std::string &error) {
+			XZBlock blockIter;
+			if (!index->locate(blockOffset, blockIter) || (size_t) blockIter.uncompressedSize != size) {
+				error.assign("couldn't find block in index");
+				return false;
+			}
+			return static_cast<XZFileReaderState*>(helper)->decodeBlock(blockIter, buf, error);
+		},
+		[pool](FileReaderState* &helper, bool success) {
+			if (success) {
+				pool->release(helper);
+			} else {
+				/* don't reuse states after errors */
+				delete static_cast<XZFileReaderState*>(helper);
+				helper = nullptr;
+			}
+		}) {
 		LOG_VERBOSE("XZFileReaderState\n");
 		memset(&strm, 0, sizeof(strm));
+		decoderBytes = 0;
+		allocator.alloc = arenaLzmaAlloc;
+		allocator.free = arenaLzmaFree;
+		allocator.opaque = &decoderBytes;
+		strm.allocator = &allocator;
 
 		for (int i = 0; i <= LZMA_FILTERS_MAX; ++i) {
 			filters[i].id = LZMA_VLI_UNKNOWN;
@@ -104,15 +194,14 @@ public:
 		block.filters = filters;
 		position = -1;
 		selectDefaultBuffer();
-
-		lzma_index_iter_init(&iter, index);
 	}
 
 	void clearFilters() {
 		LOG_VERBOSE("clearFilters\n");
 		// Free the memory allocated by lzma_block_header_decode().
 		for (int i = 0; (i < LZMA_FILTERS_MAX) && (filters[i].id != LZMA_VLI_UNKNOWN); ++i) {
-			free(filters[i].options);
+			arenaLzmaFree(&decoderBytes, filters[i].options);
+			filters[i].options = nullptr;
 			filters[i].id = LZMA_VLI_UNKNOWN;
 		}
 	}
@@ -134,6 +223,10 @@ public:
 		strm.avail_out = currentBufferSize;
 	}
 
+	virtual size_t memoryUsage() const {
+		return decoderBytes + windowSize + ((cachedBlockPrivate && cachedBlock) ? cachedBlock->size : 0) + (spareBlock ? spareBlock->size : 0);
+	}
+
 	~XZFileReaderState() {
 		LOG_VERBOSE("~XZFileReaderState\n");
 		clearFilters();
@@ -150,7 +243,9 @@ public:
 			const unsigned char *data;
 			ssize_t datasize;
 			LOG_VERBOSE("fill_input_buffer: reading at offset %i\n", (int) reader.offset());
-			if (!reader.read(4*1024, data, datasize)) {
+			/* the reader is limited to the current block: with a mapped file this
+			 * hands the complete compressed block to the decoder in one piece */
+			if (!reader.readBlock(data, datasize)) {
 				error.assign(reader.lastError());
 				return false;
 			}
@@ -173,7 +268,7 @@ public:
 		position = -1;
 
 		//LOG_VERBOSE("seeking to offset %i", (int) iter->block.compressed_file_offset);
-		reader.seek(iter.block.compressed_file_offset);
+		reader.seek(iter.compressedOffset, iter.totalSize);
 		strm.avail_in = 0; /* make sure we read new data after lseek */
 
 		if (!fill_input_buffer(error)) return false;
@@ -183,7 +278,7 @@ public:
 		}
 
 		block.version = 0;
-		block.check = iter.stream.flags->check;
+		block.check = iter.check;
 
 		block.header_size = lzma_block_header_size_decode(strm.next_in[0]);
 		if (block.header_size > strm.avail_in) {
@@ -192,13 +287,13 @@ public:
 		}
 
 		// Decode the Block Header.
-		lzma_ret ret = lzma_block_header_decode(&block, NULL, strm.next_in);
+		lzma_ret ret = lzma_block_header_decode(&block, &allocator, strm.next_in);
 		if (LZMA_OK != ret) {
 			errnoLzmaToStr("decoding block header failed", ret, error);
 			return false;
 		}
 
-		ret = lzma_block_compressed_size(&block, iter.block.unpadded_size);
+		ret = lzma_block_compressed_size(&block, iter.unpaddedSize);
 		if (LZMA_OK != ret) {
 			errnoLzmaToStr("decoding block header failed, invalid compressed size", ret, error);
 			return false;
@@ -207,22 +302,23 @@ public:
 		strm.next_in += block.header_size;
 		strm.avail_in -= block.header_size;
 
-		lzma_end(&strm);
+		/* no lzma_end(): initializing the block decoder again reuses the existing
+		 * decoder (and its dictionary if the size didn't change) */
 		ret = lzma_block_decoder(&strm, &block);
 		if (LZMA_OK != ret) {
 			errnoLzmaToStr("couldn't initialize block decoder", ret, error);
 			return false;
 		}
 
-		position = iter.block.uncompressed_file_offset;
+		position = iter.uncompressedOffset;
 		return true;
 	}
 
 	bool seekBlockFor(int64_t offset, std::string &error) {
 		bool matchingBlock =
 			(position >= 0
-			&& offset >= (int64_t)iter.block.uncompressed_file_offset
-			&& offset < (int64_t)(iter.block.uncompressed_file_offset + iter.block.uncompressed_size));
+			&& offset >= iter.uncompressedOffset
+			&& offset < iter.uncompressedOffset + iter.uncompressedSize);
 
 		if (matchingBlock && position <= offset) {
 			/* we already are in the needed block, and still before the requested data; just continue from here */
@@ -235,7 +331,7 @@ public:
 				LOG_VERBOSE("searching for offset: %i (current position: %i)\n", (int) offset, (int) position);
 
 				position = -1;
-				if (lzma_index_iter_locate(&iter, offset)) {
+				if (!index->locate(offset, iter)) {
 					error.assign("couldn't find offset in index");
 					return false;
 				}
@@ -272,7 +368,7 @@ public:
 
 			if (LZMA_STREAM_END == ret && pos == strm.next_out) {
 				/* end of stream AND we didn't get new data this round */
-				if (lzma_index_iter_next(&iter, LZMA_INDEX_ITER_ANY)) {
+				if (!index->next(iter)) {
 					error.assign("Unexepected end of file");
 					return false;
 				}
@@ -285,6 +381,7 @@ public:
 	}
 
 	bool decodeFillBuffer(std::string &error) {
+		blockEnd = false;
 		for (;0 != strm.avail_out;) {
 			LOG_VERBOSE("decodeFillBuffer: %i bytes to go\n", (int) strm.avail_out);
 
@@ -301,41 +398,293 @@ public:
 				return false;
 			}
 
-			if (0 == strm.avail_out) return true; // done filling buffer
+			if (0 == strm.avail_out) {
+				// done filling buffer
+				blockEnd = (LZMA_STREAM_END == ret);
+				return true;
+			}
 
 			if (LZMA_STREAM_END == ret) {
-				if (lzma_index_iter_next(&iter, LZMA_INDEX_ITER_ANY)) {
+				if (!index->next(iter)) {
 					error.assign("Unexepected end of file");
 					return false;
 				}
 				/* restart decoder */
 				if (!loadBlock(error)) return false;
+				/* the output buffer still contains data from the previous block */
+				position -= availableBytes();
 			}
 		}
 		return true;
 	}
+
+	/* decoder produced exactly the block data; let it consume padding and check */
+	bool finishBlock(std::string &error) {
+		if (blockEnd) return true; /* decoder already finished the block while filling the output */
+
+		/* need some output space, or the decoder wouldn't look for the end of the block */
+		unsigned char spare;
+		strm.next_out = &spare;
+		strm.avail_out = 1;
+
+		for (;;) {
+			if (!fill_input_buffer(error)) return false;
+
+			if (0 == strm.avail_in) {
+				error.assign("Unexpected end of file");
+				return false;
+			}
+
+			lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+			if (LZMA_OK != ret && LZMA_STREAM_END != ret) {
+				errnoLzmaToStr("failed decoding data", ret, error);
+				return false;
+			}
+
+			if (0 == strm.avail_out) {
+				error.assign("block larger than announced in index");
+				return false;
+			}
+
+			if (LZMA_STREAM_END == ret) return true;
+		}
+	}
+
+	/* decode the complete block blockIter into buf (needs blockIter.uncompressedSize bytes) */
+	bool decodeBlock(const XZBlock &blockIter, unsigned char *buf, std::string &error) {
+		discard_output();
+		iter = blockIter;
+		if (!loadBlock(error)) return false;
+
+		selectBuffer(buf, blockIter.uncompressedSize);
+		if (!decodeFillBuffer(error) || !finishBlock(error)) {
+			position = -1;
+			selectDefaultBuffer();
+			return false;
+		}
+
+		/* don't keep the pointer to buf (without discard_output(): buf is full, not part of the default buffer) */
+		currentBuffer = defaultOutputBuffer;
+		currentBufferSize = sizeof(defaultOutputBuffer);
+		strm.next_out = currentBuffer;
+		strm.avail_out = currentBufferSize;
+		position = blockIter.uncompressedOffset + blockIter.uncompressedSize;
+		return true;
+	}
+
+	/* point cacheIter to the block containing offset (drops cachedBlock if it is another block) */
+	bool locateCacheBlock(int64_t offset, std::string &error) {
+		if (cacheIterValid
+			&& offset >= cacheIter.uncompressedOffset
+			&& offset < cacheIter.uncompressedOffset + cacheIter.uncompressedSize) {
+			return true;
+		}
+
+		releaseCachedBlock();
+		cacheIterValid = false;
+		if (!index->locate(offset, cacheIter)) {
+			error.assign("couldn't find offset in index");
+			return false;
+		}
+		cacheIterValid = true;
+		return true;
+	}
+
+	void releaseCachedBlock() {
+		if (cachedBlockPrivate) spareBlock = cachedBlock;
+		cachedBlock.reset();
+		cachedBlockPrivate = false;
+	}
+
+	/**
+	 * set cachedBlock to the decoded block containing offset; if the block is not in the cache
+	 * and decodeMissing is set it is decoded (and inserted into the cache if it is cacheable).
+	 * cachedBlock is nullptr if the block is too large, or is missing (and decodeMissing isn't set)
+	 */
+	bool loadCachedBlock(int64_t offset, bool decodeMissing, std::string &error) {
+		if (!locateCacheBlock(offset, error)) return false;
+		if (cachedBlock) return true;
+
+		size_t size = cacheIter.uncompressedSize;
+		BlockCache &cache = BlockCache::instance();
+		bool cacheable = cache.cacheable(size);
+		if (!cacheable && (0 == size || size > MAX_PINNED_BLOCK_SIZE)) return true;
+
+		if (cacheable) cachedBlock = cache.lookup(cacheId, cacheIter.number);
+
+		int64_t blockOffset = cacheIter.uncompressedOffset;
+		if (!cachedBlock) {
+			if (!readahead.take(blockOffset, cachedBlock, error)) return false;
+			if (cachedBlock) {
+				if (cacheable) cache.insert(cacheId, cacheIter.number, cachedBlock);
+				cachedBlockPrivate = !cacheable;
+			}
+		}
+		/* only readers consuming (partial) blocks from the state, not complete readInto() ranges */
+		if (decodeMissing) readahead.access(blockOffset, size);
+
+		if (cachedBlock || !decodeMissing) return true;
+
+		DecodedBlockPtr block;
+		if (!cacheable && spareBlock && 1 == spareBlock.use_count() && spareBlock->size == size) {
+			block.swap(spareBlock);
+		} else {
+			block.reset(new DecodedBlock(size));
+		}
+		if (!decodeBlock(cacheIter, block->data, error)) return false;
+
+		if (cacheable) cache.insert(cacheId, cacheIter.number, block);
+		cachedBlock = block;
+		cachedBlockPrivate = !cacheable;
+		return true;
+	}
+
+	/* returns a buffer of at least size bytes for read() */
+	unsigned char* readWindow(size_t size) {
+		if (windowSize < size) {
+			window.reset(new unsigned char[size]);
+			windowSize = size;
+		}
+		return window.get();
+	}
+
+	/* read exactly length bytes at offset into data */
+	bool readInto(int64_t offset, ssize_t length, unsigned char *data, std::string &error) {
+		/* copy cached blocks and decode partially needed ones through the cache;
+		 * continue with the streaming decoder for the rest once a complete block is missing
+		 * (and for blocks too large for the cache) */
+		while (length > 0) {
+			if (!locateCacheBlock(offset, error)) return false;
+			int64_t inBlock = offset - cacheIter.uncompressedOffset;
+			int64_t blockSize = cacheIter.uncompressedSize;
+			bool complete = (0 == inBlock && length >= blockSize);
+
+			if (!loadCachedBlock(offset, !complete, error)) return false;
+			if (!cachedBlock) break;
+
+			ssize_t n = std::min<int64_t>(length, blockSize - inBlock);
+			memcpy(data, cachedBlock->data + inBlock, n);
+			offset += n;
+			data += n;
+			length -= n;
+		}
+		if (0 == length) return true;
+
+		selectDefaultBuffer(); // always reset buffer, readInto might have left an old pointer
+		if (!seekBlockFor(offset, error)) return false;
+
+		ssize_t skipInBlock = offset - (position + (int64_t) availableBytes());
+		LOG_VERBOSE("have to skip %i bytes (negative: overlap)\n", (int) skipInBlock);
+
+		if (skipInBlock > 0) {
+			// read exactly skipInBlock bytes into our defaultOutputBuffer
+			discard_output();
+
+			for (; skipInBlock > 0; ) {
+				if ((ssize_t) strm.avail_out > skipInBlock) {
+					selectBuffer(defaultOutputBuffer, skipInBlock);
+				}
+				if (!decodeFillBuffer(error)) return false;
+				skipInBlock -= availableBytes();
+				discard_output();
+			}
+
+			// now the real output starts
+			selectBuffer(data, length);
+		} else {
+			// copy the (possible empty) overlap we need
+			ssize_t overlap = -skipInBlock;
+
+			if (overlap >= length) {
+				/* everything already decoded */
+				memmove(data, strm.next_out - overlap, length);
+				return true;
+			}
+			memmove(data, strm.next_out - overlap, overlap);
+			selectBuffer(data + overlap, length - overlap);
+		}
+
+		if (!decodeFillBuffer(error)) return false;
+
+		return true;
+	}
 };
 
-static lzma_index* read_index(File file, uint64_t memlimit, std::string &error);
+/* split a read at block boundaries into pieces of about PARALLEL_READ_PIECE bytes */
+static bool splitParallelRead(const XZBlockTable *index, int64_t offset, ssize_t length, unsigned char *data, std::vector<ReadRequest> &pieces, std::string &error) {
+	XZBlock iter;
+	if (!index->locate(offset, iter)) {
+		error.assign("couldn't find offset in index");
+		return false;
+	}
 
-XZFile::XZFile(File file, std::string &error /* out */)
-: m_file(file), m_index(nullptr) {
-	m_index = read_index(file, 16*1024*1024, error);
+	int64_t end = offset + length;
+	int64_t pieceStart = offset;
+	for (;;) {
+		int64_t blockEnd = iter.uncompressedOffset + iter.uncompressedSize;
+		if (blockEnd >= end) break;
+		if (blockEnd - pieceStart >= PARALLEL_READ_PIECE) {
+			ReadRequest piece = { pieceStart, (ssize_t) (blockEnd - pieceStart), data + (pieceStart - offset) };
+			pieces.push_back(piece);
+			pieceStart = blockEnd;
+		}
+		/* end of file: the last piece fails in readInto() */
+		if (!index->next(iter)) break;
+	}
+	ReadRequest piece = { pieceStart, (ssize_t) (end - pieceStart), data + (pieceStart - offset) };
+	pieces.push_back(piece);
+	return true;
 }
 
-XZFile::~XZFile() {
-	if (nullptr != m_index) {
-		lzma_index_end(m_index, NULL);
-		m_index = nullptr;
+XZFile::XZFile(File file, std::string &error /* out */, int flags)
+: m_file(file), m_index(nullptr), m_cacheId(BlockCache::newFileId()), m_statePool(this, FileReaderStatePool::defaultMaxIdle()),
+  m_memory(m_cacheId, &m_statePool, [this]() { return m_index->memoryUsage(); }),
+  m_prefetcher([this](int64_t blockOffset, std::string &error) { return prefetchBlock(blockOffset, error); }) {
+	m_index = XZBlockTable::load(file, MemoryBudget::instance().indexLimit(XZ_INDEX_MEMLIMIT), 0 != (flags & LAZY_INDEX), error);
+	if (nullptr != m_index) m_memory.attach();
+}
+
+XZFile::XZFile(File file, const char *sidecarFilename, std::string &error /* out */, int flags)
+: m_file(file), m_index(nullptr), m_cacheId(BlockCache::newFileId()), m_statePool(this, FileReaderStatePool::defaultMaxIdle()),
+  m_memory(m_cacheId, &m_statePool, [this]() { return m_index->memoryUsage(); }),
+  m_prefetcher([this](int64_t blockOffset, std::string &error) { return prefetchBlock(blockOffset, error); }) {
+	SidecarReader sidecar;
+	std::string sidecarError;
+	if (sidecar.open(sidecarFilename, file, SIDECAR_XZ, sidecarError)) {
+		m_index = XZBlockTable::load(file, sidecar, sidecarError);
+	}
+	if (nullptr == m_index) {
+		LOG_VERBOSE("not using sidecar index: %s\n", sidecarError.c_str());
+		m_index = XZBlockTable::load(file, MemoryBudget::instance().indexLimit(XZ_INDEX_MEMLIMIT), 0 != (flags & LAZY_INDEX), error);
 	}
+	if (nullptr != m_index) m_memory.attach();
+}
+
+XZFile::~XZFile() {
+	m_prefetcher.cancel();
+	m_memory.detach();
+	m_statePool.clear();
+	BlockCache::instance().removeFile(m_cacheId);
+	delete m_index;
+	m_index = nullptr;
 }
 
 bool XZFile::valid() {
 	return (nullptr != m_index) && m_file;
 }
 
+bool XZFile::writeSidecar(const char *filename, std::string &error /* out */) {
+	if (!valid()) {
+		error.assign("Invalid file");
+		return false;
+	}
+	SidecarWriter sidecar;
+	if (!m_index->save(sidecar, error)) return false;
+	return sidecar.write(filename, m_file, SIDECAR_XZ, error);
+}
+
 int64_t XZFile::filesize() {
-	return (nullptr != m_index) ? lzma_index_uncompressed_size(m_index) : 0;
+	return (nullptr != m_index) ? m_index->uncompressedSize() : 0;
 }
 
 bool XZFile::read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */) {
@@ -346,12 +695,32 @@ bool XZFile::read(FileReaderState* &internalState, int64_t offset, ssize_t lengt
 
 	XZFileReaderState *state;
 	if (nullptr == internalState) {
-		internalState = state = new XZFileReaderState(m_file, m_index);
+		internalState = state = new XZFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
 	} else {
 		state = dynamic_cast<XZFileReaderState*>(internalState);
 		assert(nullptr != state);
 	}
 
+	/* return (the rest of) the complete decoded block if possible; the state keeps a reference to it */
+	if (!state->loadCachedBlock(offset, true, error)) return false;
+	if (state->cachedBlock) {
+		int64_t inBlock = offset - state->cacheIter.uncompressedOffset;
+		data = state->cachedBlock->data + inBlock;
+		datasize = std::min<int64_t>(length, state->cachedBlock->size - inBlock);
+		return true;
+	}
+
+	/* large block: decode the requested window (up to the end of the block) in one go */
+	if (length > (ssize_t) sizeof(state->defaultOutputBuffer)) {
+		int64_t end = state->cacheIter.uncompressedOffset + state->cacheIter.uncompressedSize;
+		ssize_t want = std::min<int64_t>(std::min<int64_t>(length, MAX_READ_WINDOW), end - offset);
+		unsigned char *buf = state->readWindow(want);
+		if (!state->readInto(offset, want, buf, error)) return false;
+		data = buf;
+		datasize = want;
+		return true;
+	}
+
 	state->selectDefaultBuffer(); // always reset buffer, readInto might have left an old pointer
 	if (!state->seekBlockFor(offset, error)) return false;
 
@@ -359,7 +728,7 @@ bool XZFile::read(FileReaderState* &internalState, int64_t offset, ssize_t lengt
 		ssize_t have = state->availableBytes();
 		if (state->position + have > offset) {
 			ssize_t overlap = (state->position + have - offset);
-			data = state->strm.next_out - have;
+			data = state->strm.next_out - overlap;
 			datasize = overlap;
 			return true;
 		}
@@ -379,43 +748,48 @@ bool XZFile::readInto(FileReaderState* &internalState, int64_t offset, ssize_t l
 
 	XZFileReaderState *state;
 	if (nullptr == internalState) {
-		internalState = state = new XZFileReaderState(m_file, m_index);
+		internalState = state = new XZFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
 	} else {
 		state = dynamic_cast<XZFileReaderState*>(internalState);
 		assert(nullptr != state);
 	}
 
-	state->selectDefaultBuffer(); // always reset buffer, readInto might have left an old pointer
-	if (!state->seekBlockFor(offset, error)) return false;
-
-	ssize_t skipInBlock = offset - state->position + state->availableBytes();
-	LOG_VERBOSE("have to skip %i bytes (negative: overlap)\n", (int) skipInBlock);
+	if (length >= PARALLEL_READ_MIN_LENGTH) {
+		/* blocks are independent: decode the pieces with pooled states on all cores */
+		std::vector<ReadRequest> pieces;
+		if (!splitParallelRead(m_index, offset, length, data, pieces, error)) return false;
+		if (pieces.size() > 1) return parallelPread(this, pieces, error);
+	}
 
-	if (skipInBlock > 0) {
-		// read exactly skipInBlock bytes into our defaultOutputBuffer
-		state->discard_output();
+	return state->readInto(offset, length, data, error);
+}
 
-		for (; skipInBlock > 0; ) {
-			if ((ssize_t) state->strm.avail_out > skipInBlock) {
-				state->selectBuffer(state->defaultOutputBuffer, skipInBlock);
-			}
-			if (!state->decodeFillBuffer(error)) return false;
-			skipInBlock -= state->availableBytes();
-			state->discard_output();
-		}
+bool XZFile::readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */) {
+	if (!valid()) {
+		error.assign("Invalid file");
+		return false;
+	}
 
-		// now the real output starts
-		state->selectBuffer(data, length);
+	XZFileReaderState *state;
+	if (nullptr == internalState) {
+		internalState = state = new XZFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
 	} else {
-		// copy the (possible empty) overlap we need
-		ssize_t overlap = -skipInBlock;
-
-		memmove(data, state->strm.next_in - overlap, overlap);
-		state->selectBuffer(data + overlap, length - overlap);
+		state = dynamic_cast<XZFileReaderState*>(internalState);
+		assert(nullptr != state);
 	}
 
-	if (!state->decodeFillBuffer(error)) return false;
+	/* sorted and without overlaps the decoder only moves forward, so each needed block is decoded once:
+	 * partially needed blocks are kept in the state (and the cache), and seekBlockFor() continues
+	 * in the current block for the next read */
+	std::vector<ReadRequest> reads;
+	std::vector<ReadCopy> copies;
+	planReadMany(requests, reads, copies);
 
+	for (const ReadRequest &req : reads) {
+		if (!state->readInto(req.offset, req.length, req.data, error)) return false;
+	}
+
+	finishReadCopies(copies);
 	return true;
 }
 
@@ -428,191 +802,72 @@ void XZFile::finish(FileReaderState* &internalState) {
 	}
 }
 
-/* adapted from official xz source: xz/src/xz/list.c */
-static lzma_index* read_index(File file, uint64_t memlimit, std::string &error) {
-	union {
-		unsigned char buf[4096];
-		unsigned char u8[LZMA_STREAM_HEADER_SIZE];
-		uint32_t u32[LZMA_STREAM_HEADER_SIZE/4];
-	} buf;
-
-	lzma_stream strm =  LZMA_STREAM_INIT;
-	lzma_index *cur_index = nullptr;
-	lzma_index *col_index = nullptr;
-	FileReaderState *filestate = nullptr;
-
-	lzma_stream_flags header_flags;
-	lzma_stream_flags footer_flags;
-	lzma_ret ret;
-
-	// Current position in the file. We parse the file backwards so
-	// initialize it to point to the end of the file.
-	int64_t pos = file->filesize();;
-
-	// Each loop iteration decodes one Index.
-	do {
-		lzma_vli stream_padding, index_size;
-		uint64_t memused;
-
-		// Check that there is enough data left to contain at least
-		// the Stream Header and Stream Footer. This check cannot
-		// fail in the first pass of this loop.
-		if (pos < 2 * LZMA_STREAM_HEADER_SIZE) {
-			error.assign("file too small for xz archive");
-			goto failed;
-		}
-
-		pos -= LZMA_STREAM_HEADER_SIZE;
-		stream_padding = 0;
-
-		// Locate the Stream Footer. There may be Stream Padding which
-		// we must skip when reading backwards.
-		for (;;) {
-			if (pos < LZMA_STREAM_HEADER_SIZE) {
-				error.assign("file too small for xz archive");
-				goto failed;
-			}
-
-			if (!file->readInto(filestate, pos, LZMA_STREAM_HEADER_SIZE, buf.buf, error)) goto failed;
-
-			/* padding must be a multiple of 4 */
-			if (buf.u32[2] != 0) break;
-			pos -= 4; stream_padding += 4;
-			if (buf.u32[1] != 0) break;
-			pos -= 4; stream_padding += 4;
-			if (buf.u32[0] != 0) break;
-			pos -= 4; stream_padding += 4;
-		}
-
-		// Decode the Stream Footer.
-		ret = lzma_stream_footer_decode(&footer_flags, buf.u8);
-		if (LZMA_OK != ret) {
-			errnoLzmaToStr("invalid footer", ret, error);
-			goto failed;
-		}
-
-		// Check that the size of the Index field looks sane.
-		index_size = footer_flags.backward_size;
-		if ((lzma_vli)(pos) < index_size + LZMA_STREAM_HEADER_SIZE) {
-			error.assign("invalid index size");
-			goto failed;
-		}
-
-		// Set pos to the beginning of the Index.
-		pos -= index_size;
-
-		// See how much memory we can use for decoding this Index.
-		memused = nullptr != col_index ? lzma_index_memused(col_index) : 0;
-		if (memused > memlimit) {
-			error.assign("mem limit hit");
-			goto failed;
-		}
-
-		// Decode the Index.
-		ret = lzma_index_decoder(&strm, &cur_index, memlimit - memused);
-		if (ret != LZMA_OK) {
-			errnoLzmaToStr("couldn't allocate new index", ret, error);
-			goto failed;
-		}
+/* don't keep blocks alive through idle states */
+static void releaseBlocks(FileReaderState *state) {
+	XZFileReaderState *xzstate = static_cast<XZFileReaderState*>(state);
+	xzstate->cachedBlock.reset();
+	xzstate->cachedBlockPrivate = false;
+	xzstate->spareBlock.reset();
+}
 
-		do {
-			ssize_t want = (index_size < sizeof(buf.buf) ? index_size : sizeof(buf.buf));
-			if (want < 0) { ret = LZMA_DATA_ERROR; break; }
-
-			if (!file->readInto(filestate, pos, want, buf.buf, error)) goto failed;
-
-			strm.avail_in = want;
-			strm.next_in = buf.buf;
-			pos += want;
-			index_size -= want;
-
-			ret = lzma_code(&strm, LZMA_RUN);
-		} while (ret == LZMA_OK);
-
-		// If the decoding seems to be successful, check also that
-		// the Index decoder consumed as much input as indicated
-		// by the Backward Size field.
-		if (ret == LZMA_STREAM_END)
-			if (index_size != 0 || strm.avail_in != 0)
-				ret = LZMA_DATA_ERROR;
-
-		if (ret != LZMA_STREAM_END) {
-			// LZMA_BUFFER_ERROR means that the Index decoder
-			// would have liked more input than what the Index
-			// size should be according to Stream Footer.
-			// The message for LZMA_DATA_ERROR makes more
-			// sense in that case.
-			if (ret == LZMA_BUF_ERROR)
-				ret = LZMA_DATA_ERROR;
-
-			errnoLzmaToStr("decoding index failed", ret, error);
-			goto failed;
-		}
+bool XZFile::pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */) {
+	return m_statePool.pread(offset, length, data, error, releaseBlocks);
+}
 
-		// Decode the Stream Header and check that its Stream Flags
-		// match the Stream Footer.
-		pos -= footer_flags.backward_size + LZMA_STREAM_HEADER_SIZE;
-		if ((lzma_vli)(pos) < lzma_index_total_size(cur_index)) {
-			error.assign("invalid archive - index large than available data");
-			goto failed;
-		}
+void XZFile::prefetch(int64_t offset, int64_t length, int flags) {
+	if (!valid() || offset < 0 || length <= 0 || offset >= filesize()) return;
+	int64_t end = offset + std::min(length, filesize() - offset);
 
-		pos -= lzma_index_total_size(cur_index);
-		if (!file->readInto(filestate, pos, LZMA_STREAM_HEADER_SIZE, buf.buf, error)) goto failed;
+	XZBlock block;
+	if (!m_index->locate(offset, block)) return;
 
-		ret = lzma_stream_header_decode(&header_flags, buf.u8);
-		if (ret != LZMA_OK) {
-			errnoLzmaToStr("invalid header", ret, error);
-			goto failed;
-		}
+	BlockCache &cache = BlockCache::instance();
+	bool decode = 0 != (flags & PREFETCH_DECODE);
+	/* don't prefetch more than fits into the cache, the first blocks would be evicted again */
+	size_t decodeBudget = cache.capacity() / 2;
+	std::vector<int64_t> decodeBlocks;
 
-		ret = lzma_stream_flags_compare(&header_flags, &footer_flags);
-		if (ret != LZMA_OK) {
-			errnoLzmaToStr("invalid stream: footer doesn't match header", ret, error);
-			goto failed;
-		}
-
-		// Store the decoded Stream Flags into this_index. This is
-		// needed so that we can print which Check is used in each
-		// Stream.
-		ret = lzma_index_stream_flags(cur_index, &footer_flags);
-		if (ret != LZMA_OK) {
-			errnoLzmaToStr("decoding stream flags failed", ret, error);
-			goto failed;
+	int64_t compressedStart = block.compressedOffset, compressedEnd;
+	for (;;) {
+		compressedEnd = block.compressedOffset + block.totalSize;
+		if (decode && cache.cacheable(block.uncompressedSize) && (size_t) block.uncompressedSize <= decodeBudget) {
+			decodeBudget -= block.uncompressedSize;
+			decodeBlocks.push_back(block.uncompressedOffset);
 		}
+		if (block.uncompressedOffset + block.uncompressedSize >= end || !m_index->next(block)) break;
+	}
 
-		// Store also the size of the Stream Padding field. It is
-		// needed to show the offsets of the Streams correctly.
-		ret = lzma_index_stream_padding(cur_index, stream_padding);
-		if (ret != LZMA_OK) {
-			errnoLzmaToStr("storing stream padding failed", ret, error);
-			goto failed;
-		}
+	/* the kernel starts reading before the decoders ask for the data */
+	m_file->prefetch(compressedStart, compressedEnd - compressedStart);
+	for (int64_t blockOffset : decodeBlocks) {
+		if (!m_prefetcher.schedule(blockOffset)) break;
+	}
+}
 
-		if (nullptr != col_index) {
-			// Append the earlier decoded Indexes
-			// after this_index.
-			ret = lzma_index_cat(cur_index, col_index, NULL);
-			col_index = nullptr;
-			if (ret != LZMA_OK) {
-				errnoLzmaToStr("failed to concatenate indexes", ret, error);
-				goto failed;
-			}
-		}
-		col_index = cur_index;
-		cur_index = nullptr;
-	} while (pos > 0);
+void XZFile::advise(int advice) {
+	if (m_file) m_file->advise(advice);
+}
 
-	lzma_end(&strm);
-	file->finish(filestate);
+bool XZFile::prefetchBlock(int64_t blockOffset, std::string &error /* out */) {
+	XZBlock block;
+	if (!m_index->locate(blockOffset, block)) {
+		error.assign("couldn't find offset in index");
+		return false;
+	}
 
-	return col_index;
+	BlockCache &cache = BlockCache::instance();
+	if (!cache.cacheable(block.uncompressedSize) || cache.lookup(m_cacheId, block.number)) return true;
 
-failed:
-	lzma_end(&strm);
-	if (nullptr != cur_index) lzma_index_end(cur_index, NULL);
-	if (nullptr != col_index) lzma_index_end(col_index, NULL);
-	file->finish(filestate);
+	FileReaderState *state = m_statePool.acquire();
+	if (nullptr == state) state = new XZFileReaderState(m_file, m_index, m_cacheId, &m_statePool);
+	DecodedBlockPtr data(new DecodedBlock(block.uncompressedSize));
+	if (!static_cast<XZFileReaderState*>(state)->decodeBlock(block, data->data, error)) {
+		/* don't reuse states after errors */
+		finish(state);
+		return false;
+	}
+	m_statePool.release(state);
 
-	return nullptr;
+	cache.insert(m_cacheId, block.number, data);
+	return true;
 }
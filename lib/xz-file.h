@@ -1,16 +1,18 @@
 #ifndef __MY_XZ_FILE_H
 #define __MY_XZ_FILE_H __MY_XZ_FILE_H
 
+#include "block-prefetch.h"
 #include "file.h"
-
-extern "C" {
-#include <lzma.h>
-}
+#include "memory-budget.h"
+#include "xz-block-table.h"
 
 /**
  * read xz/lzma files. they should be compressed with a sane block size,
  * otherwise random access will be terribly slow.
  * (use xz --block-size=64K or similar)
+ *
+ * decoded blocks small enough are kept in the process wide BlockCache
+ * (see block-cache.h), shared between all states and threads.
  */
 class XZFile : public IFile {
 private:
@@ -20,18 +22,49 @@ private:
 
 protected:
 	File m_file;
-	lzma_index *m_index;
+	XZBlockTable *m_index;
+	uint64_t m_cacheId; /** key for the process wide BlockCache */
+	FileReaderStatePool m_statePool; /** warm states for pread() */
+	MemoryAccount m_memory; /** registered with MemoryBudget::instance() while the file is valid */
+	BlockPrefetcher m_prefetcher; /** decodes blocks for prefetch() in the background */
+
+	/** decode the block at blockOffset into the BlockCache (if it is cacheable and not cached yet) */
+	bool prefetchBlock(int64_t blockOffset, std::string &error /* out */);
 
 public:
-	XZFile(File file, std::string &error /* out */);
+	enum Flags {
+		/**
+		 * only verify the stream indexes when opening, and build the block table of a stream
+		 * the first time it is read (for concatenations of many streams)
+		 */
+		LAZY_INDEX = 1,
+	};
+
+	XZFile(File file, std::string &error /* out */, int flags = 0);
+	/** use the block table from a sidecar index (see sidecar-index.h) if it matches the file, otherwise read the index from the file */
+	XZFile(File file, const char *sidecarFilename, std::string &error /* out */, int flags = 0);
 	virtual ~XZFile();
 
 	bool valid();
 
+	/** store the block table in a sidecar index for faster opening */
+	bool writeSidecar(const char *filename, std::string &error /* out */);
+
 	virtual int64_t filesize();
 	virtual bool read(FileReaderState* &internalState, int64_t offset, ssize_t length, const unsigned char* &data /* out */, ssize_t &datasize /* out */, std::string &error /* out */);
+	/** large reads are split at block boundaries and decoded in parallel (see parallelPread()) */
 	virtual bool readInto(FileReaderState* &internalState, int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+	virtual bool readMany(FileReaderState* &internalState, const std::vector<ReadRequest> &requests, std::string &error /* out */);
 	virtual void finish(FileReaderState* &internalState);
+	/** uses (and returns) idle states from statePool() */
+	virtual bool pread(int64_t offset, ssize_t length, unsigned char* data, std::string &error /* out */);
+	/** prefetches the compressed blocks covering the range from the underlying file; PREFETCH_DECODE decodes them into the BlockCache */
+	virtual void prefetch(int64_t offset, int64_t length, int flags = 0);
+	/** passed to the underlying file */
+	virtual void advise(int advice);
+
+	FileReaderStatePool& statePool() { return m_statePool; }
+	const MemoryAccount& memory() const { return m_memory; }
 };
 
 #endif
@@ -0,0 +1,58 @@
+/* ArchiveRegistry: sharing open archives, and not sharing them once the file changed */
+
+#include "test.h"
+
+#include "../lib/archive-registry.h"
+
+#include <lzma.h>
+
+#include <sys/stat.h>
+
+static std::vector<unsigned char> xzCompress(const std::vector<unsigned char> &data) {
+	std::vector<unsigned char> out(lzma_stream_buffer_bound(data.size()));
+	size_t outPos = 0;
+	if (LZMA_OK != lzma_easy_buffer_encode(1, LZMA_CHECK_CRC64, nullptr, data.data(), data.size(), out.data(), &outPos, out.size())) out.clear();
+	out.resize(outPos);
+	return out;
+}
+
+int main() {
+	std::vector<unsigned char> data = textData(300000, 1);
+	std::string path = testPath("archive.xz"), error;
+	writeTestFile(path, xzCompress(data));
+
+	ArchiveRegistry &registry = ArchiveRegistry::instance();
+	File first = registry.open(path.c_str(), error);
+	CHECK_OK(first, error);
+	CHECK(compareFile(first, data));
+	CHECK(first == registry.open(path.c_str(), error));
+	CHECK(1 == registry.openArchives());
+
+	/* rewrite it in place (same inode and size) with an mtime in the same second */
+	struct stat before, after;
+	CHECK(0 == stat(path.c_str(), &before));
+	struct timespec times[2];
+	times[0].tv_sec = times[1].tv_sec = before.st_mtime;
+	times[0].tv_nsec = 0;
+	times[1].tv_nsec = (NormalFile::statMtimeNsec(before) % 1000000000 + 1) % 1000000000;
+	CHECK(0 == utimensat(AT_FDCWD, path.c_str(), times, 0));
+	CHECK(0 == stat(path.c_str(), &after));
+	if (NormalFile::statMtimeNsec(after) != NormalFile::statMtimeNsec(before)) {
+		File second = registry.open(path.c_str(), error);
+		CHECK_OK(second, error);
+		CHECK(first != second);
+		CHECK(compareFile(second, data));
+		CHECK(2 == registry.openArchives());
+	} else {
+		fprintf(stderr, "no sub-second timestamps, skipping the modification check\n");
+	}
+
+	first.reset();
+	CHECK(registry.openArchives() <= 1);
+
+	/* missing files */
+	CHECK(!registry.open(testPath("missing.xz").c_str(), error));
+	CHECK(!error.empty());
+
+	return testResult();
+}
@@ -0,0 +1,145 @@
+/* AsyncReader: futures and callbacks, cancel() before and after start, priorities, destruction with queued requests */
+
+#include "test.h"
+
+#include "../lib/async-reader.h"
+#include "../lib/xz-file.h"
+
+#include <lzma.h>
+
+#include <memory>
+#include <thread>
+
+static std::vector<unsigned char> xzCompress(const std::vector<unsigned char> &data) {
+	std::vector<unsigned char> out(lzma_stream_buffer_bound(data.size()));
+	size_t outPos = 0;
+	if (LZMA_OK != lzma_easy_buffer_encode(1, LZMA_CHECK_CRC64, nullptr, data.data(), data.size(), out.data(), &outPos, out.size())) out.clear();
+	out.resize(outPos);
+	return out;
+}
+
+/* callback blocking the worker thread running it until released */
+struct Gate {
+	std::promise<void> entered, released;
+	std::shared_future<void> release;
+
+	Gate() : release(released.get_future().share()) { }
+
+	AsyncRead::Callback callback() {
+		return [this](bool, const std::string &) {
+			entered.set_value();
+			release.wait();
+		};
+	}
+};
+
+int main() {
+	std::vector<unsigned char> data = textData(2000000, 1);
+	std::vector<unsigned char> archive = xzCompress(data);
+	CHECK(!archive.empty());
+	std::string error;
+	File plain(new MemoryFile(archive.data(), archive.size()));
+	File file(new XZFile(plain, error));
+	CHECK_OK(file->filesize() == (int64_t) data.size(), error);
+
+	/* shared pool: futures, callbacks and failures */
+	{
+		AsyncReader reader(file);
+		std::vector<std::vector<unsigned char>> bufs(20, std::vector<unsigned char>(50000));
+		std::vector<AsyncReadPtr> requests;
+		std::mutex mutex;
+		int callbacks = 0;
+		for (size_t i = 0; i < bufs.size(); ++i) {
+			requests.push_back(reader.readAsync(i * 97531, bufs[i].size(), bufs[i].data(), 0, [&](bool success, const std::string &) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (success) ++callbacks;
+			}));
+		}
+		for (size_t i = 0; i < bufs.size(); ++i) {
+			CHECK(requests[i]->future().get());
+			CHECK(requests[i]->done() && requests[i]->success() && !requests[i]->cancelled());
+			CHECK(0 == memcmp(bufs[i].data(), data.data() + i * 97531, bufs[i].size()));
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		CHECK((int) bufs.size() == callbacks);
+
+		std::vector<unsigned char> buf(1000);
+		AsyncReadPtr failing = reader.readAsync(data.size() - 10, buf.size(), buf.data());
+		CHECK(!failing->wait());
+		CHECK(!failing->success() && !failing->cancelled() && !failing->error().empty());
+	}
+
+	/* own pool with one thread: cancel() and priorities, while the worker is blocked */
+	{
+		AsyncReader reader(file, 1);
+		Gate gate;
+		std::vector<unsigned char> first(1000), low(1000), high(1000), cancelled(1000, 0xaa);
+		AsyncReadPtr running = reader.readAsync(0, first.size(), first.data(), 0, gate.callback());
+		gate.entered.get_future().wait();
+
+		std::mutex mutex;
+		std::vector<int> order;
+		auto record = [&](int id) {
+			return [&mutex, &order, id](bool, const std::string &) {
+				std::lock_guard<std::mutex> lock(mutex);
+				order.push_back(id);
+			};
+		};
+		AsyncReadPtr r1 = reader.readAsync(100000, low.size(), low.data(), 0, record(1));
+		AsyncReadPtr r2 = reader.readAsync(200000, high.size(), high.data(), 5, record(2));
+		AsyncReadPtr r3 = reader.readAsync(300000, cancelled.size(), cancelled.data(), 0, record(3));
+
+		/* before start: completes at once (callback in this thread), the destination isn't touched */
+		CHECK(r3->cancel());
+		CHECK(r3->done() && r3->cancelled() && !r3->success() && !r3->error().empty());
+		CHECK(!r3->wait());
+		CHECK(std::vector<unsigned char>(cancelled.size(), 0xaa) == cancelled);
+		/* after start: too late */
+		CHECK(!running->cancel());
+		CHECK(!r3->cancel());
+
+		gate.released.set_value();
+		CHECK(running->wait() && r1->wait() && r2->wait());
+		CHECK(!running->cancelled());
+		CHECK(0 == memcmp(low.data(), data.data() + 100000, low.size()));
+		CHECK(0 == memcmp(high.data(), data.data() + 200000, high.size()));
+		std::lock_guard<std::mutex> lock(mutex);
+		CHECK((std::vector<int> { 3, 2, 1 }) == order);
+	}
+
+	/* destruction cancels queued requests and waits for the running one */
+	{
+		std::unique_ptr<AsyncReader> reader(new AsyncReader(file, 1));
+		Gate gate;
+		std::vector<unsigned char> first(1000);
+		std::vector<std::vector<unsigned char>> bufs(5, std::vector<unsigned char>(1000));
+		AsyncReadPtr running = reader->readAsync(0, first.size(), first.data(), 0, gate.callback());
+		gate.entered.get_future().wait();
+		std::vector<AsyncReadPtr> queued;
+		for (size_t i = 0; i < bufs.size(); ++i) queued.push_back(reader->readAsync(i * 1000, bufs[i].size(), bufs[i].data()));
+
+		std::thread destroy([&reader]() { reader.reset(); });
+		for (AsyncReadPtr &request : queued) {
+			CHECK(!request->wait());
+			CHECK(request->cancelled());
+		}
+		CHECK(!running->done());
+		gate.released.set_value();
+		destroy.join();
+		CHECK(running->done() && running->success());
+		CHECK(0 == memcmp(first.data(), data.data(), first.size()));
+	}
+
+	/* readers sharing the process wide pool can be destroyed with requests queued */
+	for (int round = 0; round < 20; ++round) {
+		std::vector<unsigned char> buf(200000);
+		std::vector<AsyncReadPtr> requests;
+		{
+			AsyncReader reader(file);
+			for (int i = 0; i < 10; ++i) requests.push_back(reader.readAsync(i * 150000, buf.size() / 10, buf.data() + i * (buf.size() / 10)));
+		}
+		for (AsyncReadPtr &request : requests) CHECK(request->done() && (request->success() || request->cancelled()));
+	}
+
+	return testResult();
+}
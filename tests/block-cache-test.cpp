@@ -0,0 +1,67 @@
+/* BlockCache: both tiers, eviction into the packed tier, removeFile() racing with packing */
+
+#include "test.h"
+
+#include "../lib/block-cache.h"
+
+static DecodedBlockPtr makeBlock(const std::vector<unsigned char> &data) {
+	DecodedBlockPtr block(new DecodedBlock(data.size()));
+	memcpy(block->data, data.data(), data.size());
+	return block;
+}
+
+static bool hasBlock(BlockCache &cache, uint64_t file, uint64_t number, const std::vector<unsigned char> &expected) {
+	DecodedBlockPtr block = cache.lookup(file, number);
+	return block && block->size == expected.size() && 0 == memcmp(block->data, expected.data(), expected.size());
+}
+
+int main() {
+	const size_t blockSize = 64 * 1024;
+	std::vector<std::vector<unsigned char>> blocks;
+	for (int i = 0; i < 64; ++i) blocks.push_back(textData(blockSize, i));
+
+	{
+		/* decoded tier only */
+		BlockCache cache(16 * blockSize * 4, 0);
+		for (size_t i = 0; i < 4; ++i) cache.insert(1, i, makeBlock(blocks[i]));
+		for (size_t i = 0; i < 4; ++i) CHECK(hasBlock(cache, 1, i, blocks[i]));
+		CHECK(!cache.lookup(1, 4));
+		CHECK(!cache.lookup(2, 0));
+		CHECK(cache.fileSize(1) == 4 * blockSize);
+		cache.removeFile(1);
+		CHECK(!cache.lookup(1, 0));
+		CHECK(0 == cache.size());
+	}
+
+	{
+		/* one block per shard: inserting more evicts into the packed tier */
+		BlockCache cache(16 * blockSize, 16 * 8 * blockSize);
+		for (size_t i = 0; i < blocks.size(); ++i) cache.insert(1, i, makeBlock(blocks[i]));
+		cache.waitForPacking();
+		CHECK(cache.packedSize() > 0);
+		CHECK(cache.packedSize() < cache.size());
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			CHECK(hasBlock(cache, 1, i, blocks[i]));
+			/* unpacking evicts another block, which is missing until it is packed */
+			cache.waitForPacking();
+		}
+
+		/* incompressible blocks are dropped */
+		std::vector<unsigned char> noise = randomData(blockSize, 100);
+		for (size_t i = 0; i < 64; ++i) cache.insert(2, i, makeBlock(noise));
+		cache.waitForPacking();
+		cache.clear();
+		CHECK(0 == cache.size());
+
+		/* blocks of removed files must not come back from pending pack tasks */
+		for (int round = 0; round < 50; ++round) {
+			for (size_t i = 0; i < blocks.size(); ++i) cache.insert(3 + round, i, makeBlock(blocks[i]));
+			cache.removeFile(3 + round);
+			cache.waitForPacking();
+			CHECK(0 == cache.fileSize(3 + round));
+		}
+		CHECK(0 == cache.size());
+	}
+
+	return testResult();
+}
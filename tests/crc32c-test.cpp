@@ -0,0 +1,50 @@
+/* Crc32c: known values (RFC 3720), pieces at any alignment against a bitwise reference */
+
+#include "test.h"
+
+#include "../lib/crc32c.h"
+
+static uint32_t reference(const unsigned char *data, size_t size) {
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < size; ++i) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+int main() {
+	const unsigned char check[] = "123456789";
+	CHECK(0xE3069283 == Crc32c::compute(check, 9));
+	CHECK(0 == Crc32c::compute(check, 0));
+
+	std::vector<unsigned char> bytes(32, 0);
+	CHECK(0x8A9136AA == Crc32c::compute(bytes.data(), bytes.size()));
+	bytes.assign(32, 0xff);
+	CHECK(0x62A8AB43 == Crc32c::compute(bytes.data(), bytes.size()));
+	for (size_t i = 0; i < 32; ++i) bytes[i] = (unsigned char) i;
+	CHECK(0x46DD794E == Crc32c::compute(bytes.data(), bytes.size()));
+
+	/* all alignments and short lengths (the accelerated paths work on 8 byte words) */
+	std::vector<unsigned char> data = randomData(100000, 1);
+	for (size_t offset = 0; offset < 16; ++offset) {
+		for (size_t size = 0; size < 80; ++size) {
+			CHECK(reference(data.data() + offset, size) == Crc32c::compute(data.data() + offset, size));
+		}
+	}
+
+	/* update() in pieces equals compute() at once */
+	uint32_t expected = reference(data.data(), data.size());
+	CHECK(expected == Crc32c::compute(data.data(), data.size()));
+	std::vector<unsigned char> pieces = randomData(1000, 2);
+	uint32_t crc = 0;
+	size_t pos = 0;
+	for (size_t i = 0; pos < data.size(); ++i) {
+		size_t size = std::min<size_t>(data.size() - pos, 1 + pieces[i % pieces.size()] * (1 + i % 7));
+		crc = Crc32c::update(crc, data.data() + pos, size);
+		pos += size;
+	}
+	CHECK(expected == crc);
+
+	return testResult();
+}
@@ -0,0 +1,269 @@
+/* IndexedDeflateWriter / IndexedDeflateFile round trips: v1, v2 (variable blocks, checksums, dictionary, block types), sidecars */
+
+#include "test.h"
+
+#include "../lib/block-cache.h"
+#include "../lib/idx-defl-file.h"
+#include "../lib/idx-defl-writer.h"
+#include "../lib/worker-pool.h"
+
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct Options {
+	Options() : version(IDXDEFL_VERSION_2), checksum(IDXDEFL_CHECKSUM_CRC32C), blockTypes(true), blockSize(IDXDEFL_DEFAULT_BLOCK_SIZE), piece(0), pool(nullptr) { }
+
+	int version, checksum;
+	bool blockTypes;
+	uint32_t blockSize;
+	std::vector<unsigned char> dictionary;
+	std::vector<size_t> ends; /** call endBlock() after writing up to these offsets (sorted) */
+	size_t piece; /** write() in pieces of this size (0: all at once) */
+	WorkerPool *pool;
+};
+
+static int archives = 0;
+
+/** write data into a new archive; returns its path (empty on errors) */
+static std::string writeArchive(const std::vector<unsigned char> &data, const Options &options) {
+	std::string path = testPath(("archive" + std::to_string(archives++) + ".idxdefl").c_str()), error;
+	IndexedDeflateWriter writer(path.c_str(), true, options.blockSize, IDXDEFL_DEFAULT_LEVEL, Z_DEFAULT_STRATEGY, error);
+	CHECK_OK(writer.valid(), error);
+	if (nullptr != options.pool) writer.setWorkerPool(options.pool);
+	if (IDXDEFL_VERSION_1 != options.version) {
+		CHECK_OK(writer.setFormat(options.version, options.checksum, error), error);
+		CHECK_OK(writer.setBlockTypes(options.blockTypes, error), error);
+	}
+	if (!options.dictionary.empty()) {
+		CHECK_OK(writer.setDictionary(options.dictionary.data(), options.dictionary.size(), error), error);
+	}
+
+	size_t pos = 0;
+	std::vector<size_t> ends(options.ends);
+	ends.push_back(data.size());
+	for (size_t end : ends) {
+		while (pos < end) {
+			size_t size = (0 == options.piece) ? end - pos : std::min(options.piece, end - pos);
+			if (!writer.write(data.data() + pos, size, error)) {
+				CHECK_OK(false, error);
+				return std::string();
+			}
+			pos += size;
+		}
+		if (end < data.size() || !options.ends.empty()) CHECK_OK(writer.endBlock(error), error);
+	}
+	if (!writer.finish(error)) {
+		CHECK_OK(false, error);
+		return std::string();
+	}
+	CHECK(writer.uncompressedSize() == (int64_t) data.size());
+	return path;
+}
+
+static std::shared_ptr<IndexedDeflateFile> openArchive(const std::string &path, const char *sidecar, std::string &error) {
+	File plain(new MMappedFile(path.c_str(), error));
+	if (nullptr == sidecar) return std::shared_ptr<IndexedDeflateFile>(new IndexedDeflateFile(plain, error));
+	return std::shared_ptr<IndexedDeflateFile>(new IndexedDeflateFile(plain, sidecar, error));
+}
+
+/** write, read back (with and without sidecar); returns the archive size (0 on errors) */
+static int64_t roundTrip(const std::vector<unsigned char> &data, const Options &options) {
+	std::string path = writeArchive(data, options), error;
+	if (path.empty()) return 0;
+
+	std::shared_ptr<IndexedDeflateFile> file = openArchive(path, nullptr, error);
+	CHECK_OK(file->valid(), error);
+	if (!file->valid()) return 0;
+	CHECK(compareFile(file, data));
+	CHECK(compareRandomReads(file, data, 300, 3 * options.blockSize));
+
+	std::string sidecar = path + ".sidx";
+	test_files.insert(test_files.end() - 1, sidecar);
+	CHECK_OK(file->writeSidecar(sidecar.c_str(), error), error);
+	file = openArchive(path, sidecar.c_str(), error);
+	CHECK_OK(file->valid(), error);
+	if (file->valid()) {
+		CHECK(compareFile(file, data));
+		CHECK(compareRandomReads(file, data, 100, 3 * options.blockSize));
+	}
+
+	return (int64_t) readTestFile(path).size();
+}
+
+int main() {
+	std::vector<unsigned char> text = textData(700000, 1);
+	Options v1, v2;
+	v1.version = IDXDEFL_VERSION_1;
+
+	/* sizes around the block size, empty archives */
+	for (size_t size : { (size_t) 0, (size_t) 1, (size_t) 65535, (size_t) 65536, (size_t) 65537, (size_t) 3 * 65536 }) {
+		std::vector<unsigned char> data(text.begin(), text.begin() + size);
+		CHECK(roundTrip(data, v1) > 0);
+		CHECK(roundTrip(data, v2) > 0);
+	}
+	CHECK(roundTrip(text, v1) > 0);
+
+	/* v2 without checksums and block types; large blocks (multi byte varints in the index) */
+	Options plain;
+	plain.checksum = IDXDEFL_CHECKSUM_NONE;
+	plain.blockTypes = false;
+	CHECK(roundTrip(text, plain) > 0);
+	plain.blockSize = 300000;
+	CHECK(roundTrip(text, plain) > 0);
+
+	/* variable blocks; endBlock() right before finish() must not add an empty block */
+	Options variable;
+	variable.ends = { 0, 1000, 1000, 1001, 70000, 200000, 200001, 699999, text.size() };
+	CHECK(roundTrip(text, variable) > 0);
+	variable.ends = { text.size() };
+	CHECK(roundTrip(text, variable) > 0);
+	variable.ends = { 65536 };
+	CHECK(roundTrip(std::vector<unsigned char>(text.begin(), text.begin() + 65536), variable) > 0);
+	{
+		std::string error;
+		std::string path = testPath("v1-end.idxdefl");
+		IndexedDeflateWriter writer(path.c_str(), true, 65536, IDXDEFL_DEFAULT_LEVEL, Z_DEFAULT_STRATEGY, error);
+		CHECK(!writer.endBlock(error)); /* v1 has fixed blocks */
+	}
+
+	/* the output doesn't depend on the number of threads or the size of the writes */
+	{
+		WorkerPool one(1), four(4);
+		Options a, b, c;
+		a.pool = &one;
+		b.pool = &four;
+		c.pool = &four;
+		c.piece = 777;
+		std::string pa = writeArchive(text, a), pb = writeArchive(text, b), pc = writeArchive(text, c);
+		std::vector<unsigned char> ra = readTestFile(pa);
+		CHECK(!ra.empty());
+		CHECK(ra == readTestFile(pb));
+		CHECK(ra == readTestFile(pc));
+	}
+
+	/* block types: zero, stored (incompressible) and reference (repeated) blocks */
+	{
+		std::vector<unsigned char> noise = randomData(4 * 65536, 2), data(8 * 65536, 0);
+		data.insert(data.end(), noise.begin(), noise.end());
+		data.insert(data.end(), text.begin(), text.begin() + 3 * 65536);
+		data.insert(data.end(), noise.begin(), noise.end());
+		data.insert(data.end(), text.begin(), text.begin() + 100);
+
+		Options typed, untyped;
+		untyped.blockTypes = false;
+		int64_t typedSize = roundTrip(data, typed), untypedSize = roundTrip(data, untyped);
+		CHECK(typedSize > 0 && untypedSize > 0);
+		/* the repeated noise is only stored once */
+		CHECK(typedSize + 3 * 65536 < untypedSize);
+		CHECK(typedSize < (int64_t) (noise.size() + 3 * 65536));
+
+		/* sidecars with invalid references are ignored (the archive index is used instead) */
+		std::string path = writeArchive(data, typed), sidecar = testPath("types.sidx"), error;
+		std::shared_ptr<IndexedDeflateFile> file = openArchive(path, nullptr, error);
+		CHECK_OK(file->writeSidecar(sidecar.c_str(), error), error);
+		std::vector<unsigned char> valid = readTestFile(sidecar);
+		/* the last section: (block, source) pairs of the 4 references (blocks 15..18 to 8..11) */
+		CHECK(valid.size() > 4 * 16);
+		for (int corruption = 0; corruption < 3 && valid.size() > 4 * 16; ++corruption) {
+			std::vector<unsigned char> corrupt(valid);
+			uint64_t *pairs = reinterpret_cast<uint64_t*>(corrupt.data() + corrupt.size() - 4 * 16);
+			CHECK(15 == pairs[0] && 8 == pairs[1] && 18 == pairs[6] && 11 == pairs[7]);
+			switch (corruption) {
+			case 0: pairs[7] = 18; break; /* not an earlier block */
+			case 1: pairs[7] = 15; break; /* a reference */
+			default: pairs[6] = 19; /* the last, shorter block */
+			}
+			writeTestFile(sidecar, corrupt);
+			file = openArchive(path, sidecar.c_str(), error);
+			CHECK_OK(file->valid(), error);
+			CHECK(compareFile(file, data));
+		}
+	}
+
+	/* repeated blocks are compared with the earlier block, read back from the output once it was written */
+	{
+		WorkerPool one(1);
+		std::vector<unsigned char> noise = randomData(65536, 4), data(text.begin(), text.begin() + 65536);
+		data.insert(data.end(), noise.begin(), noise.end());
+		data.insert(data.end(), text.begin() + 65536, text.begin() + 7 * 65536);
+		data.insert(data.end(), text.begin(), text.begin() + 65536);
+		data.insert(data.end(), noise.begin(), noise.end());
+
+		Options options;
+		options.pool = &one;
+		std::string path = writeArchive(data, options), error;
+		std::shared_ptr<IndexedDeflateFile> file = openArchive(path, nullptr, error);
+		CHECK_OK(file->valid(), error);
+		CHECK(compareFile(file, data));
+
+		/* write only descriptors can't be read back: only blocks still in memory are referenced */
+		std::string writeOnly = testPath("write-only.idxdefl");
+		int fd = open(writeOnly.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		CHECK(-1 != fd);
+		{
+			IndexedDeflateWriter writer(fd, IDXDEFL_DEFAULT_BLOCK_SIZE, IDXDEFL_DEFAULT_LEVEL, Z_DEFAULT_STRATEGY, error);
+			writer.setWorkerPool(&one);
+			CHECK_OK(writer.setFormat(IDXDEFL_VERSION_2, IDXDEFL_CHECKSUM_CRC32C, error), error);
+			CHECK_OK(writer.write(data.data(), data.size(), error), error);
+			CHECK_OK(writer.finish(error), error);
+		}
+		close(fd);
+		file = openArchive(writeOnly, nullptr, error);
+		CHECK_OK(file->valid(), error);
+		CHECK(compareFile(file, data));
+		/* the noise is stored twice */
+		CHECK(readTestFile(path).size() + noise.size() < readTestFile(writeOnly).size());
+	}
+
+	/* preset dictionary: small blocks compress better */
+	{
+		Options small, dict;
+		small.blockSize = dict.blockSize = 4096;
+		std::vector<unsigned char> samples = textData(64 * 4096, 3);
+		IndexedDeflateWriter::trainDictionary(samples.data(), samples.size(), 4096, IDXDEFL_MAX_DICTIONARY, dict.dictionary);
+		CHECK(!dict.dictionary.empty() && dict.dictionary.size() <= IDXDEFL_MAX_DICTIONARY);
+		int64_t plainSize = roundTrip(text, small), dictSize = roundTrip(text, dict);
+		CHECK(dictSize > 0 && dictSize < plainSize);
+
+		/* v1 has no dictionary, neither before nor after setting it */
+		std::string error;
+		IndexedDeflateWriter writer(testPath("v1-dict.idxdefl").c_str(), true, 4096, IDXDEFL_DEFAULT_LEVEL, Z_DEFAULT_STRATEGY, error);
+		CHECK(!writer.setDictionary(dict.dictionary.data(), dict.dictionary.size(), error));
+		CHECK_OK(writer.setFormat(IDXDEFL_VERSION_2, IDXDEFL_CHECKSUM_NONE, error), error);
+		CHECK_OK(writer.setDictionary(dict.dictionary.data(), dict.dictionary.size(), error), error);
+		CHECK(!writer.setFormat(IDXDEFL_VERSION_1, IDXDEFL_CHECKSUM_NONE, error));
+		CHECK_OK(writer.setDictionary(nullptr, 0, error), error);
+		CHECK_OK(writer.setFormat(IDXDEFL_VERSION_1, IDXDEFL_CHECKSUM_NONE, error), error);
+	}
+
+	/* idle states of pread() don't keep decoded blocks alive */
+	{
+		std::string path = writeArchive(text, v2), error;
+		std::shared_ptr<IndexedDeflateFile> file = openArchive(path, nullptr, error);
+		CHECK_OK(file->valid(), error);
+		std::vector<unsigned char> buf(1000);
+		CHECK_OK(file->pread(100000, buf.size(), buf.data(), error), error);
+		CHECK(0 == memcmp(buf.data(), text.data() + 100000, buf.size()));
+		/* blocks dropped from the cache would be private to the idle state now */
+		BlockCache::instance().clear();
+		CHECK(file->statePool().idleBytes() < IDXDEFL_DEFAULT_BLOCK_SIZE);
+	}
+
+	/* corrupted blocks are detected by the checksums */
+	{
+		std::string path = writeArchive(text, v2), error;
+		std::vector<unsigned char> archive = readTestFile(path);
+		archive[archive.size() / 3] ^= 0x10;
+		std::string corrupt = testPath("corrupt.idxdefl");
+		writeTestFile(corrupt, archive);
+		std::shared_ptr<IndexedDeflateFile> file = openArchive(corrupt, nullptr, error);
+		CHECK_OK(file->valid(), error);
+		std::vector<unsigned char> buf(text.size());
+		CHECK(!file->pread(0, buf.size(), buf.data(), error));
+	}
+
+	return testResult();
+}
@@ -0,0 +1,59 @@
+/* LZ4Codec: round trips for compressible, incompressible and short inputs; corrupted input */
+
+#include "test.h"
+
+#include "../lib/lz4-codec.h"
+
+static void roundTrip(const std::vector<unsigned char> &data) {
+	std::vector<unsigned char> packed(LZ4Codec::compressBound(data.size())), unpacked(data.size());
+	size_t packedSize = LZ4Codec::compress(data.data(), data.size(), packed.data(), packed.size());
+	CHECK(packedSize > 0);
+	CHECK(packedSize <= packed.size());
+	CHECK(LZ4Codec::decompress(packed.data(), packedSize, unpacked.data(), unpacked.size()));
+	CHECK(unpacked == data);
+
+	/* a wrong size is corruption */
+	std::vector<unsigned char> other(data.size() + 1);
+	CHECK(!LZ4Codec::decompress(packed.data(), packedSize, other.data(), other.size()));
+	if (!data.empty()) CHECK(!LZ4Codec::decompress(packed.data(), packedSize, other.data(), data.size() - 1));
+	/* so is a truncated input */
+	if (packedSize > 1) CHECK(!LZ4Codec::decompress(packed.data(), packedSize - 1, unpacked.data(), unpacked.size()));
+}
+
+int main() {
+	/* short inputs (the format has special rules for the last bytes) */
+	for (size_t size = 0; size <= 64; ++size) {
+		roundTrip(randomData(size, size));
+		roundTrip(std::vector<unsigned char>(size, 'a'));
+	}
+
+	std::vector<unsigned char> text = textData(1024 * 1024, 3);
+	roundTrip(text);
+	roundTrip(integerData(1024 * 1024, 3));
+	roundTrip(randomData(300000, 4));
+	roundTrip(std::vector<unsigned char>(1000000, 0));
+
+	/* mixed: long matches, literals and matches at large distances */
+	std::vector<unsigned char> mixed = randomData(100000, 5);
+	mixed.insert(mixed.end(), text.begin(), text.begin() + 200000);
+	mixed.insert(mixed.end(), mixed.begin(), mixed.begin() + 150000);
+	roundTrip(mixed);
+
+	/* compressible data has to compress; incompressible data fails with a smaller capacity */
+	std::vector<unsigned char> packed(LZ4Codec::compressBound(text.size()));
+	size_t packedSize = LZ4Codec::compress(text.data(), text.size(), packed.data(), packed.size());
+	CHECK(packedSize > 0 && packedSize < text.size() / 2);
+	CHECK(0 == LZ4Codec::compress(text.data(), text.size(), packed.data(), packedSize / 2));
+	std::vector<unsigned char> noise = randomData(100000, 6);
+	CHECK(0 == LZ4Codec::compress(noise.data(), noise.size(), packed.data(), noise.size() - noise.size() / 8));
+
+	/* corrupted match offsets must not read outside the output */
+	std::vector<unsigned char> unpacked(text.size());
+	std::vector<unsigned char> corrupt(packed.begin(), packed.begin() + packedSize);
+	for (size_t i = 0; i < corrupt.size(); i += 97) corrupt[i] ^= 0xff;
+	if (LZ4Codec::decompress(corrupt.data(), corrupt.size(), unpacked.data(), unpacked.size())) {
+		CHECK(unpacked != text);
+	}
+
+	return testResult();
+}
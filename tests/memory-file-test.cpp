@@ -0,0 +1,79 @@
+/* MemoryFile: archives read from memory (without a file system), bounds; ArchiveRegistry open flags */
+
+#include "test.h"
+
+#include "../lib/archive-registry.h"
+#include "../lib/xz-file.h"
+
+#include <lzma.h>
+
+#include <memory>
+
+static std::vector<unsigned char> xzCompress(const std::vector<unsigned char> &data) {
+	std::vector<unsigned char> out(lzma_stream_buffer_bound(data.size()));
+	size_t outPos = 0;
+	if (LZMA_OK != lzma_easy_buffer_encode(1, LZMA_CHECK_CRC64, nullptr, data.data(), data.size(), out.data(), &outPos, out.size())) out.clear();
+	out.resize(outPos);
+	return out;
+}
+
+int main() {
+	std::vector<unsigned char> data = textData(500000, 1);
+	std::vector<unsigned char> archive = xzCompress(data);
+	CHECK(!archive.empty());
+	std::string error;
+
+	/* caller owned memory */
+	{
+		File plain(new MemoryFile(archive.data(), archive.size()));
+		CHECK(plain->filesize() == (int64_t) archive.size());
+		CHECK(compareFile(plain, archive));
+		std::vector<unsigned char> buf(16);
+		CHECK(!plain->pread(archive.size() - 8, buf.size(), buf.data(), error));
+		CHECK(!plain->pread(-1, 1, buf.data(), error));
+		CHECK_OK(plain->pread(archive.size() - buf.size(), buf.size(), buf.data(), error), error);
+
+		std::shared_ptr<XZFile> file(new XZFile(plain, error));
+		CHECK_OK(file->valid(), error);
+		CHECK(compareFile(file, data));
+		CHECK(compareRandomReads(file, data, 300, 100000));
+	}
+
+	/* owned memory */
+	{
+		std::unique_ptr<unsigned char[]> copy(new unsigned char[archive.size()]);
+		memcpy(copy.get(), archive.data(), archive.size());
+		File plain(new MemoryFile(std::move(copy), archive.size()));
+		std::shared_ptr<XZFile> file(new XZFile(plain, error));
+		CHECK_OK(file->valid(), error);
+		CHECK(compareFile(file, data));
+	}
+
+	/* read from a file; missing files */
+	std::string path = testPath("memory.xz");
+	writeTestFile(path, archive);
+	{
+		std::shared_ptr<MemoryFile> plain(new MemoryFile(path.c_str(), error));
+		CHECK_OK(plain->valid(), error);
+		CHECK(compareFile(plain, archive));
+		std::shared_ptr<MemoryFile> missing(new MemoryFile(testPath("missing.xz").c_str(), error));
+		CHECK(!missing->valid());
+	}
+
+	/* the registry opens archives in memory (and mapped with flags) */
+	for (int flags : { (int) ArchiveRegistry::IN_MEMORY, (int) ArchiveRegistry::PRELOAD, (int) ArchiveRegistry::LOCK }) {
+		File file = ArchiveRegistry::instance().open(path.c_str(), error, flags);
+		CHECK_OK(file, error);
+		if (!file) continue;
+		CHECK(compareFile(file, data));
+		/* shared while open */
+		CHECK(file == ArchiveRegistry::instance().open(path.c_str(), error));
+	}
+	File file = ArchiveRegistry::openArchive(path.c_str(), error, ArchiveRegistry::IN_MEMORY);
+	CHECK_OK(file, error);
+	/* the archive is read completely: removing the file doesn't matter */
+	CHECK(0 == unlink(path.c_str()));
+	CHECK(compareFile(file, data));
+
+	return testResult();
+}
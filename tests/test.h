@@ -0,0 +1,191 @@
+#ifndef __MY_TEST_H
+#define __MY_TEST_H __MY_TEST_H
+
+/**
+ * minimal helpers for the test programs in tests/ (run with ctest): each test is a
+ * program whose main() returns testResult(); CHECK() reports failures and continues.
+ */
+
+#include "../lib/file.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++test_failures; \
+		} \
+	} while (0)
+
+/* like CHECK(), for calls reporting errors in a std::string */
+#define CHECK_OK(call, error) do { \
+		if (!(call)) { \
+			fprintf(stderr, "%s:%d: failed: %s: %s\n", __FILE__, __LINE__, #call, (error).c_str()); \
+			++test_failures; \
+		} \
+	} while (0)
+
+static std::vector<std::string> test_files; /* removed by testResult() */
+
+/** path of a file in a temporary directory for this test */
+static inline std::string testPath(const char *name) {
+	static std::string dir;
+	if (dir.empty()) {
+		char tmpl[] = "/tmp/xz-jni-test-XXXXXX";
+		if (nullptr == mkdtemp(tmpl)) {
+			perror("mkdtemp");
+			exit(1);
+		}
+		dir = tmpl;
+		test_files.push_back(dir);
+	}
+	std::string path = dir + "/" + name;
+	test_files.insert(test_files.end() - 1, path);
+	return path;
+}
+
+/** create (or replace) path with data */
+static inline void writeTestFile(const std::string &path, const std::vector<unsigned char> &data) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (nullptr == f || (!data.empty() && 1 != fwrite(data.data(), data.size(), 1, f)) || 0 != fclose(f)) {
+		perror(path.c_str());
+		exit(1);
+	}
+}
+
+static inline std::vector<unsigned char> readTestFile(const std::string &path) {
+	std::vector<unsigned char> data;
+	FILE *f = fopen(path.c_str(), "rb");
+	if (nullptr == f) return data;
+	unsigned char buf[65536];
+	size_t r;
+	while ((r = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + r);
+	fclose(f);
+	return data;
+}
+
+/** deterministic pseudo random bytes (xorshift) */
+static inline std::vector<unsigned char> randomData(size_t size, uint64_t seed) {
+	std::vector<unsigned char> data(size);
+	uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1;
+	for (size_t i = 0; i < size; ++i) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		data[i] = (unsigned char) (x >> 24);
+	}
+	return data;
+}
+
+/** big endian integer array with small random steps (like the arrays this library is used for) */
+static inline std::vector<unsigned char> integerData(size_t size, uint64_t seed) {
+	std::vector<unsigned char> steps = randomData(size / 4 + 1, seed), data(size);
+	uint32_t value = (uint32_t) seed;
+	for (size_t i = 0; i < size; ++i) {
+		if (0 == i % 4) value += steps[i / 4] & 7;
+		data[i] = (unsigned char) (value >> (24 - 8 * (i % 4)));
+	}
+	return data;
+}
+
+/** text from a small vocabulary (compresses well even with LZ4) */
+static inline std::vector<unsigned char> textData(size_t size, uint64_t seed) {
+	static const char *words[] = { "block", "index", "stream", "offset", "the", "of", "and", "a", "compressed",
+		"decoder", "cache", "reader", "file", "size", "to", "in", "is", "data", "map", "route" };
+	std::vector<unsigned char> choices = randomData(size / 2 + 1, seed), data;
+	data.reserve(size + 16);
+	for (size_t i = 0; data.size() < size; ++i) {
+		const char *word = words[choices[i] % (sizeof(words) / sizeof(words[0]))];
+		data.insert(data.end(), word, word + strlen(word));
+		data.push_back((0 == choices[i] % 13) ? '\n' : ' ');
+	}
+	data.resize(size);
+	return data;
+}
+
+/** read the complete file with readInto() and with read() (through a FileReader) and compare with expected */
+static inline bool compareFile(File file, const std::vector<unsigned char> &expected) {
+	if (!file || file->filesize() != (int64_t) expected.size()) return false;
+
+	std::string error;
+	std::vector<unsigned char> buf(expected.size());
+	if (!file->pread(0, buf.size(), buf.data(), error)) {
+		fprintf(stderr, "pread failed: %s\n", error.c_str());
+		return false;
+	}
+	if (buf != expected) return false;
+
+	FileReader reader(file);
+	size_t pos = 0;
+	for (;;) {
+		const unsigned char *data;
+		ssize_t datasize;
+		if (!reader.readBlock(data, datasize)) {
+			fprintf(stderr, "read failed: %s\n", reader.lastError().c_str());
+			return false;
+		}
+		if (0 == datasize) break;
+		if (pos + datasize > expected.size() || 0 != memcmp(data, expected.data() + pos, datasize)) return false;
+		pos += datasize;
+	}
+	return pos == expected.size();
+}
+
+/** random reads (up to maxLength bytes) with read(), readInto() and pread(), compared with expected */
+static inline bool compareRandomReads(File file, const std::vector<unsigned char> &expected, int count, size_t maxLength) {
+	if (expected.empty()) return true;
+	FileReader reader(file);
+	std::string error;
+	std::vector<unsigned char> buf;
+	uint64_t x = 12345;
+	for (int i = 0; i < count; ++i) {
+		x = x * 6364136223846793005ull + 1442695040888963407ull;
+		int64_t offset = (x >> 16) % expected.size();
+		ssize_t length = 1 + (ssize_t) ((x >> 40) % maxLength);
+		if (offset + length > (int64_t) expected.size()) length = expected.size() - offset;
+		buf.resize(length);
+
+		reader.seek(offset);
+		switch (i % 3) {
+		case 0:
+			if (!reader.readInto(buf.data(), length)) return false;
+			break;
+		case 1:
+			if (!file->pread(offset, length, buf.data(), error)) return false;
+			break;
+		default:
+			{
+				const unsigned char *data;
+				ssize_t datasize;
+				if (!reader.read(length, data, datasize) || datasize <= 0 || datasize > length) return false;
+				length = datasize;
+				memcpy(buf.data(), data, datasize);
+			}
+		}
+		if (0 != memcmp(buf.data(), expected.data() + offset, length)) return false;
+	}
+	return true;
+}
+
+static inline int testResult() {
+	for (const std::string &path : test_files) {
+		if (0 != unlink(path.c_str())) rmdir(path.c_str());
+	}
+	if (0 != test_failures) {
+		fprintf(stderr, "%i check(s) failed\n", test_failures);
+		return 1;
+	}
+	return 0;
+}
+
+#endif
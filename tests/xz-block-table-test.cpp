@@ -0,0 +1,261 @@
+/* XZBlockTable / XZFile: multi block, multi stream files; eager, lazy and sidecar block tables */
+
+#include "test.h"
+
+#include "../lib/sidecar-index.h"
+#include "../lib/xz-block-table.h"
+#include "../lib/xz-file.h"
+
+#include <lzma.h>
+
+#include <memory>
+
+/** compress data into a single xz stream with blocks of blockSize bytes */
+static std::vector<unsigned char> xzCompress(const unsigned char *data, size_t size, uint64_t blockSize, lzma_check check) {
+	lzma_mt mt;
+	memset(&mt, 0, sizeof(mt));
+	mt.threads = 2;
+	mt.block_size = blockSize;
+	mt.preset = 1;
+	mt.check = check;
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	std::vector<unsigned char> out;
+	if (LZMA_OK != lzma_stream_encoder_mt(&strm, &mt)) return out;
+
+	out.resize(lzma_stream_buffer_bound(size));
+	strm.next_in = data;
+	strm.avail_in = size;
+	strm.next_out = out.data();
+	strm.avail_out = out.size();
+	lzma_ret ret;
+	while (LZMA_OK == (ret = lzma_code(&strm, LZMA_FINISH))) { }
+	out.resize(LZMA_STREAM_END == ret ? out.size() - strm.avail_out : 0);
+	lzma_end(&strm);
+	return out;
+}
+
+/** a single stream of count copies of the same block of blockSize zero bytes (encoding that many blocks takes too long) */
+static std::vector<unsigned char> xzRepeatBlock(size_t blockSize, uint64_t count) {
+	std::vector<unsigned char> out, data(blockSize, 0);
+	lzma_options_lzma options;
+	lzma_lzma_preset(&options, 0);
+	lzma_filter filters[2] = { { LZMA_FILTER_LZMA2, &options }, { LZMA_VLI_UNKNOWN, nullptr } };
+	lzma_block block;
+	memset(&block, 0, sizeof(block));
+	block.check = LZMA_CHECK_NONE;
+	block.filters = filters;
+	std::vector<unsigned char> encoded(lzma_block_buffer_bound(blockSize));
+	size_t encodedSize = 0;
+	if (LZMA_OK != lzma_block_buffer_encode(&block, nullptr, data.data(), data.size(), encoded.data(), &encodedSize, encoded.size())) return out;
+
+	lzma_stream_flags flags;
+	memset(&flags, 0, sizeof(flags));
+	flags.check = LZMA_CHECK_NONE;
+	lzma_index *index = lzma_index_init(nullptr);
+	out.resize(LZMA_STREAM_HEADER_SIZE);
+	bool success = (nullptr != index) && LZMA_OK == lzma_stream_header_encode(&flags, out.data());
+	out.reserve(LZMA_STREAM_HEADER_SIZE + count * encodedSize);
+	for (uint64_t i = 0; success && i < count; ++i) {
+		out.insert(out.end(), encoded.begin(), encoded.begin() + encodedSize);
+		success = LZMA_OK == lzma_index_append(index, nullptr, lzma_block_unpadded_size(&block), blockSize);
+	}
+
+	size_t pos = out.size();
+	if (success) {
+		out.resize(pos + lzma_index_size(index) + LZMA_STREAM_HEADER_SIZE);
+		flags.backward_size = lzma_index_size(index);
+		success = LZMA_OK == lzma_index_buffer_encode(index, out.data(), &pos, out.size())
+			&& LZMA_OK == lzma_stream_footer_encode(&flags, out.data() + pos);
+	}
+	lzma_index_end(index, nullptr);
+	if (!success) out.clear();
+	return out;
+}
+
+/** blocks must be contiguous, cover the file and be found by locate() */
+static void checkTable(const XZBlockTable &table, const std::vector<unsigned char> &archive, int64_t size, uint64_t blocks) {
+	CHECK(table.uncompressedSize() == size);
+	CHECK(table.blocks() == blocks);
+
+	XZBlock block;
+	int64_t offset = 0, compressedOffset = 0;
+	for (uint64_t i = 0; i < table.blocks(); ++i) {
+		if (!table.get(i, block)) {
+			CHECK(!"get() failed");
+			return;
+		}
+		CHECK(block.number == i);
+		CHECK(block.uncompressedOffset == offset);
+		CHECK(block.uncompressedSize > 0);
+		CHECK(block.compressedOffset > compressedOffset);
+		CHECK(block.compressedOffset + block.totalSize <= (int64_t) archive.size());
+		/* the block header size byte */
+		CHECK(0 != archive[block.compressedOffset]);
+
+		XZBlock found;
+		CHECK(table.locate(block.uncompressedOffset + block.uncompressedSize - 1, found));
+		CHECK(found.number == i);
+		CHECK(found.compressedOffset == block.compressedOffset);
+
+		offset += block.uncompressedSize;
+		compressedOffset = block.compressedOffset;
+	}
+	CHECK(offset == size);
+	CHECK(!table.get(table.blocks(), block));
+	CHECK(!table.locate(size, block));
+
+	if (table.get(0, block)) {
+		uint64_t count = 1;
+		while (table.next(block)) ++count;
+		CHECK(count == table.blocks());
+	}
+}
+
+enum Corruption { NONE, COMPRESSED_ORDER, UNCOMPRESSED_ORDER, UNCOMPRESSED_END, BLOCKS_END };
+
+/** write a sidecar for the single stream table (in the layout of XZBlockTable::save()) with one corruption and load it */
+static bool loadCorrupted(File plain, const XZBlockTable &table, const std::string &path, Corruption corruption) {
+	XZPackedOffsets compressed, uncompressed;
+	XZBlock block;
+	uint64_t previous = 0;
+	for (uint64_t i = 0; table.get(i, block); ++i) {
+		uint64_t offset = block.compressedOffset | (block.unpaddedSize & 3);
+		if (COMPRESSED_ORDER == corruption && 5 == i) offset = previous;
+		compressed.push_back(previous = offset);
+		uncompressed.push_back(block.uncompressedOffset + ((UNCOMPRESSED_ORDER == corruption && 7 == i) ? 2 * block.uncompressedSize : 0));
+	}
+	uncompressed.push_back(table.uncompressedSize() + ((UNCOMPRESSED_END == corruption) ? 1 : 0));
+
+	std::string error;
+	SidecarWriter writer;
+	writer.appendValue<int64_t>(table.uncompressedSize());
+	writer.appendValue<int64_t>(0); /* not uniform */
+	writer.appendValue<uint64_t>(1); /* streams */
+	writer.appendValue<uint64_t>(0); /* first block */
+	writer.appendValue<int64_t>(block.compressedOffset + block.totalSize + ((BLOCKS_END == corruption) ? 100000 : 0));
+	writer.appendValue<uint64_t>(LZMA_CHECK_CRC64);
+	compressed.save(writer);
+	uncompressed.save(writer);
+	CHECK_OK(writer.write(path.c_str(), plain, SIDECAR_XZ, error), error);
+
+	SidecarReader reader;
+	CHECK_OK(reader.open(path.c_str(), plain, SIDECAR_XZ, error), error);
+	std::unique_ptr<XZBlockTable> loaded(XZBlockTable::load(plain, reader, error));
+	return nullptr != loaded;
+}
+
+static void testArchive(const char *name, const std::vector<unsigned char> &archive, const std::vector<unsigned char> &data, uint64_t blocks, bool uniform) {
+	std::string path = testPath(name), sidecarPath = testPath((std::string(name) + ".idx").c_str()), error;
+	writeTestFile(path, archive);
+
+	File plain(new MMappedFile(path.c_str(), error));
+	CHECK_OK(error.empty(), error);
+
+	for (int lazy = 0; lazy <= 1; ++lazy) {
+		std::unique_ptr<XZBlockTable> table(XZBlockTable::load(plain, UINT64_MAX, lazy, error));
+		CHECK_OK(nullptr != table, error);
+		if (!table) continue;
+		checkTable(*table, archive, data.size(), blocks);
+		/* lazy tables build the block lists of the streams on demand */
+		if (!lazy) CHECK(uniform == (0 != table->uniformBlockSize()));
+
+		std::shared_ptr<XZFile> file(new XZFile(plain, error, lazy ? XZFile::LAZY_INDEX : 0));
+		CHECK_OK(file->valid(), error);
+		CHECK(compareFile(file, data));
+		CHECK(compareRandomReads(file, data, 500, 300000));
+	}
+
+	/* sidecar: the same table, loaded without parsing the archive */
+	std::unique_ptr<XZBlockTable> table(XZBlockTable::load(plain, UINT64_MAX, false, error));
+	if (!table) return;
+	SidecarWriter writer;
+	CHECK_OK(table->save(writer, error), error);
+	CHECK_OK(writer.write(sidecarPath.c_str(), plain, SIDECAR_XZ, error), error);
+
+	SidecarReader reader;
+	CHECK_OK(reader.open(sidecarPath.c_str(), plain, SIDECAR_XZ, error), error);
+	std::unique_ptr<XZBlockTable> loaded(XZBlockTable::load(plain, reader, error));
+	CHECK_OK(nullptr != loaded, error);
+	if (loaded) {
+		checkTable(*loaded, archive, data.size(), blocks);
+		XZBlock a, b;
+		for (uint64_t i = 0; i < table->blocks(); ++i) {
+			CHECK(table->get(i, a) && loaded->get(i, b));
+			CHECK(a.compressedOffset == b.compressedOffset && a.totalSize == b.totalSize);
+			CHECK(a.uncompressedOffset == b.uncompressedOffset && a.uncompressedSize == b.uncompressedSize);
+		}
+	}
+
+	if (uniform) {
+		/* the single stream archive (loadCorrupted() writes one stream) */
+		std::string corruptPath = testPath("corrupt.idx");
+		CHECK(loadCorrupted(plain, *table, corruptPath, NONE));
+		CHECK(!loadCorrupted(plain, *table, corruptPath, COMPRESSED_ORDER));
+		CHECK(!loadCorrupted(plain, *table, corruptPath, UNCOMPRESSED_ORDER));
+		CHECK(!loadCorrupted(plain, *table, corruptPath, UNCOMPRESSED_END));
+		CHECK(!loadCorrupted(plain, *table, corruptPath, BLOCKS_END));
+
+		/* XZFile falls back to the index in the archive */
+		loadCorrupted(plain, *table, corruptPath, COMPRESSED_ORDER);
+		std::shared_ptr<XZFile> file(new XZFile(plain, corruptPath.c_str(), error));
+		CHECK_OK(file->valid(), error);
+		CHECK(compareFile(file, data));
+	}
+
+	std::shared_ptr<XZFile> file(new XZFile(plain, error));
+	CHECK_OK(file->writeSidecar(sidecarPath.c_str(), error), error);
+	file.reset(new XZFile(plain, sidecarPath.c_str(), error));
+	CHECK_OK(file->valid(), error);
+	CHECK(compareFile(file, data));
+	CHECK(compareRandomReads(file, data, 200, 100000));
+}
+
+int main() {
+	std::vector<unsigned char> data = integerData(3 * 1024 * 1024 + 12345, 1);
+	std::vector<unsigned char> noise = randomData(200000, 2);
+	data.insert(data.begin() + 1000000, noise.begin(), noise.end());
+
+	/* single stream with uniform blocks (the last one shorter) */
+	std::vector<unsigned char> single = xzCompress(data.data(), data.size(), 65536, LZMA_CHECK_CRC64);
+	CHECK(!single.empty());
+	testArchive("single.xz", single, data, (data.size() + 65535) / 65536, true);
+
+	/* three concatenated streams with different block sizes, checks and stream padding */
+	size_t split1 = 1000003, split2 = 2500000;
+	std::vector<unsigned char> multi = xzCompress(data.data(), split1, 100000, LZMA_CHECK_CRC32);
+	std::vector<unsigned char> part = xzCompress(data.data() + split1, split2 - split1, 250000, LZMA_CHECK_SHA256);
+	multi.insert(multi.end(), 8, 0);
+	multi.insert(multi.end(), part.begin(), part.end());
+	part = xzCompress(data.data() + split2, data.size() - split2, 40000, LZMA_CHECK_NONE);
+	multi.insert(multi.end(), part.begin(), part.end());
+	uint64_t blocks = (split1 + 99999) / 100000 + (split2 - split1 + 249999) / 250000 + (data.size() - split2 + 39999) / 40000;
+	testArchive("multi.xz", multi, data, blocks, false);
+
+	/* more than 2^20 blocks fit into the default 16 MiB limit of XZFile (about 4.2 bytes per block) */
+	{
+		uint64_t count = 1100000;
+		std::vector<unsigned char> many = xzRepeatBlock(16, count);
+		CHECK(!many.empty());
+		std::string path = testPath("many.xz"), error;
+		writeTestFile(path, many);
+		File plain(new MMappedFile(path.c_str(), error));
+		for (int lazy = 0; lazy <= 1; ++lazy) {
+			std::unique_ptr<XZBlockTable> table(XZBlockTable::load(plain, 16 * 1024 * 1024, lazy, error));
+			CHECK_OK(nullptr != table, error);
+			if (!table) continue;
+			CHECK(table->blocks() == count);
+			XZBlock block;
+			CHECK(table->locate(16 * count - 1, block) && count - 1 == block.number);
+			if (!lazy) CHECK(16 == table->uniformBlockSize());
+			CHECK(table->memoryUsage() < 16 * 1024 * 1024);
+		}
+		std::shared_ptr<XZFile> file(new XZFile(plain, error));
+		CHECK_OK(file->valid(), error);
+		std::vector<unsigned char> buf(100000), zeros(buf.size(), 0);
+		CHECK_OK(file->pread(16 * count - buf.size(), buf.size(), buf.data(), error), error);
+		CHECK(buf == zeros);
+	}
+
+	return testResult();
+}
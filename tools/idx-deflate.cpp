@@ -1,142 +1,190 @@
 
-#include "../lib/file.h"
+#include "../lib/idx-defl-writer.h"
+#include "../lib/worker-pool.h"
 
+#include <algorithm>
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <algorithm>
+#include <vector>
 
-#include <arpa/inet.h>
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
-#include <zlib.h>
+/* size of the reads from the input */
+#define INPUT_BUFFER_SIZE (1024*1024)
+/* input sampled to train a preset dictionary (from the start of pipes, spread over files) */
+#define DICT_SAMPLE_SIZE (8*1024*1024)
 
-static void dowrite(int fd, const unsigned char *data, ssize_t datalen) {
-	while (datalen > 0) {
-		ssize_t r = write(fd, data, datalen);
+/* read up to size bytes (less only at the end of the input) */
+static size_t readFull(int fd, unsigned char *data, size_t size, int64_t offset = -1) {
+	size_t have = 0;
+	while (have < size) {
+		ssize_t r = (offset >= 0) ? pread(fd, data + have, size - have, offset + have) : read(fd, data + have, size - have);
 		if (r < 0) {
-			std::cerr << "write failed: " << strerror(errno) << "\n";
+			if (EINTR == errno) continue;
+			std::cerr << "failed to read data: " << strerror(errno) << "\n";
 			exit(1);
 		}
-		datalen -= r;
-		data += r;
+		if (0 == r) break;
+		have += r;
 	}
+	return have;
 }
 
-static uint32_t store(int fd, const unsigned char *data, ssize_t datasize) {
-	z_stream strm;
-	memset(&strm, 0, sizeof(strm));
-
-	unsigned char outbuf[4096];
-
-	uint32_t complen = 0;
-
-	strm.next_in = const_cast<unsigned char*>(data);
-	strm.avail_in = datasize;
-
-	deflateInit2(&strm, 7, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY);
-	for (;;) {
-		strm.next_out = outbuf;
-		strm.avail_out = sizeof(outbuf);
-		int ret = deflate(&strm, Z_FINISH);
-		int have = sizeof(outbuf) - strm.avail_out;
-		complen += have;
-		dowrite(fd, outbuf, have);
-
-		if (ret == Z_STREAM_END) break;
-		if (ret != Z_OK) {
-			std::cerr << "deflate failed: " << ret << "\n";
-			exit(1);
-		}
-	}
-	deflateEnd(&strm);
-
-	return complen;
+static void usage(const char *prog) {
+	std::cerr << "syntax: " << prog << " [-T threads] [-b blocksize] [-l level] [-f] [-V version] [-C] [-D dictsize] [-o output] filename\n";
+	std::cerr << "  filename - reads from stdin; the archive is written to filename.idxdefl (stdout for stdin) unless -o is given (- for stdout)\n";
+	std::cerr << "  -T: compress the blocks on that many threads (default: one per core); the output doesn't depend on it\n";
+	std::cerr << "  -b: uncompressed block size (default: " << IDXDEFL_DEFAULT_BLOCK_SIZE << ")\n";
+	std::cerr << "  -l: zlib compression level (default: " << IDXDEFL_DEFAULT_LEVEL << ")\n";
+	std::cerr << "  -f: overwrite an existing archive\n";
+	std::cerr << "  -V: format version 1 (default) or 2 (raw deflate blocks, 64-bit sizes, stored / zero / repeated blocks)\n";
+	std::cerr << "  -C: store CRC32C checksums of the blocks (needs -V 2)\n";
+	std::cerr << "  -D: train a preset dictionary of that many bytes (up to " << IDXDEFL_MAX_DICTIONARY << ") for all blocks (needs -V 2)\n";
+	exit(1);
 }
 
 int main(int argc, char **argv) {
-	if (argc < 2) {
-		std::cerr << "syntax: " << argv[0] << " filename\n";
-		exit(1);
+	unsigned int threads = 0;
+	uint32_t blocksize = IDXDEFL_DEFAULT_BLOCK_SIZE;
+	int level = IDXDEFL_DEFAULT_LEVEL;
+	bool overwrite = false;
+	int version = IDXDEFL_VERSION_1;
+	int checksumType = IDXDEFL_CHECKSUM_NONE;
+	size_t dictSize = 0;
+	std::string outFilename;
+
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "T:b:l:fV:CD:o:"))) {
+		switch (opt) {
+		case 'T': threads = atoi(optarg); break;
+		case 'b': blocksize = strtoul(optarg, nullptr, 0); break;
+		case 'l': level = atoi(optarg); break;
+		case 'f': overwrite = true; break;
+		case 'V': version = atoi(optarg); break;
+		case 'C': checksumType = IDXDEFL_CHECKSUM_CRC32C; break;
+		case 'D': dictSize = strtoul(optarg, nullptr, 0); break;
+		case 'o': outFilename = optarg; break;
+		default: usage(argv[0]);
+		}
 	}
+	if (argc != optind + 1) usage(argv[0]);
 
 	std::string error;
 
-	std::string inFilename = argv[1];
-	std::shared_ptr<NormalFile> file(new MMappedFile(inFilename.c_str(), error));
-	if (!file->valid()) {
-		std::cerr << "couldn't open file: " << error << "\n";
+	std::string inFilename = argv[optind];
+	int infd = 0;
+	if ("-" != inFilename) {
+		infd = open(inFilename.c_str(), O_RDONLY);
+		if (-1 == infd) {
+			std::cerr << "couldn't open file: " << strerror(errno) << "\n";
+			exit(1);
+		}
+	}
+	if (outFilename.empty()) outFilename = ("-" == inFilename) ? std::string("-") : inFilename + std::string(".idxdefl");
+
+	/* total size for the progress (unknown for pipes) */
+	int64_t filesize = -1;
+	struct stat st;
+	if (0 == fstat(infd, &st) && S_ISREG(st.st_mode)) filesize = st.st_size;
+
+	bool toStdout = ("-" == outFilename);
+	WorkerPool pool(threads);
+	std::unique_ptr<IndexedDeflateWriter> writer(toStdout
+		? new IndexedDeflateWriter(1, blocksize, level, Z_DEFAULT_STRATEGY, error)
+		: new IndexedDeflateWriter(outFilename.c_str(), overwrite, blocksize, level, Z_DEFAULT_STRATEGY, error));
+	if (!writer->valid()) {
+		std::cerr << "couldn't create archive: " << error << "\n";
 		exit(1);
 	}
-
-	uint32_t blocksize = 64*1024;
-	int64_t filesize = file->filesize();
-	int64_t blocks = (filesize + blocksize - 1) / blocksize;
-
-	std::string outFilename = inFilename + std::string(".idxdefl");
-
-	int fd = open(outFilename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
-
-	if (-1 == fd) {
-		std::cerr << "couldn't create file: " << strerror(errno) << "\n";
+	writer->setWorkerPool(&pool);
+	if (!writer->setFormat(version, checksumType, error)) {
+		std::cerr << "couldn't create archive: " << error << "\n";
 		exit(1);
 	}
 
-	/* header: "idxdefl\0" */
-	/* big endian footer: <index size> <block size> <full blocks> <last block size> */
-	static const unsigned char magic_header[8] = "idxdefl";
-
-	write(fd, magic_header, sizeof(magic_header));
-
-	uint32_t *index = new uint32_t[blocks-1];
-	uint32_t blockndx = 0;
-	int64_t pos = 0;
-	uint32_t lastBlocksize = 0;
+	/* pipes: the samples are the start of the input, and are compressed first */
+	std::vector<unsigned char> pending;
+	if (dictSize > 0) {
+		std::vector<unsigned char> samples;
+		if (filesize >= 0) {
+			int64_t blocks = (filesize + blocksize - 1) / blocksize;
+			int64_t sampleBlocks = std::min<int64_t>(blocks, std::max<int64_t>(1, DICT_SAMPLE_SIZE / blocksize));
+			for (int64_t i = 0; i < sampleBlocks; ++i) {
+				size_t have = samples.size();
+				samples.resize(have + blocksize);
+				samples.resize(have + readFull(infd, samples.data() + have, blocksize, (i * blocks / sampleBlocks) * blocksize));
+			}
+		} else {
+			pending.resize(DICT_SAMPLE_SIZE);
+			pending.resize(readFull(infd, pending.data(), pending.size()));
+		}
+		const std::vector<unsigned char> &data = (filesize >= 0) ? samples : pending;
 
-	FileReader reader(file);
+		std::vector<unsigned char> dictionary;
+		IndexedDeflateWriter::trainDictionary(data.data(), data.size(), blocksize, dictSize, dictionary);
+		if (!dictionary.empty() && !writer->setDictionary(dictionary.data(), dictionary.size(), error)) {
+			std::cerr << "couldn't create archive: " << error << "\n";
+			exit(1);
+		}
+		if (!pending.empty() && !writer->write(pending.data(), pending.size(), error)) {
+			std::cerr << "couldn't write archive: " << error << "\n";
+			exit(1);
+		}
+	}
 
-	int64_t compressedSize = 24;
-	printf("Progress: %i, Ratio: %0.2f", (int) (100 * (int64_t)blockndx / blocks), 0.);
+	/* progress goes to stdout, unless the archive does */
+	bool progress = !toStdout;
+	int lastProgress = -1;
 
-	while (pos < filesize) {
-		const unsigned char *data;
-		ssize_t datasize;
-		if (!reader.read(std::min<int64_t>(blocksize, reader.length()), data, datasize)) {
-			std::cerr << "failed to read data: " << reader.lastError() << "\n";
+	std::vector<unsigned char> buffer(INPUT_BUFFER_SIZE);
+	for (;;) {
+		ssize_t r = read(infd, buffer.data(), buffer.size());
+		if (r < 0) {
+			if (EINTR == errno) continue;
+			std::cerr << "failed to read data: " << strerror(errno) << "\n";
 			exit(1);
 		}
-		// std::cerr << "read block with size: " << datasize << "\n";
+		if (0 == r) break;
 
-		uint32_t complen = store(fd, data, datasize);
-		compressedSize += complen;
+		if (!writer->write(buffer.data(), r, error)) {
+			std::cerr << "couldn't write archive: " << error << "\n";
+			exit(1);
+		}
 
-		// std::cerr << "stored block with size: " << complen << "\n";
+		int64_t pos = writer->uncompressedSize();
+		int percent = (filesize > 0) ? (int) (100 * std::min(pos, filesize) / filesize) : (int) (pos >> 20);
+		if (progress && percent != lastProgress) {
+			lastProgress = percent;
+			if (filesize >= 0) {
+				printf("\rProgress: %i, Ratio: %0.2f", percent, writer->compressedSize() / (double) pos);
+			} else {
+				printf("\rProgress: %i MiB, Ratio: %0.2f", percent, writer->compressedSize() / (double) pos);
+			}
+			fflush(stdout);
+		}
+	}
 
-		pos += datasize;
-		if (pos < filesize) {
-			index[blockndx++] = htonl(complen);
+	if (!writer->finish(error)) {
+		std::cerr << "couldn't write archive: " << error << "\n";
+		exit(1);
+	}
+	if (progress) {
+		double ratio = writer->compressedSize() / (double) std::max<int64_t>(1, writer->uncompressedSize());
+		if (filesize >= 0) {
+			printf("\rProgress: 100, Ratio: %0.2f\n", ratio);
 		} else {
-			lastBlocksize = datasize;
+			printf("\rProgress: %i MiB, Ratio: %0.2f\n", (int) (writer->uncompressedSize() >> 20), ratio);
 		}
-		printf("\rProgress: %i, Ratio: %0.2f", (int) (100 * (int64_t)blockndx / blocks), compressedSize / (double) pos);
 	}
-	printf("\n");
-
-	uint32_t indexsize = store(fd, (const unsigned char*) index, 4 * (blocks - 1));
 
-	uint32_t footer[4];
-	footer[0] = htonl(indexsize);
-	footer[1] = htonl(blocksize);
-	footer[2] = htonl(blocks - 1);
-	footer[3] = htonl(lastBlocksize);
-
-	dowrite(fd, (const unsigned char*) footer, sizeof(footer));
-	close(fd);
+	if (0 != infd) close(infd);
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -52,10 +52,9 @@ int main(int argc, char **argv) {
 
 	FileReader reader(file);
 	while (reader.length() > 0) {
-		int want = std::min<int64_t>(4096, reader.length());
 		const unsigned char *data;
 		ssize_t datasize;
-		if (!reader.read(want, data, datasize)) {
+		if (!reader.readBlock(data, datasize)) {
 			std::cerr << "read failed: " << reader.lastError() << "\n";
 			exit(1);
 		}
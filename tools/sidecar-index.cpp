@@ -0,0 +1,59 @@
+
+#include "../lib/idx-defl-file.h"
+#include "../lib/xz-file.h"
+
+#include <iostream>
+#include <string>
+
+#include <string.h>
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "syntax: " << argv[0] << " archive [sidecar]\n";
+		std::cerr << "  writes the block table of an xz or idxdefl archive to sidecar (default: archive.sidx)\n";
+		exit(1);
+	}
+
+	std::string error;
+
+	std::string inFilename = argv[1];
+	std::string outFilename = (argc > 2) ? argv[2] : inFilename + ".sidx";
+
+	std::shared_ptr<NormalFile> plainfile(new MMappedFile(inFilename.c_str(), error));
+	if (!plainfile->valid()) {
+		std::cerr << "couldn't open file: " << error << "\n";
+		exit(1);
+	}
+
+	static const unsigned char idxdeflMagic[8] = { 'i', 'd', 'x', 'd', 'e', 'f', 'l', 0 };
+	unsigned char magic[8];
+	FileReaderState *state = nullptr;
+	bool isIdxDefl = plainfile->filesize() >= (int64_t) sizeof(magic)
+		&& plainfile->readInto(state, 0, sizeof(magic), magic, error)
+		&& 0 == memcmp(magic, idxdeflMagic, sizeof(magic) - 1); /* last byte: format version */
+	plainfile->finish(state);
+
+	bool success;
+	if (isIdxDefl) {
+		std::shared_ptr<IndexedDeflateFile> file(new IndexedDeflateFile(plainfile, error));
+		if (!file->valid()) {
+			std::cerr << "couldn't open archive: " << error << "\n";
+			exit(1);
+		}
+		success = file->writeSidecar(outFilename.c_str(), error);
+	} else {
+		std::shared_ptr<XZFile> file(new XZFile(plainfile, error));
+		if (!file->valid()) {
+			std::cerr << "couldn't open archive: " << error << "\n";
+			exit(1);
+		}
+		success = file->writeSidecar(outFilename.c_str(), error);
+	}
+
+	if (!success) {
+		std::cerr << "couldn't write sidecar index: " << error << "\n";
+		exit(1);
+	}
+
+	return 0;
+}